@@ -0,0 +1,363 @@
+// entity_bench: runs the benchmark scripts and compares them to a baseline.
+//
+// every script's main() returns the number of operations it performed.
+// each script runs `--runs` times as `entity --stats <script>`, the fastest
+// run is kept. results are printed as csv:
+//
+//   name,runs,ops,ns_per_op,allocs,peak_rss_kb,baseline_ns_per_op,change_pct,status
+//
+// a script is a regression when it is more than `--threshold` percent
+// slower than the baseline, or allocates that much more than it did.
+// the exit code is 1 if any script regressed. timings only compare on
+// the machine they were taken on, the baseline is recorded locally
+// with --save.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define ERROR(...) do { fprintf(stderr, __VA_ARGS__); exit(-1); } while(0);
+#define MAX_BENCHES 64
+#define MAX_NAME_LEN 64
+#define LEX_LARGE_FUNCS 5000
+
+typedef struct result
+{
+    char name[MAX_NAME_LEN];
+    long long ops;
+    double ns_per_op;
+    long long allocs;
+    long peak_rss_kb;
+} result;
+
+typedef struct baseline
+{
+    result results[MAX_BENCHES];
+    int count;
+} baseline;
+
+typedef struct buffer
+{
+    char* data;
+    size_t len;
+    size_t cap;
+} buffer;
+
+// reads what's there, returns 0 at the end
+int read_some(int fd, buffer* b)
+{
+    if (b->cap - b->len < 4096)
+    {
+        b->cap = b->cap ? b->cap * 2 : 8192;
+        b->data = realloc(b->data, b->cap);
+    }
+    ssize_t n = read(fd, b->data + b->len, b->cap - b->len - 1);
+    if (n > 0)
+        b->len += n;
+    b->data[b->len] = 0;
+    return n > 0;
+}
+
+// both pipes until they're closed, a child blocked on a full stderr
+// would never close stdout
+void read_all(int out_fd, int err_fd, buffer* out, buffer* err)
+{
+    struct pollfd fds[2] = { { out_fd, POLLIN, 0 }, { err_fd, POLLIN, 0 } };
+    buffer* bufs[2] = { out, err };
+    int open = 2;
+    while (open > 0)
+    {
+        if (poll(fds, 2, -1) == -1)
+            continue;
+        for (int i = 0; i < 2; i++)
+        {
+            if (fds[i].revents && !read_some(fds[i].fd, bufs[i]))
+            {
+                fds[i].fd = -1;
+                open--;
+            }
+        }
+    }
+}
+
+// main()'s result is the number at the end of stdout
+long long last_number(const char* out)
+{
+    const char* end = out + strlen(out);
+    while (end > out && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
+    const char* beg = end;
+    while (beg > out && beg[-1] >= '0' && beg[-1] <= '9')
+        beg--;
+    if (beg > out && beg[-1] == '-')
+        beg--;
+    return beg == end ? 0 : atoll(beg);
+}
+
+long long stat_value(const char* err, const char* key)
+{
+    const char* p = strstr(err, key);
+    return p ? atoll(p + strlen(key)) : -1;
+}
+
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// runs the script once, returns elapsed nanoseconds
+double run_once(const char* entity, const char* script, result* r)
+{
+    int out[2], err[2];
+    if (pipe(out) == -1 || pipe(err) == -1)
+    {
+        ERROR("pipe failed\n");
+    }
+
+    double start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(out[1], 1);
+        dup2(err[1], 2);
+        close(out[0]);
+        close(err[0]);
+        execl(entity, entity, "--stats", script, (char*)NULL);
+        _exit(127);
+    }
+    close(out[1]);
+    close(err[1]);
+
+    buffer out_buf = { 0 };
+    buffer err_buf = { 0 };
+    read_all(out[0], err[0], &out_buf, &err_buf);
+    char* stdout_text = out_buf.data;
+    char* stderr_text = err_buf.data;
+    close(out[0]);
+    close(err[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    double elapsed = now_ns() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        ERROR("%s failed:\n%s%s\n", script, stderr_text, stdout_text);
+    }
+
+    r->ops = last_number(stdout_text);
+    r->allocs = stat_value(stderr_text, "allocs=");
+    r->peak_rss_kb = usage.ru_maxrss;
+
+    free(stdout_text);
+    free(stderr_text);
+    return elapsed;
+}
+
+void run_bench(const char* entity, const char* script, const char* name, int runs, result* r)
+{
+    double best = 0;
+    long peak = 0;
+
+    for (int i = 0; i < runs; i++)
+    {
+        double ns = run_once(entity, script, r);
+        if (i == 0 || ns < best)
+            best = ns;
+        if (r->peak_rss_kb > peak)
+            peak = r->peak_rss_kb;
+    }
+
+    snprintf(r->name, MAX_NAME_LEN, "%s", name);
+    r->peak_rss_kb = peak;
+    r->ns_per_op = best / (r->ops > 0 ? r->ops : 1);
+}
+
+// a large source of many small functions, for lexing and registration
+void write_lex_large(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+    {
+        ERROR("can't write %s\n", path);
+    }
+    for (int i = 0; i < LEX_LARGE_FUNCS; i++)
+    {
+        fprintf(f,
+            "int f%d(int a, int b)\n"
+            "{\n"
+            "    int c = a + b * 2;\n"
+            "    if (c > 10)\n"
+            "    {\n"
+            "        c = c - 10;\n"
+            "    }\n"
+            "    return c;\n"
+            "}\n\n", i);
+    }
+    fprintf(f, "int main()\n{\n    return %d;\n}\n", LEX_LARGE_FUNCS);
+    fclose(f);
+}
+
+// name,ns_per_op,allocs,peak_rss_kb per line, '#' starts a comment
+void load_baseline(const char* path, baseline* b)
+{
+    b->count = 0;
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) && b->count < MAX_BENCHES)
+    {
+        result* r = &b->results[b->count];
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%63[^,],%lf,%lld,%ld", r->name, &r->ns_per_op, &r->allocs, &r->peak_rss_kb) == 4)
+            b->count++;
+    }
+    fclose(f);
+}
+
+void save_baseline(const char* path, result* results, int count)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+    {
+        ERROR("can't write %s\n", path);
+    }
+    fprintf(f, "# name,ns_per_op,allocs,peak_rss_kb\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(f, "%s,%.1f,%lld,%ld\n", results[i].name, results[i].ns_per_op,
+            results[i].allocs, results[i].peak_rss_kb);
+    }
+    fclose(f);
+}
+
+result* find_result(baseline* b, const char* name)
+{
+    for (int i = 0; i < b->count; i++)
+    {
+        if (!strcmp(b->results[i].name, name))
+            return &b->results[i];
+    }
+    return NULL;
+}
+
+int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* entity = "./entity";
+    const char* baseline_path = NULL;
+    const char* save_path = NULL;
+    const char* dir = NULL;
+    int runs = 5;
+    double threshold = 10.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--entity") && i + 1 < argc)
+            entity = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (!strcmp(argv[i], "--save") && i + 1 < argc)
+            save_path = argv[++i];
+        else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (dir == NULL)
+            dir = argv[i];
+        else
+            dir = NULL, i = argc;
+    }
+
+    if (dir == NULL || runs < 1)
+    {
+        ERROR("usage: entity_bench [--entity <path>] [--baseline <csv>] [--save <csv>] "
+              "[--runs <n>] [--threshold <percent>] <bench dir>\n");
+    }
+
+    // every *.txt in the bench directory, in name order
+    char* scripts[MAX_BENCHES];
+    int n_scripts = 0;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+    {
+        ERROR("no such directory: %s\n", dir);
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) && n_scripts < MAX_BENCHES - 1)
+    {
+        size_t len = strlen(ent->d_name);
+        if (len > 4 && !strcmp(ent->d_name + len - 4, ".txt"))
+            scripts[n_scripts++] = strdup(ent->d_name);
+    }
+    closedir(d);
+    qsort(scripts, n_scripts, sizeof(char*), &compare_names);
+
+    baseline base;
+    load_baseline(baseline_path ? baseline_path : "", &base);
+    if (baseline_path != NULL && base.count == 0)
+    {
+        fprintf(stderr, "no baseline in %s, record one with --save\n", baseline_path);
+    }
+
+    result results[MAX_BENCHES];
+    int count = 0;
+    char path[4096];
+
+    for (int i = 0; i < n_scripts; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, scripts[i]);
+        scripts[i][strlen(scripts[i]) - 4] = 0;
+        run_bench(entity, path, scripts[i], runs, &results[count++]);
+    }
+
+    write_lex_large("lex_large.txt");
+    run_bench(entity, "lex_large.txt", "lex_large", runs, &results[count++]);
+
+    int regressions = 0;
+    printf("name,runs,ops,ns_per_op,allocs,peak_rss_kb,baseline_ns_per_op,change_pct,status\n");
+    for (int i = 0; i < count; i++)
+    {
+        result* r = &results[i];
+        result* b = find_result(&base, r->name);
+        const char* status = "new";
+        double change = 0;
+
+        if (b != NULL)
+        {
+            change = (r->ns_per_op / b->ns_per_op - 1) * 100;
+            status = "ok";
+            double more_allocs = b->allocs > 0 ? ((double)r->allocs / b->allocs - 1) * 100 : 0;
+            if (change > threshold || more_allocs > threshold)
+            {
+                status = "regression";
+                regressions++;
+            }
+        }
+
+        printf("%s,%d,%lld,%.1f,%lld,%ld,%.1f,%.1f,%s\n", r->name, runs, r->ops,
+            r->ns_per_op, r->allocs, r->peak_rss_kb, b ? b->ns_per_op : 0, change, status);
+    }
+
+    if (save_path != NULL)
+    {
+        save_baseline(save_path, results, count);
+    }
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "lexer.h"
+#include "coro.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// x86-64 switches with coro_switch() below, swapcontext() makes a
+// sigprocmask() syscall on every switch. asan only knows swapcontext().
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN
+#endif
+#endif
+#if !defined(_WIN32) && defined(__x86_64__) && defined(__ELF__) && !defined(CORO_ASAN)
+#define CORO_SWITCH
+#elif !defined(_WIN32)
+#include <ucontext.h>
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define ERROR(...) do { fail(__VA_ARGS__); } while(0);
+
+typedef struct coro
+{
+    struct coro* prev;      // the coroutine that resumed this one
+    void (*fn)(void*);
+    void* arg;
+    int finished;
+#ifdef _WIN32
+    void* fiber;
+    void* caller;
+#else
+#ifdef CORO_SWITCH
+    void* sp;               // saved stack pointers, see coro_switch()
+    void* caller;
+#else
+    ucontext_t ctx;
+    ucontext_t caller;
+#endif
+    char* stack;            // the mapping, starting with the guard page
+    size_t mapped;
+#endif
+} coro;
+
+// coroutine running on this thread, NULL on the thread's own stack
+static THREAD_LOCAL coro* current = NULL;
+
+#ifdef _WIN32
+
+static void __stdcall entry(void* arg)
+{
+    coro* c = arg;
+    c->fn(c->arg);
+    c->finished = 1;
+    // a fiber must never return
+    for (;;)
+    {
+        SwitchToFiber(c->caller);
+    }
+}
+
+coro* coro_new(void (*fn)(void*), void* arg, size_t stack_size)
+{
+    coro* c = mem_alloc(sizeof(coro));
+    c->prev = NULL;
+    c->fn = fn;
+    c->arg = arg;
+    c->finished = 0;
+    c->caller = NULL;
+    c->fiber = CreateFiberEx(0, stack_size, FIBER_FLAG_FLOAT_SWITCH, &entry, c);
+    if (c->fiber == NULL)
+    {
+        mem_free(c);
+        ERROR("failed to create coroutine\n");
+    }
+    return c;
+}
+
+void coro_free(coro* c)
+{
+    DeleteFiber(c->fiber);
+    mem_free(c);
+}
+
+void coro_resume(coro* c)
+{
+    if (!IsThreadAFiber())
+    {
+        ConvertThreadToFiber(NULL);
+    }
+    c->prev = current;
+    c->caller = GetCurrentFiber();
+    current = c;
+    SwitchToFiber(c->fiber);
+    current = c->prev;
+}
+
+void coro_yield()
+{
+    SwitchToFiber(current->caller);
+}
+
+#else
+
+// the stack grows down onto a PROT_NONE page, an overflow segfaults
+// instead of writing over whatever is mapped below it
+static char* map_stack(coro* c, size_t stack_size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page - 1) / page * page;
+    c->mapped = stack_size + page;
+    c->stack = mmap(NULL, c->mapped, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    // out of mappings (vm.max_map_count) with thousands of coroutines,
+    // an error the script's request or loop can catch
+    if (c->stack == MAP_FAILED)
+    {
+        mem_free(c);
+        ERROR("failed to create coroutine: %s\n", strerror(errno));
+    }
+    if (mprotect(c->stack, page, PROT_NONE) != 0)
+    {
+        int err = errno;
+        munmap(c->stack, c->mapped);
+        mem_free(c);
+        ERROR("failed to create coroutine: %s\n", strerror(err));
+    }
+    return c->stack + c->mapped;
+}
+
+void coro_free(coro* c)
+{
+    munmap(c->stack, c->mapped);
+    mem_free(c);
+}
+
+#ifdef CORO_SWITCH
+
+// saves the callee-saved registers and the sse/x87 control words on
+// the stack, stores the stack pointer in *from and pops the same from
+// to. the caller saves everything else.
+void coro_switch(void** from, void* to);
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n"
+);
+
+// the first coro_switch() to a coroutine returns here
+static void entry()
+{
+    coro* c = current;
+    c->fn(c->arg);
+    c->finished = 1;
+    // there's nothing to return to
+    for (;;)
+    {
+        coro_switch(&c->sp, c->caller);
+    }
+}
+
+coro* coro_new(void (*fn)(void*), void* arg, size_t stack_size)
+{
+    coro* c = mem_alloc(sizeof(coro));
+    c->prev = NULL;
+    c->fn = fn;
+    c->arg = arg;
+    c->finished = 0;
+    c->caller = NULL;
+
+    // the frame coro_switch() pops: control words, six registers and
+    // entry() as the return address. entry() starts with the stack
+    // aligned as after a call.
+    void** sp = (void**)((uintptr_t)map_stack(c, stack_size) & ~(uintptr_t)15);
+    *--sp = NULL;
+    *--sp = (void*)&entry;
+    for (int i = 0; i < 6; i++)
+    {
+        *--sp = NULL;
+    }
+    --sp;
+    ((uint32_t*)sp)[0] = 0x1f80;    // mxcsr: exceptions masked, round to nearest
+    ((uint16_t*)sp)[2] = 0x037f;    // x87: the same, 64-bit precision
+    c->sp = sp;
+    return c;
+}
+
+void coro_resume(coro* c)
+{
+    c->prev = current;
+    current = c;
+    coro_switch(&c->caller, c->sp);
+    current = c->prev;
+}
+
+void coro_yield()
+{
+    coro* c = current;
+    coro_switch(&c->sp, c->caller);
+}
+
+#else
+
+// makecontext() only passes ints, the coroutine is picked up from `current`.
+static void entry()
+{
+    coro* c = current;
+    c->fn(c->arg);
+    c->finished = 1;
+    // returning continues at uc_link, i.e. the last resumer
+}
+
+coro* coro_new(void (*fn)(void*), void* arg, size_t stack_size)
+{
+    coro* c = mem_alloc(sizeof(coro));
+    c->prev = NULL;
+    c->fn = fn;
+    c->arg = arg;
+    c->finished = 0;
+    char* top = map_stack(c, stack_size);
+
+    if (getcontext(&c->ctx) == -1)
+    {
+        coro_free(c);
+        ERROR("failed to create coroutine\n");
+    }
+    c->ctx.uc_stack.ss_sp = c->stack + (c->mapped - stack_size);
+    c->ctx.uc_stack.ss_size = top - (char*)c->ctx.uc_stack.ss_sp;
+    c->ctx.uc_link = &c->caller;
+    makecontext(&c->ctx, &entry, 0);
+    return c;
+}
+
+void coro_resume(coro* c)
+{
+    c->prev = current;
+    current = c;
+    swapcontext(&c->caller, &c->ctx);
+    current = c->prev;
+}
+
+void coro_yield()
+{
+    swapcontext(&current->ctx, &current->caller);
+}
+
+#endif
+
+#endif
+
+int coro_finished(coro* c)
+{
+    return c->finished;
+}
+
+
+coro* coro_running()
+{
+    return current;
+}
+
+void coro_reset(coro* c)
+{
+    current = c;
+}
\ No newline at end of file
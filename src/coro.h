@@ -0,0 +1,35 @@
+#ifndef ENTITY_CORO_H
+#define ENTITY_CORO_H
+
+#include <stddef.h>
+
+// execution contexts with their own stacks, the interpreter keeps
+// its state on the c stack (block() -> expression() -> call() ...),
+// so a suspended script needs a stack of its own.
+
+typedef struct coro coro;
+
+// fn(arg) starts running on the first coro_resume().
+// stack pages are only committed by the os when touched, the
+// page below the stack is a guard.
+coro* coro_new(void (*fn)(void*), void* arg, size_t stack_size);
+void coro_free(coro* c);
+
+// switch to c, returns when c yields or fn returns.
+void coro_resume(coro* c);
+
+// switch from the running coroutine back to whoever resumed it.
+void coro_yield();
+
+// non-zero once fn has returned.
+int coro_finished(coro* c);
+
+// the coroutine running on this thread, NULL on the thread's own stack.
+coro* coro_running();
+
+// c is running again, after a longjmp() from a coroutine nested in it
+// left those for good (NULL: the thread's own stack). their stacks
+// aren't freed.
+void coro_reset(coro* c);
+
+#endif
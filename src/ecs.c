@@ -0,0 +1,243 @@
+/*************************
+ * ECS Storage
+ *************************/
+
+// `entity --ecs` keeps entities in archetypes: all entities with the
+// same members (names & types) share one table, with a typed array per
+// member. appending a member moves the entity's row to the archetype
+// with one more column.
+//
+// `query (entity e : x, y) { ... }` runs the block for every row of
+// every archetype that has members x and y, table by table.
+
+typedef struct arch_edge
+{
+    struct arch_edge* next;
+    char* name;
+    int type;
+    archetype* to;      // this archetype plus the member
+} arch_edge;
+
+typedef struct archetype
+{
+    struct archetype* next;
+    int n;              // number of members
+    char** names;       // sorted by address, they're pooled
+    int* types;
+    array** columns;
+    array* owners;      // entity of each row
+    arch_edge* edges;
+} archetype;
+
+int ecs_mode = 0;
+archetype* archetypes = NULL;
+archetype* empty_archetype = NULL;
+// running queries on any thread, their tables must not change.
+// thread_queries are the ones this thread runs.
+atomic_int ecs_queries = 0;
+THREAD_LOCAL int thread_queries = 0;
+
+void begin_query()
+{
+    atomic_fetch_add(&ecs_queries, 1);
+    thread_queries++;
+}
+
+void end_query()
+{
+    atomic_fetch_sub(&ecs_queries, 1);
+    thread_queries--;
+}
+
+// an error left this thread's queries above the first n
+void reset_queries(int n)
+{
+    atomic_fetch_sub(&ecs_queries, thread_queries - n);
+    thread_queries = n;
+}
+
+archetype* new_archetype(int n, char** names, int* types)
+{
+    archetype* a = mem_alloc(sizeof(archetype));
+    a->n = n;
+    a->names = mem_alloc((n + 1) * sizeof(char*));
+    a->types = mem_alloc((n + 1) * sizeof(int));
+    a->columns = mem_alloc((n + 1) * sizeof(array*));
+    for (int i = 0; i < n; i++)
+    {
+        a->names[i] = names[i];
+        a->types[i] = types[i];
+        a->columns[i] = make_array(types[i], 0);
+    }
+    a->owners = make_array(TYPE_ENTITY, 0);
+    a->edges = NULL;
+
+    a->next = archetypes;
+    archetypes = a;
+    return a;
+}
+
+int arch_column(archetype* a, char* name)
+{
+    for (int i = 0; i < a->n; i++)
+    {
+        if (a->names[i] == name)
+            return i;
+    }
+    return -1;
+}
+
+// the archetype with the members of `from` plus name
+archetype* arch_with(archetype* from, char* name, int type)
+{
+    for (arch_edge* e = from->edges; e; e = e->next)
+    {
+        if (e->name == name && e->type == type)
+            return e->to;
+    }
+
+    int n = from->n + 1;
+    char** names = mem_alloc(n * sizeof(char*));
+    int* types = mem_alloc(n * sizeof(int));
+    int j = 0;
+    for (int i = 0; i < from->n; i++)
+    {
+        if (j == i && (uintptr_t)name < (uintptr_t)from->names[i])
+        {
+            names[j] = name;
+            types[j++] = type;
+        }
+        names[j] = from->names[i];
+        types[j++] = from->types[i];
+    }
+    if (j < n)
+    {
+        names[j] = name;
+        types[j] = type;
+    }
+
+    archetype* to = archetypes;
+    for (; to; to = to->next)
+    {
+        if (to->n == n
+            && !memcmp(to->names, names, n * sizeof(char*))
+            && !memcmp(to->types, types, n * sizeof(int)))
+            break;
+    }
+    if (to == NULL)
+    {
+        to = new_archetype(n, names, types);
+    }
+    mem_free(names);
+    mem_free(types);
+
+    arch_edge* e = mem_alloc(sizeof(arch_edge));
+    e->name = name;
+    e->type = type;
+    e->to = to;
+    e->next = from->edges;
+    from->edges = e;
+    return to;
+}
+
+// appends a zeroed row owned by e
+int arch_push(archetype* a, entity* e)
+{
+    int row = a->owners->len;
+    for (int i = 0; i < a->n; i++)
+    {
+        resize_array(a->columns[i], row + 1);
+    }
+    resize_array(a->owners, row + 1);
+    ((entity**)a->owners->data)[row] = e;
+    return row;
+}
+
+// the last row takes the place of the removed one
+void arch_remove(archetype* a, int row)
+{
+    int last = a->owners->len - 1;
+    entity** owners = (entity**)a->owners->data;
+    if (row != last)
+    {
+        for (int i = 0; i < a->n; i++)
+        {
+            array* c = a->columns[i];
+            memcpy(c->data + (size_t)row * c->size, c->data + (size_t)last * c->size, c->size);
+        }
+        owners[row] = owners[last];
+        owners[row]->row = row;
+    }
+    for (int i = 0; i < a->n; i++)
+    {
+        a->columns[i]->len = last;
+    }
+    a->owners->len = last;
+}
+
+void check_queries()
+{
+    if (atomic_load(&ecs_queries) > 0)
+    {
+        ERROR("(%d) entities can't gain members or be deleted inside a query\n", lineno);
+    }
+}
+
+void ecs_add(entity* e)
+{
+    if (empty_archetype == NULL)
+    {
+        empty_archetype = new_archetype(0, NULL, NULL);
+    }
+    e->arch = empty_archetype;
+    e->row = arch_push(empty_archetype, e);
+}
+
+void ecs_append(entity* e, char* name, value val)
+{
+    check_queries();
+    archetype* from = e->arch;
+    if (arch_column(from, name) != -1)
+    {
+        ERROR("(%d) member %s already exists\n", lineno, name);
+    }
+
+    archetype* to = arch_with(from, name, val.type);
+    int row = arch_push(to, e);
+    for (int i = 0; i < from->n; i++)
+    {
+        array* src_col = from->columns[i];
+        array* dst_col = to->columns[arch_column(to, from->names[i])];
+        memcpy(dst_col->data + (size_t)row * dst_col->size,
+            src_col->data + (size_t)e->row * src_col->size, src_col->size);
+    }
+    array_set(to->columns[arch_column(to, name)], row, val);
+
+    arch_remove(from, e->row);
+    e->arch = to;
+    e->row = row;
+}
+
+void ecs_remove(entity* e)
+{
+    check_queries();
+    arch_remove(e->arch, e->row);
+    e->arch = NULL;
+}
+
+place ecs_place(entity* e, char* name)
+{
+    int i = arch_column(e->arch, name);
+    if (i == -1)
+    {
+        ERROR("(%d) no such member: %s\n", lineno, name);
+    }
+
+    place p;
+    p.val = NULL;
+    p.arr = e->arch->columns[i];
+    p.index = e->row;
+    p.swizzle = 0;
+    p.member = 1;
+    return p;
+}
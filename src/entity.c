@@ -1,940 +1,2804 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdint.h>
-
-#define ERROR(...) do { printf(__VA_ARGS__); exit(-1); } while(0);
-
-#include "lexer.h"
-
-/*************************
- * Variable Management
- *************************/
-
-#include "value.c"
-
-typedef struct variable
-{
-    struct variable* next;
-    char* name;
-    value val;
-} variable;
-
-typedef struct scope
-{
-    struct scope* parent;
-    variable* beg;
-    variable* end;
-} scope;
-
-scope* scope_beg = NULL; // begining & the global scope
-scope* scope_end = NULL; // current scope
-
-void new_scope()
-{
-    scope* n = malloc(sizeof(scope));
-    n->beg = NULL;
-    n->end = NULL;
-    n->parent = scope_end;
-    scope_end = n;
-    
-    if (scope_beg == NULL) {
-        scope_beg = n;
-    }
-}
-
-void free_variable(variable* v)
-{
-    if (v == NULL)
-        return;
-    free_variable(v->next);
-    free(v);
-}
-
-void exit_scope()
-{
-    scope* orig = scope_end;
-    scope_end = orig->parent;
-    free_variable(orig->beg);
-    free(orig);
-
-    if (scope_end == NULL) {
-        scope_beg = NULL;
-    }
-}
-
-// find variable in variable list
-value* _find_variable(variable* v, const char* name)
-{
-    if (v == NULL)
-        return NULL;
-    if (v->name == name)
-        return &v->val;
-    return _find_variable(v->next, name);
-}
-
-value* find_variable(scope* scp, const char* name)
-{
-    if (scp == NULL)
-        return NULL;
-    value* val = _find_variable(scp->beg, name);
-    if (val != NULL)
-        return val;
-    return find_variable(scp->parent, name);
-}
-
-void new_variable(char* name, value val)
-{
-    if (scope_end == NULL)
-        ERROR("no scope\n");
-
-    // search current scope
-    // use the underscored version cuz it won't search parent scope.
-    if (_find_variable(scope_end->beg, name) != NULL)
-    {
-        //bug: lineno is not accurate if new_variable() call by user.
-        ERROR("(%d) redefinition of variable %s\n", lineno, name);
-    }
-
-    variable* var = malloc(sizeof(variable));
-    var->next = NULL;
-    var->name = name;
-    var->val = val;
-
-    // if it is an uninitialized list
-    if (scope_end->end == NULL)
-    {
-        // initialize it
-        scope_end->beg = var;
-        scope_end->end = var;
-    }
-    else
-    {
-        scope_end->end->next = var;
-        scope_end->end = var;
-    }
-}
-
-// search variable with the given name
-value* get_variable(const char* name)
-{
-    value* val = find_variable(scope_end, name);
-    if (val == NULL)
-        ERROR("(%d) no such variable: %s\n", lineno, name);
-    return val;
-}
-
-/*************************
- * Function Management
- *************************/
-
-typedef struct param
-{
-    struct param* next;
-    int type;
-    char* name;
-} param;
-
-typedef struct function
-{
-    struct function* next;
-    int type; // return type
-    char* name;
-    param* params; // when appending native functions, you need to
-                    // construct this by yourself.
-    //state stat; // token = '{', the start of the function body
-    token_struct* stat;
-    value (*fp)(); // function pointer to native function
-                    // NULL by default. if not NULL, the native
-                    // function will be called, and stat is ignored.
-                    // when fp doesn't return a value, let return_value.type = TYPE_VOID
-} function;
-
-// linked list to global functions
-function* funcs_beg = NULL;
-function* funcs_end = NULL;
-
-function* _find_function(function* fun, const char* name)
-{
-    if (fun == NULL)
-        return NULL;
-    if (fun->name == name)
-        return fun;
-    return _find_function(fun->next, name);
-}
-
-function* find_function(const char* name)
-{
-    return _find_function(funcs_beg, name);
-}
-
-function* get_function(const char* name)
-{
-    function* fun = find_function(name);
-    if (fun == NULL)
-    {
-        ERROR("(%d) no such function %s\n", lineno, name);
-    }
-    return fun;
-}
-
-void new_function(
-    int type, 
-    char* name, 
-    param* params, 
-    token_struct* stat,
-    value (*fp)()
-)
-{
-    if (find_function(name) != NULL)
-    {
-        //bug: lineno it not accurate here.
-        ERROR("(%d) redefinition of function %s\n", lineno, name);
-    }
-
-    function* fun = malloc(sizeof(function));
-    fun->next = NULL;
-    fun->type = type;
-    fun->name = name;
-    fun->params = params;
-    fun->stat = stat;
-    fun->fp = fp;
-
-    if (funcs_end == NULL)
-    {
-        funcs_beg = fun;
-        funcs_end = fun;
-    }
-    else
-    {
-        funcs_end->next = fun;
-        funcs_end = fun;
-    }
-}
-
-/*************************
- * Parser & Interpreter
- *************************/
-
-// allow function call evaluation
-// set to true when global variables are all processed
-//int allow_func_eval = 0;
-
-/*
-exp -> term1 { op1 term1 }
-term1 -> term2 { op2 term2 }
-term2 -> term3 { op3 term3 }
-    ......
-term? -> factor { op? factor }
-factor -> NUM | ref | call | ( exp )
-op1 -> '<' | '>'
-op2 -> '+' | '-'
-op? -> '*' | '/'
-
-the larger the number behind 'op' is, the higher precedence the operators have.
-*/
-
-value factor();
-value term2();
-value term1();
-value expression();
-
-value* reference();
-value call();
-value block();
-
-value factor() {
-    value out;
-    if (token == '(') {
-        match('(');
-        out = expression();
-        match(')');
-    }
-    else if(token == NUM) {
-        out.type = TYPE_INT;
-        out.i32 = token_val.integer;
-        match(NUM);
-    }
-    else if(token == FLT) {
-        out.type = TYPE_FLOAT;
-        out.f32 = token_val.floating;
-        match(FLT);
-    }
-    else if(token == CHR) {
-        out.type = TYPE_CHAR;
-        out.i8 = token_val.integer;
-        match(CHR);
-    }
-    else if(token == STR) {
-        out.type = TYPE_STRING;
-        out.str = token_val.string;
-        match(STR);
-    }
-    else if (token == ID) {
-        token_struct* cur = save();
-
-        match(ID);
-        if (token == '(') {
-            restore(cur);
-            out = call();
-        }
-        else {
-            restore(cur);
-            out = *reference();
-        }
-    }
-    else {
-        ERROR("(%d) unexpected token: %d\n", lineno, token);
-    }
-    return out;
-}
-
-value term2() {
-    value lhs = factor(), rhs;
-    while (token == '*' || token == '/' || token == '%') {
-        if (token == '*') {
-            match('*');
-            rhs = factor();
-            binary_op(&lhs, &lhs, '*', &rhs);
-        }
-        else if (token == '/') {
-            match('/');
-            rhs = factor();
-            binary_op(&lhs, &lhs, '/', &rhs);
-        }
-        else {
-            match('%');
-            rhs = factor();
-            binary_op(&lhs, &lhs, '%', &rhs);
-        }
-    }
-    return lhs;
-}
-
-value term1() {
-    value lhs = term2(), rhs;
-    while (token == '+' || token == '-') {
-        if (token == '+') {
-            match('+');
-            rhs = term2();
-            binary_op(&lhs, &lhs, '+', &rhs);
-        }
-        else {
-            match('-');
-            rhs = term2();
-            binary_op(&lhs, &lhs, '-', &rhs);
-        }
-    }
-    return lhs;
-}
-
-value expression() {
-    value lhs = term1(), rhs;
-    while (token == '<' || token == '>') {
-        if (token == '<') {
-            match('<');
-            rhs = term1();
-            binary_op(&lhs, &lhs, '<', &rhs);
-        }
-        else {
-            match('>');
-            rhs = term1();
-            binary_op(&lhs, &lhs, '>', &rhs);
-        }
-    }
-    return lhs;
-}
-
-// ref -> ID { '.' ID }
-value* reference()
-{
-    char* name = token_val.string;
-    match(ID);
-    value* ref = get_variable(name);
-
-    while(token == '.')
-    {
-        match('.');
-        char* member = token_val.string;
-        match(ID);
-
-        if (ref->type != TYPE_ENTITY)
-        {
-            ERROR("(%d) can't access member of non-entity object\n", lineno);
-        }
-        entity* e = ref->obj;
-        ref = get_member(e, member);
-    }
-
-    return ref;
-}
-
-// 在多重嵌套的block中返回时设为true
-// 这样就能快速跳出递归的block()
-// 每次call()之后设为false
-int retflag = 0;
-
-value call()
-{
-    value ret;
-
-    char* name = token_val.string;
-    match(ID);
-    
-    // get the function and its parameter list
-    function* fun = get_function(name);
-    param* par = fun->params;
-    
-    // find number of arguments we need to pass
-    int n_args = 0;
-    for(param* p = par; p; p = p->next)
-        n_args++;
-
-    scope* bak = scope_end;
-    // 先生成一个新scope，暂时挂到bak下面。
-    new_scope();
-    // 保存新的scope
-    scope* neo = scope_end;
-
-    // number of arguments passed to the function
-    int n_passed = 0;
-
-    match('(');
-    if (token != ')')
-    {
-    NextArg:
-        if (par == NULL)
-        {
-            ERROR("(%d) too many arguments to function %s\n",
-                lineno, name);
-        }
-        // 计算表达式时，切换到原来的scope。
-        scope_end = bak;
-        value val = expression();
-        if (val.type != par->type)
-        {
-            ERROR("(%d) wrong type provided to function %s at pos %d, %s required, but %s provided\n",
-                lineno, name, n_passed+1, type_name(par->type), type_name(val.type));
-        }
-        // 传参时切换到新的scope
-        scope_end = neo;
-        new_variable(par->name, val);
-        par = par->next;
-        n_passed++;
-
-        if (token == ',')
-        {
-            match(',');
-            goto NextArg;
-        }
-    }
-    match(')');
-
-    if (n_passed != n_args)
-    {
-        ERROR("(%d) too few arguments to function %s, %d required, but %d provided\n",
-            lineno, name, n_args, n_passed);
-    }
-
-    // save return address
-    token_struct* cur = save();
-
-    // 传参结束，scope_end=neo,新scope挂到scope_beg下。
-    scope_end->parent = scope_beg;
-    // finally, call it!
-    if (fun->fp != NULL)
-    {
-        ret = fun->fp();
-    }   
-    else
-    {
-        restore(fun->stat);
-        ret = block();
-    }
-
-    if (ret.type != fun->type)
-    {
-        ERROR("(%d) function %s returns wrong type\n", lineno, name);
-    }
-
-    restore(cur);
-
-    exit_scope();
-    scope_end = bak;
-
-    // see begining of call()
-    retflag = 0;
-
-    return ret;
-}
-
-// block -> '{' { stat } '}'
-// stat -> var | call | assign | append
-// var -> TYPE name { ',' name } ';'
-// call -> ID '(' ID ID { ',' ID ID } ')'
-// assign -> ref '=' expr
-// append -> TYPE ID '.' ID '=' expr ';'
-
-void var();
-void skip_block();
-void assign()
-{
-    value* left = reference();
-    match('=');
-    value right = expression();
-    if (left->type != right.type)
-    {
-        ERROR("(%d) assignment on different types\n", lineno);
-    }
-    *left = right;
-}
-
-void append()
-{
-    int type = token_val.type;
-    match(TYPE);
-    char* name = token_val.string;
-    match(ID);
-
-    value var = *get_variable(name);
-
-    match('.');
-
-    char* member = token_val.string;
-    match(ID);
-
-    match('=');
-    value val = expression();
-    type_convert(&val, type);
-    match(';');
-
-    append_member(var, member, val);
-}
-
-int contflag = 0;
-int brkflag = 0;
-
-value block()
-{
-    value ret;
-    memset(&ret, 0, sizeof(value));
-    ret.type = TYPE_VOID;
-
-    match('{');
-    while(token != '}')
-    {
-        token_struct* cur = save();
-
-        // empty statement
-        if (token == ';')
-        {
-            match(';');
-        }
-        // anonymous block
-        else if (token == '{')
-        {
-            new_scope();
-            ret = block();
-            exit_scope();
-            
-            if (retflag)
-            {
-                return ret;
-            }
-        }
-        else if (token == TYPE)
-        {
-            token_struct* cur = save();
-            match(TYPE);
-            match(ID);
-
-            if (token == '.')
-            {
-                restore(cur);
-                append();
-            }
-            else
-            {
-                restore(cur);
-                var();
-            }
-        }
-        else if (token == ID)
-        {
-            match(ID);
-            if (token == '(')
-            {
-                restore(cur);
-                call();
-                match(';');
-            }
-            else
-            {
-                restore(cur);
-                assign();
-                match(';');
-            }
-        }
-        else if (token == IF) {
-        NextIf:
-            match(IF);
-            match('(');
-            value val = expression();
-            match(')');
-
-            // TODO: conversion to bool
-            if (val.i32) {
-                new_scope();
-                ret = block();
-                exit_scope();
-                if (retflag)
-                {
-                    return ret;
-                }
-            }
-            else {
-                skip_block();
-            }
-
-            if (token == ELSE) {
-                match(ELSE);
-                if (!val.i32) {
-                    // improve this, goto is dangerous.
-                    if (token == IF)
-                    {
-                        goto NextIf;
-                    }
-                    else {
-                        new_scope();
-                        ret = block();
-                        exit_scope();
-                        if (retflag)
-                        {
-                            return ret;
-                        }
-                    }
-                }
-                else {
-                    skip_block();
-                }
-            }
-        }
-        else if (token == WHILE) {
-            match(WHILE);
-            match('(');
-            token_struct* w = save();
-            token_struct* sob = NULL; // start of block
-
-        NextWhile:
-            value val = expression();
-            match(')');
-
-            sob = save();
-
-            if (val.i32) {
-                new_scope();
-                ret = block();
-                exit_scope();
-
-                if (retflag)
-                {
-                    return ret;
-                }
-                if (contflag)
-                {
-                    contflag = 0;
-                    restore(w);
-                    goto NextWhile;
-                }
-                if (brkflag)
-                {
-                    brkflag = 0;
-                    restore(sob);
-                    skip_block();
-                    continue; // parse next statment
-                }
-
-                restore(w);
-                goto NextWhile;
-            }
-            else {
-                skip_block();
-            }
-        }
-        else if (token == DO) {
-            match(DO);
-            token_struct *d = save();
-
-        NextDo:
-            new_scope();
-            ret = block();
-            exit_scope();
-            
-            if (retflag)
-            {
-                return ret;
-            }
-            if (contflag)
-            {
-                contflag = 0;
-                restore(d);
-                goto NextDo;
-            }
-            if (brkflag)
-            {
-                brkflag = 0;
-                restore(d); // d is the start of block
-                skip_block();
-                // skip to the ending semicolon of do-while statement
-                while(token != ';') {
-                    next();
-                }
-                match(';');
-                continue; // parse next statment
-            }
-
-            match(WHILE);
-            match('(');
-            value val = expression();
-            match(')');
-            match(';');
-
-            if (val.i32) {
-                restore(d);
-                goto NextDo;
-            }
-        }
-        else if (token == CONTINUE) {
-            match(CONTINUE);
-            match(';');
-            contflag = 1;
-            return ret;
-        }
-        else if (token == BREAK) {
-            match(BREAK);
-            match(';');
-            brkflag = 1;
-            return ret;
-        }
-        else if (token == RETURN) {
-            match(RETURN);
-            if (token == ';')
-            {
-                match(';');
-                retflag = 1;
-                return ret;
-            }
-            else
-            {
-                ret = expression();
-                match(';');
-                retflag = 1;
-                return ret;
-            }
-        }
-    }
-    match('}');
-    return ret;
-}
-
-/*
-program -> { var } { func }
-func -> TYPE ID '(' [ ID ID { ',' ID ID } ] ')' block
-var -> TYPE name { ',' name } ';'
-name -> ID | ID '=' expr
-*/
-
-void var()
-{
-    int type = token_val.type;
-    match(TYPE);
-
-NextVar:
-    char* name = token_val.string;
-    match(ID);
-
-    if (token == '=')
-    {
-        match('=');
-        value val = expression();
-        type_convert(&val, type);
-        new_variable(name, val);
-    }
-    else
-    {
-        value val;
-        memset(&val, 0, sizeof(val));
-        val.type = type;
-        new_variable(name, val);
-    }
-
-    if (token == ',')
-    {
-        match(',');
-        goto NextVar;
-    }
-
-    match(';');
-}
-
-void skip_block()
-{
-    match('{');
-    int count = 0;
-    while (token && !(token == '}' && count == 0)) {
-        if (token == '}') count++;
-        if (token == '{') count--;
-        next();
-    }
-    match('}');
-}
-
-void func()
-{
-    int type = token_val.type;
-    match(TYPE);
-    char* name = token_val.string;
-    match(ID);
-
-    param* params_beg = NULL;
-    param* params_end = NULL;
-    // match params
-    match('(');
-    if (token != ')')
-    {
-    NextParam:
-        int param_type = token_val.type;
-        match(TYPE);
-        char* param_name = token_val.string;
-        match(ID);
-
-        param* p = malloc(sizeof(param));
-        p->next = NULL;
-        p->type = param_type;
-        p->name = param_name;
-        
-        if (params_end == NULL)
-        {
-            params_beg = p;
-            params_end = p;
-        }
-        else
-        {
-            params_end->next = p;
-            params_end = p;
-        }
-
-        if (token == ',')
-        {
-            match(',');
-            goto NextParam;
-        }
-    }
-    match(')');
-
-    token_struct* cur = save();
-
-    skip_block();
-
-    new_function(
-        type,
-        name,
-        params_beg,
-        cur,
-        NULL
-    );
-}
-
-void program()
-{
-    new_scope();
-    //next();
-    init_lex();
-
-    token_struct* cur;
-
-    // process global variables
-    while(token)
-    {
-        cur = save();
-        match(TYPE);
-        match(ID);
-
-        if (token == '=' 
-            || token == ',' 
-            || token == ';')
-        {
-            restore(cur);
-            var();
-        }
-        else {
-            restore(cur);
-            break;
-        }
-    }
-
-    while(token)
-    {
-        func();
-    }
-}
-
-int main(int argc, char* argv[])
-{
-    if (argc != 2)
-    {
-        ERROR("usage: entity <source>\n");
-    }
-
-    FILE *f = fopen(argv[1], "r");
-    if (f == NULL)
-    {
-        ERROR("no such file\n");
-    }
-
-    fseek(f, 0, SEEK_END);
-    int len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char* orig;
-    orig = src = malloc(len+1);
-    memset(src, 0, len+1);
-    fread(src, 1, len, f);
-
-    // register native function(s)
-    new_function(TYPE_ENTITY, pool_add("new"), NULL, NULL, &new_entity);
-    
-    param* p = malloc(sizeof(param));
-    p->next = NULL;
-    p->name = pool_add("e");
-    p->type = TYPE_ENTITY;
-    new_function(TYPE_VOID, pool_add("del"), p, NULL, &del_entity);
-
-    param* p2 = malloc(sizeof(param));
-    p2->next = NULL;
-    p2->name = pool_add("s");
-    p2->type = TYPE_STRING;
-    new_function(TYPE_VOID, pool_add("print"), p2, NULL, &print_str);
-
-    // parse
-    program();
-
-    value result;
-    char* str = find_string("main");
-    function* entry = find_function(str);
-
-    if (entry != NULL) {
-        new_scope();
-        restore(entry->stat);
-        result = block();
-        exit_scope();
-    }
-    else {
-        ERROR("main() not found\n");
-    }
-
-    printf("%d\n", result.i32);
-
-    free(orig);
-    return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+
+// prints the message after the script's output and exits, see output.c
+_Noreturn void fail(const char* fmt, ...);
+#define ERROR(...) do { fail(__VA_ARGS__); } while(0);
+
+#include "lexer.h"
+#include "sched.h"
+#include "coro.h"
+#include "stats.h"
+#include "simd.h"
+
+/*************************
+ * Variable Management
+ *************************/
+
+#include "value.c"
+#include "ecs.c"
+#include "str.c"
+#include "output.c"
+
+typedef struct variable
+{
+    struct variable* next;
+    char* name;
+    slot val;
+} variable;
+
+typedef struct scope
+{
+    struct scope* parent;
+    variable* beg;
+    variable* end;
+} scope;
+
+scope* scope_beg = NULL; // begining & the global scope
+THREAD_LOCAL scope* scope_end = NULL; // current scope
+
+void new_scope()
+{
+    STAT_INC(scopes_entered);
+    scope* n = mem_alloc(sizeof(scope));
+    n->beg = NULL;
+    n->end = NULL;
+    n->parent = scope_end;
+    scope_end = n;
+    
+    if (scope_beg == NULL) {
+        scope_beg = n;
+    }
+}
+
+void free_variable(variable* v)
+{
+    if (v == NULL)
+        return;
+    free_variable(v->next);
+    free_slot(v->val);
+    mem_free(v);
+}
+
+void exit_scope()
+{
+    STAT_INC(scopes_exited);
+    scope* orig = scope_end;
+    scope_end = orig->parent;
+    free_variable(orig->beg);
+    mem_free(orig);
+
+    if (scope_end == NULL) {
+        scope_beg = NULL;
+    }
+}
+
+// find variable in variable list
+slot* _find_variable(variable* v, const char* name)
+{
+    if (v == NULL)
+        return NULL;
+    STAT_INC(var_steps);
+    if (v->name == name)
+        return &v->val;
+    return _find_variable(v->next, name);
+}
+
+slot* find_variable(scope* scp, const char* name)
+{
+    if (scp == NULL)
+        return NULL;
+    STAT_INC(scope_steps);
+    slot* val = _find_variable(scp->beg, name);
+    if (val != NULL)
+        return val;
+    return find_variable(scp->parent, name);
+}
+
+void new_variable(char* name, value val)
+{
+    if (scope_end == NULL)
+        ERROR("no scope\n");
+
+    // search current scope
+    // use the underscored version cuz it won't search parent scope.
+    if (_find_variable(scope_end->beg, name) != NULL)
+    {
+        //bug: lineno is not accurate if new_variable() call by user.
+        ERROR("(%d) redefinition of variable %s\n", lineno, name);
+    }
+
+    variable* var = mem_alloc(sizeof(variable));
+    var->next = NULL;
+    var->name = name;
+    var->val = new_slot(val);
+
+    // if it is an uninitialized list
+    if (scope_end->end == NULL)
+    {
+        // initialize it
+        scope_end->beg = var;
+        scope_end->end = var;
+    }
+    else
+    {
+        scope_end->end->next = var;
+        scope_end->end = var;
+    }
+}
+
+// search variable with the given name
+// a global's slot, not a local's
+int is_global(const slot* s)
+{
+    for (variable* v = scope_beg->beg; v; v = v->next)
+    {
+        if (&v->val == s)
+            return 1;
+    }
+    return 0;
+}
+
+slot* get_variable(const char* name)
+{
+    slot* val = find_variable(scope_end, name);
+    if (val == NULL)
+        ERROR("(%d) no such variable: %s\n", lineno, name);
+    return val;
+}
+
+/*************************
+ * Function Management
+ *************************/
+
+typedef struct param
+{
+    struct param* next;
+    int type;
+    char* name;
+} param;
+
+typedef struct function
+{
+    struct function* next;
+    struct function* hnext; // next in the same bucket of func_table
+    int type; // return type
+    char* name;
+    param* params; // when appending native functions, you need to
+                    // construct this by yourself.
+    //state stat; // token = '{', the start of the function body
+    token_struct* stat;
+    atomic_int compiled; // nested blocks of the body are linked
+    value (*fp)(); // function pointer to native function
+                    // NULL by default. if not NULL, the native
+                    // function will be called, and stat is ignored.
+                    // when fp doesn't return a value, let return_value.type = TYPE_VOID
+} function;
+
+// linked list to global functions
+function* funcs_beg = NULL;
+function* funcs_end = NULL;
+
+// the same functions, hashed by their pooled name
+function** func_table = NULL;
+unsigned func_mask = 0;
+int func_count = 0;
+
+unsigned hash_name(const char* name)
+{
+    uintptr_t h = (uintptr_t)name;
+    return (unsigned)(h ^ (h >> 4) ^ (h >> 12));
+}
+
+void grow_func_table()
+{
+    unsigned size = func_table ? 2 * (func_mask + 1) : 256;
+    function** table = mem_alloc(size * sizeof(function*));
+    memset(table, 0, size * sizeof(function*));
+
+    for (function* fun = funcs_beg; fun; fun = fun->next)
+    {
+        unsigned b = hash_name(fun->name) & (size - 1);
+        fun->hnext = table[b];
+        table[b] = fun;
+    }
+    mem_free(func_table);
+    func_table = table;
+    func_mask = size - 1;
+}
+
+function* _find_function(function* fun, const char* name)
+{
+    while (fun != NULL && fun->name != name)
+        fun = fun->hnext;
+    return fun;
+}
+
+function* find_function(const char* name)
+{
+    if (func_table == NULL)
+        return NULL;
+    return _find_function(func_table[hash_name(name) & func_mask], name);
+}
+
+function* get_function(const char* name)
+{
+    function* fun = find_function(name);
+    if (fun == NULL)
+    {
+        ERROR("(%d) no such function %s\n", lineno, name);
+    }
+    return fun;
+}
+
+function* make_function(
+    int type, 
+    char* name, 
+    param* params, 
+    token_struct* stat,
+    value (*fp)()
+)
+{
+    function* fun = mem_alloc(sizeof(function));
+    fun->next = NULL;
+    fun->hnext = NULL;
+    fun->type = type;
+    fun->name = name;
+    fun->params = params;
+    fun->stat = stat;
+    atomic_init(&fun->compiled, 0);
+    fun->fp = fp;
+    return fun;
+}
+
+void add_function(function* fun)
+{
+    if (find_function(fun->name) != NULL)
+    {
+        //bug: lineno it not accurate here.
+        ERROR("(%d) redefinition of function %s\n", lineno, fun->name);
+    }
+
+    fun->next = NULL;
+    if (funcs_end == NULL)
+    {
+        funcs_beg = fun;
+        funcs_end = fun;
+    }
+    else
+    {
+        funcs_end->next = fun;
+        funcs_end = fun;
+    }
+
+    if (++func_count > (int)func_mask)
+    {
+        // rehashes fun as well
+        grow_func_table();
+    }
+    else
+    {
+        unsigned b = hash_name(fun->name) & func_mask;
+        fun->hnext = func_table[b];
+        func_table[b] = fun;
+    }
+}
+
+// a function added by a reload that failed
+void remove_function(function* fun)
+{
+    function* prev = NULL;
+    function** link = &funcs_beg;
+    while (*link != fun)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = fun->next;
+    if (funcs_end == fun)
+        funcs_end = prev;
+
+    link = &func_table[hash_name(fun->name) & func_mask];
+    while (*link != fun)
+        link = &(*link)->hnext;
+    *link = fun->hnext;
+    func_count--;
+}
+
+// fun takes the place of old, which isn't freed: calls in progress
+// and suspended coroutines go on running its body.
+void replace_function(function* old, function* fun)
+{
+    function** link = &funcs_beg;
+    while (*link != old)
+        link = &(*link)->next;
+    fun->next = old->next;
+    *link = fun;
+    if (funcs_end == old)
+        funcs_end = fun;
+
+    link = &func_table[hash_name(old->name) & func_mask];
+    while (*link != old)
+        link = &(*link)->hnext;
+    fun->hnext = old->hnext;
+    *link = fun;
+}
+
+void new_function(
+    int type, 
+    char* name, 
+    param* params, 
+    token_struct* stat,
+    value (*fp)()
+)
+{
+    add_function(make_function(type, name, params, stat, fp));
+}
+
+#include "math.c"
+
+// functions are compiled on their first call(): the braces of every
+// block in the body get linked, so skip_block() is a single jump.
+// until then only the body itself is linked, by the lexer.
+//
+// for loops are classified then too, the result is kept in the FOR
+// token. a counted loop, for (int i = a; i < b; i = i + k) with no
+// assignment to i in its body, runs with i in a c variable. its bound
+// b is evaluated once if it's only numbers and variables the body
+// can't change: not assigned, and no calls that run script code.
+
+enum { FOR_GENERIC = 1, FOR_COUNTED, FOR_HOISTED };
+
+mtx_t compile_lock;
+// compile_lock is held by this thread, for errors in server requests
+THREAD_LOCAL int compiling = 0;
+
+// what fail() longjmp()ing out of script code has to put back on the
+// thread. the scopes it left are leaked.
+typedef struct thread_state
+{
+    coro* ctx;
+    struct coroutine* running;
+    scope* scope;
+    int queries;
+    struct prof_node* prof;
+} thread_state;
+
+void save_state(thread_state* s);
+void recover_state(const thread_state* s);
+
+value resume_coroutine();
+
+#define IS_RELATION(tk) ((tk) == '<' || (tk) == '>' || (tk) == LE || (tk) == GE)
+#define IS_COMPARE(tk) (IS_RELATION(tk) || (tk) == EQU || (tk) == NEQ)
+
+// does tk end the right operand of op (AND or OR), outside parentheses
+int ends_operand(int op, int tk)
+{
+    return tk == 0 || tk == ')' || tk == ']' || tk == ';' || tk == ',' || tk == ':'
+        || tk == '{' || tk == '}' || tk == OR || (op == AND && tk == AND);
+}
+
+int classify_for(token_struct* t)
+{
+    token_struct* p = t + 1;
+    if (p[0].token != '(' || p[1].token != TYPE || p[1].token_val.type != TYPE_INT
+        || p[2].token != ID || p[3].token != '=')
+        return FOR_GENERIC;
+    char* name = p[2].token_val.string;
+
+    // int i = a;
+    p += 4;
+    for (int depth = 0; p->token != ';' || depth > 0; p++)
+    {
+        if (p->token == 0 || (p->token == ',' && depth == 0))
+            return FOR_GENERIC;
+        depth += (p->token == '(') - (p->token == ')');
+    }
+    p++;
+
+    // i < b;
+    if (p[0].token != ID || p[0].token_val.string != name
+        || !IS_RELATION(p[1].token))
+        return FOR_GENERIC;
+    p += 2;
+    token_struct* bound = p;
+    int invariant = 1;
+    for (; p->token != ';'; p++)
+    {
+        if (p->token == 0)
+            return FOR_GENERIC;
+        if (p->token == ID)
+        {
+            if (p->token_val.string == name || p[1].token == '(' || p[1].token == '.' || p[1].token == '[')
+                invariant = 0;
+        }
+        else if (p->token != NUM && p->token != LNG && p->token != MATH
+            && (p->token >= 128 || !strchr("+-*/(),", p->token)))
+        {
+            invariant = 0;
+        }
+    }
+    token_struct* bound_end = p++;
+
+    // i = i + k)
+    if (p[0].token != ID || p[0].token_val.string != name || p[1].token != '='
+        || p[2].token != ID || p[2].token_val.string != name
+        || (p[3].token != '+' && p[3].token != '-') || p[4].token != NUM || p[5].token != ')'
+        || p[6].token != '{' || p[6].token_val.jump == 0)
+        return FOR_GENERIC;
+    p += 6;
+
+    for (token_struct* q = p; q < p + p->token_val.jump; q++)
+    {
+        if (q->token == YIELD || q->token == PARALLEL)
+        {
+            invariant = 0;
+        }
+        else if (q->token == ID && q[1].token == '=')
+        {
+            if (q->token_val.string == name)
+                return FOR_GENERIC;
+            for (token_struct* b = bound; b < bound_end; b++)
+            {
+                if (b->token == ID && b->token_val.string == q->token_val.string)
+                    invariant = 0;
+            }
+        }
+        else if (q->token == ID && q[1].token == '(')
+        {
+            function* f = find_function(q->token_val.string);
+            if (f == NULL || f->fp == NULL || f->fp == &resume_coroutine)
+                invariant = 0;
+        }
+    }
+    return invariant ? FOR_HOISTED : FOR_COUNTED;
+}
+
+// && and || jump over their right operand when it isn't evaluated
+void link_operands(token_struct* t)
+{
+    for (token_struct* end = t + t->token_val.jump; t < end; t++)
+    {
+        if (t->token != AND && t->token != OR)
+            continue;
+        int depth = 0;
+        token_struct* p = t + 1;
+        for (; depth > 0 || !ends_operand(t->token, p->token); p++)
+        {
+            if (p->token == '(' || p->token == '[')
+                depth++;
+            else if (p->token == ')' || p->token == ']')
+                depth--;
+        }
+        t->token_val.jump = p - t;
+    }
+}
+
+// the cases of a switch. a dense one is a jump table indexed by
+// value - lo, a sparse one is searched. jumps are tokens from the
+// SWITCH to the statement after the label, 0 for none.
+typedef struct switch_table
+{
+    long long lo;
+    int n;
+    int dense;
+    int def;            // default:
+    int* jumps;
+    long long* keys;    // sparse only, sorted
+} switch_table;
+
+typedef struct case_label
+{
+    long long key;
+    int jump;
+} case_label;
+
+int compare_cases(const void* a, const void* b)
+{
+    long long x = ((case_label*)a)->key;
+    long long y = ((case_label*)b)->key;
+    return (x > y) - (x < y);
+}
+
+int is_case_constant(int tk)
+{
+    return tk == NUM || tk == LNG || tk == CHR;
+}
+
+// NULL if the body of the switch at t isn't linked
+switch_table* build_switch(token_struct* t)
+{
+    token_struct* body = t + 1;
+    for (int depth = 0; body->token != ')' || depth > 1; body++)
+    {
+        if (body->token == 0)
+            return NULL;
+        depth += (body->token == '(') - (body->token == ')');
+    }
+    body++;
+    if (body->token != '{' || body->token_val.jump == 0)
+        return NULL;
+
+    int n = 0;
+    int capacity = 16;
+    int def = 0;
+    case_label* labels = mem_alloc(capacity * sizeof(case_label));
+    for (token_struct* q = body + 1; q < body + body->token_val.jump; q++)
+    {
+        // labels of nested switches are in nested blocks
+        if (q->token == '{')
+        {
+            q += q->token_val.jump;
+        }
+        else if (q->token == CASE)
+        {
+            if (!is_case_constant(q[1].token) || q[2].token != ':')
+            {
+                ERROR("(%d) case needs an integer or char constant\n", q->lineno);
+            }
+            if (n == capacity)
+            {
+                capacity *= 2;
+                labels = mem_realloc(labels, capacity * sizeof(case_label));
+            }
+            labels[n].key = q[1].token_val.integer;
+            labels[n].jump = (int)(q + 3 - t);
+            n++;
+        }
+        else if (q->token == DEFAULT)
+        {
+            if (def != 0)
+            {
+                ERROR("(%d) more than one default in switch\n", q->lineno);
+            }
+            def = (int)(q + 2 - t);
+        }
+    }
+
+    if (n > 1)
+    {
+        qsort(labels, n, sizeof(case_label), &compare_cases);
+    }
+    for (int i = 1; i < n; i++)
+    {
+        if (labels[i].key == labels[i - 1].key)
+        {
+            ERROR("(%d) duplicate case %lld in switch\n", t->lineno, labels[i].key);
+        }
+    }
+
+    switch_table* s = mem_alloc(sizeof(switch_table));
+    s->def = def;
+    s->lo = n > 0 ? labels[0].key : 0;
+    // at least half of the table used, or a small one
+    unsigned long long range = n > 0 ? (unsigned long long)labels[n - 1].key - (unsigned long long)s->lo + 1 : 0;
+    s->dense = range <= 16 || range <= 2ULL * n;
+    if (s->dense)
+    {
+        s->n = (int)range;
+        s->jumps = mem_alloc(range * sizeof(int));
+        memset(s->jumps, 0, range * sizeof(int));
+        for (int i = 0; i < n; i++)
+            s->jumps[labels[i].key - s->lo] = labels[i].jump;
+        s->keys = NULL;
+    }
+    else
+    {
+        s->n = n;
+        s->jumps = mem_alloc(n * sizeof(int));
+        s->keys = mem_alloc(n * sizeof(long long));
+        for (int i = 0; i < n; i++)
+        {
+            s->jumps[i] = labels[i].jump;
+            s->keys[i] = labels[i].key;
+        }
+    }
+    mem_free(labels);
+    return s;
+}
+
+// tokens from the SWITCH to the statement for v, 0 if there's none
+int switch_jump(switch_table* s, long long v)
+{
+    if (s->dense)
+    {
+        unsigned long long i = (unsigned long long)v - (unsigned long long)s->lo;
+        if (i < (unsigned long long)s->n && s->jumps[i] != 0)
+            return s->jumps[i];
+        return s->def;
+    }
+
+    int lo = 0, hi = s->n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s->keys[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < s->n && s->keys[lo] == v)
+        return s->jumps[lo];
+    return s->def;
+}
+
+// t is a linked '{'
+void link_switches(token_struct* t)
+{
+    for (token_struct* end = t + t->token_val.jump; t < end; t++)
+    {
+        if (t->token == SWITCH)
+        {
+            t->token_val.table = build_switch(t);
+        }
+    }
+}
+
+// t is a linked '{'
+void classify_loops(token_struct* t)
+{
+    for (token_struct* end = t + t->token_val.jump; t < end; t++)
+    {
+        if (t->token == FOR && t[-1].token != PARALLEL)
+        {
+            t->token_val.integer = classify_for(t);
+        }
+    }
+}
+
+void compile_function(function* fun)
+{
+    if (atomic_load_explicit(&fun->compiled, memory_order_acquire))
+        return;
+
+    mtx_lock(&compile_lock);
+    compiling = 1;
+    if (!atomic_load_explicit(&fun->compiled, memory_order_relaxed))
+    {
+        // a streamed body may span pages, it's never linked
+        if (fun->stat->token_val.jump != 0)
+        {
+            link_blocks(fun->stat);
+            link_intrinsics(fun->stat);
+            classify_loops(fun->stat);
+            link_operands(fun->stat);
+            link_switches(fun->stat);
+        }
+        atomic_store_explicit(&fun->compiled, 1, memory_order_release);
+    }
+    compiling = 0;
+    mtx_unlock(&compile_lock);
+}
+
+// `entity --eager` compiles all functions on a background thread.
+// it walks the function list, a reload changes it: join_eager() first.
+thrd_t eager_thread;
+int eager_running = 0;
+
+int compile_all(void* arg)
+{
+    (void)arg;
+    stats_thread();
+    for (function* fun = funcs_beg; fun; fun = fun->next)
+    {
+        if (fun->fp == NULL)
+        {
+            compile_function(fun);
+        }
+    }
+    return 0;
+}
+
+void join_eager()
+{
+    if (eager_running)
+    {
+        thrd_join(eager_thread, NULL);
+        eager_running = 0;
+    }
+}
+
+#include "image.c"
+#include "profile.c"
+
+/*************************
+ * Parser & Interpreter
+ *************************/
+
+// allow function call evaluation
+// set to true when global variables are all processed
+//int allow_func_eval = 0;
+
+/*
+exp -> and { OR and }
+and -> equality { AND equality }
+equality -> relation { ( EQU | NEQ ) relation }
+relation -> term1 { op1 term1 }
+term1 -> term2 { op2 term2 }
+term2 -> term3 { op3 term3 }
+    ......
+term? -> factor { op? factor }
+factor -> NUM | LNG | FLT | DBL | ref | call | ( exp ) | TYPE '[' exp ']'
+op1 -> '<' | '>' | LE | GE
+op2 -> '+' | '-'
+op? -> '*' | '/'
+
+the larger the number behind 'op' is, the higher precedence the operators have.
+*/
+
+value factor();
+value term2();
+value term1();
+value expression();
+
+// type -> TYPE [ '[' ']' ]
+int parse_type()
+{
+    int type = token_val.type;
+    match(TYPE);
+    if (token == '[')
+    {
+        match('[');
+        match(']');
+        type = ARRAY_OF(type);
+    }
+    return type;
+}
+
+place reference();
+value call();
+value block();
+value new_coroutine(function* fun, scope* args);
+
+value factor() {
+    value out;
+    if (token == '(') {
+        match('(');
+        out = expression();
+        match(')');
+    }
+    else if(token == NUM) {
+        out.type = TYPE_INT;
+        out.i32 = (int32_t)token_val.integer;
+        match(NUM);
+    }
+    else if(token == LNG) {
+        out.type = TYPE_LONG;
+        out.i64 = token_val.integer;
+        match(LNG);
+    }
+    else if(token == FLT) {
+        out.type = TYPE_FLOAT;
+        out.f32 = (float)token_val.floating;
+        match(FLT);
+    }
+    else if(token == DBL) {
+        out.type = TYPE_DOUBLE;
+        out.f64 = token_val.floating;
+        match(DBL);
+    }
+    else if(token == CHR) {
+        out.type = TYPE_CHAR;
+        out.i8 = token_val.integer;
+        match(CHR);
+    }
+    else if(token == STR) {
+        out.type = TYPE_STRING;
+        out.str = string_pooled(token_val.string);
+        match(STR);
+    }
+    else if (token == ID) {
+        token_struct* cur = save();
+        match(ID);
+        if (token == '(') {
+            restore(cur);
+            out = call();
+        }
+        else {
+            restore(cur);
+            out = load(reference());
+        }
+    }
+    else if (token == MATH) {
+        int fn = (int)token_val.integer;
+        match(MATH);
+        out = math_call(fn);
+    }
+    else if (token == TYPE) {
+        int type = token_val.type;
+        match(TYPE);
+        if (token == '(' && IS_VECTOR(type)) {
+            // float3(x, y, z), float4(x, y, z, w)
+            value args[4];
+            int n = 0;
+            match('(');
+            while (token != ')') {
+                if (n == 4) {
+                    ERROR("(%d) %s takes %d components\n", lineno, type_name(type), type == TYPE_FLOAT3 ? 3 : 4);
+                }
+                args[n++] = expression();
+                if (token != ')')
+                    match(',');
+            }
+            match(')');
+            return new_vector(type, args, n);
+        }
+        // a new array, int[n]
+        match('[');
+        value len = expression();
+        match(']');
+        if (len.type != TYPE_INT)
+        {
+            ERROR("(%d) array length must be int\n", lineno);
+        }
+        out = new_array(type, len.i32);
+    }
+    else {
+        ERROR("(%d) unexpected token: %d\n", lineno, token);
+    }
+
+    // s[i] is a char, s[i:j] a slice
+    while (token == '[' && out.type == TYPE_STRING) {
+        match('[');
+        value beg = expression();
+        value end = beg;
+        int slice = token == ':';
+        if (slice) {
+            match(':');
+            end = expression();
+        }
+        match(']');
+        if (beg.type != TYPE_INT || end.type != TYPE_INT) {
+            ERROR("(%d) string index must be int\n", lineno);
+        }
+        if (slice) {
+            out.str = string_slice(&out.str, beg.i32, end.i32);
+        }
+        else {
+            out.type = TYPE_CHAR;
+            out.i8 = string_at(&out.str, beg.i32);
+        }
+    }
+    return out;
+}
+
+value term2() {
+    value lhs = factor(), rhs;
+    while (token == '*' || token == '/' || token == '%') {
+        if (token == '*') {
+            match('*');
+            rhs = factor();
+            binary_op(&lhs, &lhs, '*', &rhs);
+        }
+        else if (token == '/') {
+            match('/');
+            rhs = factor();
+            binary_op(&lhs, &lhs, '/', &rhs);
+        }
+        else {
+            match('%');
+            rhs = factor();
+            binary_op(&lhs, &lhs, '%', &rhs);
+        }
+    }
+    return lhs;
+}
+
+value term1() {
+    value lhs = term2(), rhs;
+    while (token == '+' || token == '-') {
+        if (token == '+') {
+            match('+');
+            rhs = term2();
+            binary_op(&lhs, &lhs, '+', &rhs);
+        }
+        else {
+            match('-');
+            rhs = term2();
+            binary_op(&lhs, &lhs, '-', &rhs);
+        }
+    }
+    return lhs;
+}
+
+value relation_rest(value lhs) {
+    while (IS_RELATION(token)) {
+        int op = token;
+        match(op);
+        value rhs = term1();
+        binary_op(&lhs, &lhs, op, &rhs);
+    }
+    return lhs;
+}
+
+value equality_rest(value lhs) {
+    while (token == EQU || token == NEQ) {
+        int op = token;
+        match(op);
+        value rhs = relation_rest(term1());
+        binary_op(&lhs, &lhs, op, &rhs);
+    }
+    return lhs;
+}
+
+// the right operand of the && or || at the current token isn't
+// evaluated. compiled functions jump over it, see link_operands().
+void skip_operand()
+{
+    if (token_val.jump != 0) {
+        restore(save() + token_val.jump);
+        return;
+    }
+    int op = token;
+    int depth = 0;
+    for (next(); depth > 0 || !ends_operand(op, token); next()) {
+        if (token == '(' || token == '[')
+            depth++;
+        else if (token == ')' || token == ']')
+            depth--;
+    }
+}
+
+value logic_and() {
+    value lhs = equality_rest(relation_rest(term1()));
+    while (token == AND) {
+        int c = truth(&lhs);
+        if (c) {
+            match(AND);
+            value rhs = equality_rest(relation_rest(term1()));
+            c = truth(&rhs);
+        }
+        else {
+            skip_operand();
+        }
+        lhs.type = TYPE_INT;
+        lhs.i32 = c;
+    }
+    return lhs;
+}
+
+value expression() {
+    value lhs = logic_and();
+    while (token == OR) {
+        int c = truth(&lhs);
+        if (!c) {
+            match(OR);
+            value rhs = logic_and();
+            c = truth(&rhs);
+        }
+        else {
+            skip_operand();
+        }
+        lhs.type = TYPE_INT;
+        lhs.i32 = c;
+    }
+    return lhs;
+}
+
+// conditions of if, while, do & for. the same grammar as expression(),
+// but a comparison of 2 ints and && || give a c int, no values.
+int cond_compare() {
+    value lhs = term1();
+    if (IS_COMPARE(token)) {
+        int op = token;
+        match(op);
+        value rhs = term1();
+        if (!IS_COMPARE(token))
+            return compare(&lhs, op, &rhs);
+
+        // a < b < c, a == b < c ...
+        if (IS_RELATION(op)) {
+            binary_op(&lhs, &lhs, op, &rhs);
+            lhs = relation_rest(lhs);
+        }
+        else {
+            rhs = relation_rest(rhs);
+            binary_op(&lhs, &lhs, op, &rhs);
+        }
+    }
+    lhs = equality_rest(lhs);
+    return truth(&lhs);
+}
+
+int cond_and() {
+    int c = cond_compare();
+    while (token == AND) {
+        if (c) {
+            match(AND);
+            c = cond_compare();
+        }
+        else {
+            skip_operand();
+        }
+    }
+    return c;
+}
+
+int condition() {
+    int c = cond_and();
+    while (token == OR) {
+        if (!c) {
+            match(OR);
+            c = cond_and();
+        }
+        else {
+            skip_operand();
+        }
+    }
+    return c;
+}
+
+// ref -> ID { '.' ID | '[' exp ']' }, a '.' on a float3/float4 is a swizzle
+place reference()
+{
+    char* name = token_val.string;
+    match(ID);
+
+    place ref;
+    ref.val = get_variable(name);
+    ref.arr = NULL;
+    ref.index = 0;
+    ref.swizzle = 0;
+    ref.member = 0;
+
+    while(token == '.' || token == '[')
+    {
+        if (ref.swizzle)
+        {
+            ERROR("(%d) a swizzle can't be followed by '%c'\n", lineno, token);
+        }
+        value v = load(ref);
+        // s[i] & s[i:j] aren't places, factor() does them
+        if (token == '[' && v.type == TYPE_STRING)
+            break;
+
+        if (token == '.')
+        {
+            match('.');
+            char* member = token_val.string;
+            match(ID);
+
+            if (IS_VECTOR(v.type))
+            {
+                ref.swizzle = parse_swizzle(v.type, member);
+                if (ref.swizzle == 0)
+                {
+                    ERROR("(%d) bad swizzle .%s of %s\n", lineno, member, type_name(v.type));
+                }
+                continue;
+            }
+            if (v.type != TYPE_ENTITY)
+            {
+                ERROR("(%d) can't access member of non-entity object\n", lineno);
+            }
+            ref = member_place(v.obj, member);
+        }
+        else
+        {
+            match('[');
+            value i = expression();
+            match(']');
+
+            if (!IS_ARRAY(v.type))
+            {
+                ERROR("(%d) can't index %s\n", lineno, type_name(v.type));
+            }
+            if (i.type != TYPE_INT)
+            {
+                ERROR("(%d) array index must be int\n", lineno);
+            }
+            check_index(v.arr, i.i32);
+            ref.val = NULL;
+            ref.arr = v.arr;
+            ref.index = i.i32;
+        }
+    }
+
+    return ref;
+}
+
+// every loop iteration and script call is a tick. when a request served
+// in slices has used up its slice, out_of_ticks() suspends it, see
+// server.c. anything else never runs out.
+THREAD_LOCAL long long ticks_left = LLONG_MAX;
+void out_of_ticks();
+#define TICK() do { if (--ticks_left <= 0) out_of_ticks(); } while (0)
+
+// 在多重嵌套的block中返回时设为true
+// 这样就能快速跳出递归的block()
+// 每次call()之后设为false
+THREAD_LOCAL int retflag = 0;
+
+value call()
+{
+    value ret;
+
+    char* name = token_val.string;
+    match(ID);
+    
+    // get the function and its parameter list
+    function* fun = find_function(name);
+    if (fun == NULL)
+    {
+        // an intrinsic in a function that isn't compiled
+        int fn = find_intrinsic(name);
+        if (fn < 0)
+        {
+            ERROR("(%d) no such function %s\n", lineno, name);
+        }
+        return math_call(fn);
+    }
+    param* par = fun->params;
+    
+    // find number of arguments we need to pass
+    int n_args = 0;
+    for(param* p = par; p; p = p->next)
+        n_args++;
+
+    scope* bak = scope_end;
+    // 先生成一个新scope，暂时挂到bak下面。
+    new_scope();
+    // 保存新的scope
+    scope* neo = scope_end;
+
+    // number of arguments passed to the function
+    int n_passed = 0;
+
+    match('(');
+    if (token != ')')
+    {
+    NextArg:
+        if (par == NULL)
+        {
+            ERROR("(%d) too many arguments to function %s\n",
+                lineno, name);
+        }
+        // 计算表达式时，切换到原来的scope。
+        scope_end = bak;
+        value val = expression();
+        if (IS_NUMBER(val.type) && IS_NUMBER(par->type))
+        {
+            convert_number(&val, par->type);
+        }
+        if (par->type != TYPE_ANY && val.type != par->type)
+        {
+            ERROR("(%d) wrong type provided to function %s at pos %d, %s required, but %s provided\n",
+                lineno, name, n_passed+1, type_name(par->type), type_name(val.type));
+        }
+        // 传参时切换到新的scope
+        scope_end = neo;
+        new_variable(par->name, val);
+        par = par->next;
+        n_passed++;
+
+        if (token == ',')
+        {
+            match(',');
+            goto NextArg;
+        }
+    }
+    match(')');
+
+    if (n_passed != n_args)
+    {
+        ERROR("(%d) too few arguments to function %s, %d required, but %d provided\n",
+            lineno, name, n_args, n_passed);
+    }
+
+    if (fun->fp == NULL)
+    {
+        compile_function(fun);
+    }
+
+    // save return address
+    token_struct* cur = save();
+
+    // 传参结束，scope_end=neo,新scope挂到scope_beg下。
+    scope_end->parent = scope_beg;
+
+    // a coroutine function doesn't run yet, the new scope
+    // is handed over to the suspended coroutine.
+    if (fun->type == TYPE_COROUTINE && fun->fp == NULL)
+    {
+        ret = new_coroutine(fun, neo);
+        restore(cur);
+        scope_end = bak;
+        return ret;
+    }
+
+    // finally, call it!
+    prof_frame frame;
+    profile_enter(&frame, fun);
+    if (fun->fp != NULL)
+    {
+        ret = fun->fp();
+    }   
+    else
+    {
+        TICK();
+        restore(fun->stat);
+        ret = block();
+    }
+    profile_exit(&frame);
+
+    if (IS_NUMBER(ret.type) && IS_NUMBER(fun->type))
+    {
+        convert_number(&ret, fun->type);
+    }
+    if (fun->type != TYPE_ANY && ret.type != fun->type)
+    {
+        ERROR("(%d) function %s returns wrong type\n", lineno, name);
+    }
+
+    restore(cur);
+
+    exit_scope();
+    scope_end = bak;
+
+    // see begining of call()
+    retflag = 0;
+
+    return ret;
+}
+
+// block -> '{' { stat } '}'
+// stat -> var | call | assign | append
+// var -> TYPE name { ',' name } ';'
+// call -> ID '(' ID ID { ',' ID ID } ')'
+// assign -> ref '=' expr
+// append -> TYPE ID '.' ID '=' expr ';'
+// for -> FOR '(' [ var | assign ] ';' [ expr ] ';' [ assign | call ] ')' block
+// parallel -> PARALLEL FOR '(' TYPE ID '=' expr ';' ID '<' expr ')' block
+// yield -> YIELD [ expr ] ';'
+// query -> QUERY '(' TYPE ID ':' ID { ',' ID } ')' block
+
+void var();
+void skip_block();
+void parallel_for();
+value for_loop();
+void yield();
+value query();
+void assign()
+{
+    place left = reference();
+    match('=');
+    value right = expression();
+    if (IS_NUMBER(right.type) && IS_NUMBER(place_type(left)))
+    {
+        convert_number(&right, place_type(left));
+    }
+    if (place_type(left) != right.type)
+    {
+        ERROR("(%d) assignment on different types\n", lineno);
+    }
+    store(left, right);
+}
+
+void append()
+{
+    int type = parse_type();
+    char* name = token_val.string;
+    match(ID);
+
+    value var = load_slot(*get_variable(name));
+
+    match('.');
+
+    char* member = token_val.string;
+    match(ID);
+
+    match('=');
+    value val = expression();
+    type_convert(&val, type);
+    match(';');
+
+    append_member(var, member, val);
+}
+
+THREAD_LOCAL int contflag = 0;
+THREAD_LOCAL int brkflag = 0;
+
+value switch_statement();
+
+// the statements of a block up to and with its '}'
+value statements()
+{
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+
+    while(token != '}')
+    {
+        token_struct* cur = save();
+
+        // empty statement
+        if (token == ';')
+        {
+            match(';');
+        }
+        // anonymous block
+        else if (token == '{')
+        {
+            new_scope();
+            ret = block();
+            exit_scope();
+            
+            if (retflag)
+            {
+                return ret;
+            }
+        }
+        else if (token == TYPE)
+        {
+            token_struct* cur = save();
+            parse_type();
+            match(ID);
+
+            if (token == '.')
+            {
+                restore(cur);
+                append();
+            }
+            else
+            {
+                restore(cur);
+                var();
+            }
+        }
+        else if (token == ID)
+        {
+            match(ID);
+            if (token == '(')
+            {
+                restore(cur);
+                call();
+                match(';');
+            }
+            else
+            {
+                restore(cur);
+                assign();
+                match(';');
+            }
+        }
+        else if (token == IF) {
+        NextIf:
+            match(IF);
+            match('(');
+            int c = condition();
+            match(')');
+
+            if (c) {
+                new_scope();
+                ret = block();
+                exit_scope();
+                if (retflag)
+                {
+                    return ret;
+                }
+            }
+            else {
+                skip_block();
+            }
+
+            if (token == ELSE) {
+                match(ELSE);
+                if (!c) {
+                    // improve this, goto is dangerous.
+                    if (token == IF)
+                    {
+                        goto NextIf;
+                    }
+                    else {
+                        new_scope();
+                        ret = block();
+                        exit_scope();
+                        if (retflag)
+                        {
+                            return ret;
+                        }
+                    }
+                }
+                else {
+                    skip_block();
+                }
+            }
+        }
+        else if (token == WHILE) {
+            match(WHILE);
+            match('(');
+            token_struct* w = save();
+            token_struct* sob = NULL; // start of block
+
+        NextWhile:
+            int c = condition();
+            match(')');
+
+            sob = save();
+
+            if (c) {
+                new_scope();
+                ret = block();
+                exit_scope();
+
+                if (retflag)
+                {
+                    return ret;
+                }
+                if (contflag)
+                {
+                    contflag = 0;
+                    TICK();
+                    restore(w);
+                    goto NextWhile;
+                }
+                if (brkflag)
+                {
+                    brkflag = 0;
+                    restore(sob);
+                    skip_block();
+                    continue; // parse next statment
+                }
+
+                TICK();
+                restore(w);
+                goto NextWhile;
+            }
+            else {
+                skip_block();
+            }
+        }
+        else if (token == DO) {
+            match(DO);
+            token_struct *d = save();
+
+        NextDo:
+            new_scope();
+            ret = block();
+            exit_scope();
+            
+            if (retflag)
+            {
+                return ret;
+            }
+            if (contflag)
+            {
+                contflag = 0;
+                TICK();
+                restore(d);
+                goto NextDo;
+            }
+            if (brkflag)
+            {
+                brkflag = 0;
+                restore(d); // d is the start of block
+                skip_block();
+                // skip to the ending semicolon of do-while statement
+                while(token != ';') {
+                    next();
+                }
+                match(';');
+                continue; // parse next statment
+            }
+
+            match(WHILE);
+            match('(');
+            int c = condition();
+            match(')');
+            match(';');
+
+            if (c) {
+                TICK();
+                restore(d);
+                goto NextDo;
+            }
+        }
+        else if (token == CONTINUE) {
+            match(CONTINUE);
+            match(';');
+            contflag = 1;
+            return ret;
+        }
+        else if (token == BREAK) {
+            match(BREAK);
+            match(';');
+            brkflag = 1;
+            return ret;
+        }
+        else if (token == FOR) {
+            ret = for_loop();
+            if (retflag)
+            {
+                return ret;
+            }
+        }
+        else if (token == MATH) {
+            expression();
+            match(';');
+        }
+        else if (token == SWITCH) {
+            ret = switch_statement();
+            if (retflag || contflag)
+            {
+                return ret;
+            }
+        }
+        // labels of the switch being run fall through
+        else if (token == CASE) {
+            match(CASE);
+            match(token);
+            match(':');
+        }
+        else if (token == DEFAULT) {
+            match(DEFAULT);
+            match(':');
+        }
+        else if (token == PARALLEL) {
+            parallel_for();
+        }
+        else if (token == YIELD) {
+            yield();
+        }
+        else if (token == QUERY) {
+            ret = query();
+            if (retflag)
+            {
+                return ret;
+            }
+        }
+        else if (token == RETURN) {
+            match(RETURN);
+            if (token == ';')
+            {
+                match(';');
+                retflag = 1;
+                return ret;
+            }
+            else
+            {
+                ret = expression();
+                match(';');
+                retflag = 1;
+                return ret;
+            }
+        }
+    }
+    match('}');
+    return ret;
+}
+
+value block()
+{
+    match('{');
+    return statements();
+}
+
+// runs the statements after the matching label, to the end of the
+// body or a break. cases are looked up in the table made by
+// build_switch(), or searched when the function isn't compiled.
+value switch_statement()
+{
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+
+    token_struct* sw = save();
+    match(SWITCH);
+    match('(');
+    value val = expression();
+    match(')');
+    if (!IS_NUMBER(val.type) || val.type == TYPE_FLOAT || val.type == TYPE_DOUBLE)
+    {
+        ERROR("(%d) switch needs an integer or char, not %s\n", lineno, type_name(val.type));
+    }
+    long long v = number_i64(&val);
+
+    token_struct* body = save();
+    token_struct* target = NULL;
+    if (sw->token_val.table != NULL)
+    {
+        int jump = switch_jump(sw->token_val.table, v);
+        if (jump != 0)
+            target = sw + jump;
+    }
+    else
+    {
+        token_struct* def = NULL;
+        match('{');
+        for (int depth = 0; token != '}' || depth > 0; )
+        {
+            if (depth == 0 && token == CASE)
+            {
+                match(CASE);
+                if (!is_case_constant(token))
+                {
+                    ERROR("(%d) case needs an integer or char constant\n", lineno);
+                }
+                long long key = token_val.integer;
+                match(token);
+                match(':');
+                if (key == v)
+                {
+                    target = save();
+                    break;
+                }
+            }
+            else if (depth == 0 && token == DEFAULT)
+            {
+                match(DEFAULT);
+                match(':');
+                def = save();
+            }
+            else
+            {
+                depth += (token == '{') - (token == '}');
+                next();
+            }
+        }
+        if (target == NULL)
+            target = def;
+    }
+
+    if (target == NULL)
+    {
+        restore(body);
+        skip_block();
+        return ret;
+    }
+
+    restore(target);
+    new_scope();
+    ret = statements();
+    exit_scope();
+
+    if (brkflag)
+    {
+        brkflag = 0;
+        restore(body);
+        skip_block();
+    }
+    return ret;
+}
+
+// the loop of a counted for, see classify_for(). the induction variable
+// is stored to its slot before each iteration, the body only reads it.
+value counted_for(int kind)
+{
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+
+    char* name = (save() + 1)->token_val.string;
+    var();
+    slot* iv = get_variable(name);
+    int32_t i = load_slot(*iv).i32;
+
+    match(ID);
+    int op = token;
+    match(op);
+    token_struct* cond = save();
+    value bound = expression();
+    match(';');
+
+    match(ID);
+    match('=');
+    match(ID);
+    int32_t step = token == '+' ? 1 : -1;
+    match(token);
+    step *= (int32_t)token_val.integer;
+    match(NUM);
+    match(')');
+    token_struct* body = save();
+
+    value iv_val;
+    memset(&iv_val, 0, sizeof(value));
+    iv_val.type = TYPE_INT;
+
+    for (;;)
+    {
+        if (kind != FOR_HOISTED)
+        {
+            restore(cond);
+            bound = expression();
+        }
+        iv_val.i32 = i;
+        if (!compare(&iv_val, op, &bound))
+            break;
+
+        store_slot(iv, iv_val);
+        restore(body);
+        new_scope();
+        ret = block();
+        exit_scope();
+
+        if (retflag)
+            return ret;
+        contflag = 0;
+        if (brkflag)
+        {
+            brkflag = 0;
+            break;
+        }
+        i = (int32_t)((uint32_t)i + (uint32_t)step);
+        TICK();
+    }
+
+    restore(body);
+    skip_block();
+    return ret;
+}
+
+value for_loop()
+{
+    int kind = token_val.integer;
+    match(FOR);
+    match('(');
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+
+    // the init statement's variables are scoped to the loop
+    new_scope();
+    if (kind == FOR_COUNTED || kind == FOR_HOISTED)
+    {
+        ret = counted_for(kind);
+        exit_scope();
+        return ret;
+    }
+
+    if (token == TYPE)
+    {
+        var();
+    }
+    else
+    {
+        if (token != ';')
+            assign();
+        match(';');
+    }
+
+    token_struct* cond = save();
+    while (token != ';')
+        next();
+    match(';');
+    token_struct* step = save();
+    for (int depth = 0; token != ')' || depth > 0; next())
+    {
+        depth += (token == '(') - (token == ')');
+    }
+    match(')');
+    token_struct* body = save();
+
+    for (;;)
+    {
+        restore(cond);
+        if (token != ';' && !condition())
+            break;
+
+        restore(body);
+        new_scope();
+        ret = block();
+        exit_scope();
+
+        if (retflag)
+        {
+            exit_scope();
+            return ret;
+        }
+        contflag = 0;
+        if (brkflag)
+        {
+            brkflag = 0;
+            break;
+        }
+
+        restore(step);
+        if (token != ')')
+        {
+            token_struct* cur = save();
+            match(ID);
+            int is_call = token == '(';
+            restore(cur);
+            if (is_call)
+                call();
+            else
+                assign();
+        }
+        TICK();
+    }
+
+    restore(body);
+    skip_block();
+    exit_scope();
+    return ret;
+}
+
+// a parallel loop, shared by every worker running its iterations.
+typedef struct par_loop
+{
+    char* name;         // the induction variable
+    token_struct* body; // token = '{'
+    scope* parent;      // scope the loop was started in
+    atomic_int failed;  // the first error is raised by the caller
+    char msg[256];
+} par_loop;
+
+// iterations of a parallel loop are running on this thread
+THREAD_LOCAL int in_parallel = 0;
+
+// runs iterations [lo, hi) of a parallel loop on the current thread.
+// the thread may be in the middle of another statement (the caller
+// helps out while waiting), so the lexer state and scope are restored.
+void par_iterations(void* arg, int lo, int hi)
+{
+    par_loop* loop = arg;
+    token_struct* cur = save();
+    jmp_buf* outer = fail_jmp;
+    thread_state state;
+    save_state(&state);
+
+    jmp_buf jmp;
+    if (setjmp(jmp) != 0)
+    {
+        // the rest of the loop is skipped
+        if (atomic_exchange(&loop->failed, 1) == 0)
+            strcpy(loop->msg, fail_msg);
+        recover_state(&state);
+        goto Done;
+    }
+    fail_jmp = &jmp;
+    in_parallel++;
+
+    for (int i = lo; i < hi && !atomic_load(&loop->failed); i++)
+    {
+        value val;
+        val.type = TYPE_INT;
+        val.i32 = i;
+
+        // every iteration gets its own scope on this thread's chain,
+        // the enclosing scopes are shared read-only.
+        scope_end = loop->parent;
+        new_scope();
+        new_variable(loop->name, val);
+        restore(loop->body);
+        block();
+        exit_scope();
+
+        contflag = 0;
+        if (brkflag || retflag)
+        {
+            ERROR("(%d) break and return are not allowed in parallel for\n", lineno);
+        }
+    }
+
+Done:
+    in_parallel--;
+    fail_jmp = outer;
+    scope_end = state.scope;
+    if (cur != NULL)
+    {
+        restore(cur);
+    }
+}
+
+// iterations are independent of each other, they run on the worker
+// threads in no particular order. the statement completes when all
+// of them are done.
+mtx_t parallel_lock;
+
+void parallel_for()
+{
+    match(PARALLEL);
+    match(FOR);
+    match('(');
+
+    if (token_val.type != TYPE_INT)
+    {
+        ERROR("(%d) induction variable of parallel for must be int\n", lineno);
+    }
+    match(TYPE);
+    char* name = token_val.string;
+    match(ID);
+    match('=');
+    value lo = expression();
+    match(';');
+
+    if (token_val.string != name)
+    {
+        ERROR("(%d) parallel for must compare its induction variable %s\n", lineno, name);
+    }
+    match(ID);
+    match('<');
+    value hi = expression();
+    match(')');
+
+    if (lo.type != TYPE_INT || hi.type != TYPE_INT)
+    {
+        ERROR("(%d) bounds of parallel for must be int\n", lineno);
+    }
+
+    par_loop loop;
+    loop.name = name;
+    loop.body = save();
+    loop.parent = scope_end;
+    atomic_init(&loop.failed, 0);
+
+    skip_block();
+    token_struct* end = save();
+
+    // to the scheduler every server thread is the main thread, they
+    // take turns.
+    int request = fail_jmp != NULL && in_parallel == 0;
+    if (request)
+        mtx_lock(&parallel_lock);
+    parallel_range(&par_iterations, &loop, lo.i32, hi.i32);
+    if (request)
+        mtx_unlock(&parallel_lock);
+
+    if (atomic_load(&loop.failed))
+    {
+        ERROR("%s", loop.msg);
+    }
+    restore(end);
+}
+
+#define MAX_QUERY_MEMBERS 16
+
+// the block runs once per entity having all the members, archetype
+// by archetype, with the entity bound to the variable.
+value query()
+{
+    match(QUERY);
+    match('(');
+    if (token_val.type != TYPE_ENTITY)
+    {
+        ERROR("(%d) query needs an entity variable\n", lineno);
+    }
+    match(TYPE);
+    char* name = token_val.string;
+    match(ID);
+    match(':');
+
+    char* members[MAX_QUERY_MEMBERS];
+    int n = 0;
+NextMember:
+    if (n == MAX_QUERY_MEMBERS)
+    {
+        ERROR("(%d) too many members in query\n", lineno);
+    }
+    members[n++] = token_val.string;
+    match(ID);
+    if (token == ',')
+    {
+        match(',');
+        goto NextMember;
+    }
+    match(')');
+
+    if (!ecs_mode)
+    {
+        ERROR("(%d) query needs entity --ecs\n", lineno);
+    }
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+
+    token_struct* body = save();
+    begin_query();
+
+    for (archetype* a = archetypes; a; a = a->next)
+    {
+        int i = 0;
+        while (i < n && arch_column(a, members[i]) != -1)
+            i++;
+        if (i < n)
+            continue;
+
+        for (int row = 0; row < a->owners->len; row++)
+        {
+            value e;
+            e.type = TYPE_ENTITY;
+            e.obj = ((entity**)a->owners->data)[row];
+
+            new_scope();
+            new_variable(name, e);
+            restore(body);
+            ret = block();
+            exit_scope();
+
+            if (retflag)
+            {
+                end_query();
+                return ret;
+            }
+            contflag = 0;
+            if (brkflag)
+            {
+                brkflag = 0;
+                goto Done;
+            }
+        }
+    }
+
+Done:
+    end_query();
+    restore(body);
+    skip_block();
+    return ret;
+}
+
+/*************************
+ * Coroutines
+ *************************/
+
+// a function returning `coroutine` doesn't run when called, it returns
+// a suspended coroutine instead. resume(c) runs it until the next yield
+// and returns 0 once the function body has finished. yielded(c) is the
+// last yielded (or returned) value.
+
+#define COROUTINE_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct coroutine
+{
+    coro* ctx;      // NULL once finished
+    function* fun;
+    scope* args;    // bottom of the coroutine's scope chain
+    value val;      // last yielded or returned value
+    int active;     // resumed and not yielded back yet
+} coroutine;
+
+// coroutine running on this thread, NULL if none
+THREAD_LOCAL coroutine* running = NULL;
+
+void save_state(thread_state* s)
+{
+    s->ctx = coro_running();
+    s->running = running;
+    s->scope = scope_end;
+    s->queries = thread_queries;
+    s->prof = prof_cur;
+}
+
+void recover_state(const thread_state* s)
+{
+    if (compiling)
+    {
+        compiling = 0;
+        mtx_unlock(&compile_lock);
+    }
+    coro_reset(s->ctx);
+    running = s->running;
+    scope_end = s->scope;
+    reset_queries(s->queries);
+    // the calls that failed never got to profile_exit()
+    prof_cur = s->prof;
+    retflag = 0;
+    contflag = 0;
+    brkflag = 0;
+}
+
+void coroutine_main(void* arg)
+{
+    coroutine* co = arg;
+    prof_frame frame;
+    scope_end = co->args;
+    profile_enter(&frame, co->fun);
+    restore(co->fun->stat);
+    co->val = block();
+    profile_exit(&frame);
+    retflag = 0;
+    exit_scope();
+}
+
+value new_coroutine(function* fun, scope* args)
+{
+    coroutine* co = mem_alloc(sizeof(coroutine));
+    co->ctx = coro_new(&coroutine_main, co, COROUTINE_STACK_SIZE);
+    co->fun = fun;
+    co->args = args;
+    co->active = 0;
+    memset(&co->val, 0, sizeof(value));
+    co->val.type = TYPE_VOID;
+
+    value ret;
+    ret.type = TYPE_COROUTINE;
+    ret.co = co;
+    return ret;
+}
+
+void yield()
+{
+    value val;
+    memset(&val, 0, sizeof(value));
+    val.type = TYPE_VOID;
+
+    match(YIELD);
+    if (token != ';')
+    {
+        val = expression();
+    }
+    match(';');
+
+    if (running == NULL)
+    {
+        ERROR("(%d) yield outside of a coroutine\n", lineno);
+    }
+    running->val = val;
+
+    // whoever resumes us next overwrites the lexer state and scope
+    token_struct* cur = save();
+    scope* scp = scope_end;
+    prof_node* prof = prof_cur;
+    coro_yield();
+    restore(cur);
+    scope_end = scp;
+    prof_cur = prof;
+}
+
+value resume_coroutine()
+{
+    coroutine* co = arg("c").co;
+
+    value ret;
+    ret.type = TYPE_INT;
+    ret.i32 = 0;
+    if (co->ctx == NULL)
+    {
+        return ret;
+    }
+    // it's somewhere up this thread's stack, waiting for us to return
+    if (co->active)
+    {
+        ERROR("(%d) resume of a coroutine that is already running\n", lineno);
+    }
+
+    token_struct* cur = save();
+    scope* bak = scope_end;
+    coroutine* prev = running;
+    prof_node* prof = prof_cur;
+
+    // coroutines show up as call paths of their own, their frames
+    // outlive the resume() they were started by. once started,
+    // yield() puts back the coroutine's own path.
+    if (prof_cur != NULL)
+    {
+        prof_cur = &prof_root;
+    }
+
+    running = co;
+    co->active = 1;
+    coro_resume(co->ctx);
+    co->active = 0;
+    running = prev;
+
+    restore(cur);
+    scope_end = bak;
+    prof_cur = prof;
+
+    if (coro_finished(co->ctx))
+    {
+        coro_free(co->ctx);
+        co->ctx = NULL;
+        return ret;
+    }
+    ret.i32 = 1;
+    return ret;
+}
+
+value yielded_value()
+{
+    return arg("c").co->val;
+}
+
+/*
+program -> { var } { func }
+func -> TYPE ID '(' [ ID ID { ',' ID ID } ] ')' block
+var -> TYPE name { ',' name } ';'
+name -> ID | ID '=' expr
+*/
+
+// one name of a declaration, with its initializer if it has one
+void declare(int type, char* name)
+{
+    if (token == '=')
+    {
+        match('=');
+        value val = expression();
+        type_convert(&val, type);
+        new_variable(name, val);
+    }
+    else if (IS_ARRAY(type))
+    {
+        new_variable(name, new_array(ELEM_TYPE(type), 0));
+    }
+    else
+    {
+        value val;
+        memset(&val, 0, sizeof(val));
+        val.type = type;
+        new_variable(name, val);
+    }
+}
+
+void var()
+{
+    int type = parse_type();
+
+NextVar:
+    char* name = token_val.string;
+    match(ID);
+    declare(type, name);
+
+    if (token == ',')
+    {
+        match(',');
+        goto NextVar;
+    }
+
+    match(';');
+}
+
+void skip_block()
+{
+    if (token == '{' && token_val.jump != 0)
+    {
+        restore(save() + token_val.jump);
+        match('}');
+        return;
+    }
+
+    match('{');
+    int count = 0;
+    while (token && !(token == '}' && count == 0)) {
+        if (token == '}') count++;
+        if (token == '{') count--;
+        STAT_INC(skipped_tokens);
+        next();
+    }
+    match('}');
+}
+
+// parses a function without registering it, any thread can do that
+function* parse_func()
+{
+    int type = parse_type();
+    char* name = token_val.string;
+    match(ID);
+
+    param* params_beg = NULL;
+    param* params_end = NULL;
+    // match params
+    match('(');
+    if (token != ')')
+    {
+    NextParam:
+        int param_type = parse_type();
+        char* param_name = token_val.string;
+        match(ID);
+
+        param* p = mem_alloc(sizeof(param));
+        p->next = NULL;
+        p->type = param_type;
+        p->name = param_name;
+        
+        if (params_end == NULL)
+        {
+            params_beg = p;
+            params_end = p;
+        }
+        else
+        {
+            params_end->next = p;
+            params_end = p;
+        }
+
+        if (token == ',')
+        {
+            match(',');
+            goto NextParam;
+        }
+    }
+    match(')');
+
+    token_struct* cur = save();
+
+    skip_block();
+
+    return make_function(
+        type,
+        name,
+        params_beg,
+        cur,
+        NULL
+    );
+}
+
+void func()
+{
+    add_function(parse_func());
+}
+
+// global declarations end at their ';', nothing is evaluated.
+// used when compiling an image, where only the functions matter.
+void skip_globals()
+{
+    while(token)
+    {
+        token_struct* cur = save();
+        parse_type();
+        match(ID);
+
+        if (token == '='
+            || token == ','
+            || token == ';')
+        {
+            while (token != ';')
+            {
+                next();
+            }
+            match(';');
+        }
+        else {
+            restore(cur);
+            break;
+        }
+    }
+}
+
+/*************************
+ * Parallel Loading
+ *************************/
+
+// a large source is split into chunks at top-level function boundaries.
+// all chunks are lexed at once, then the chunks after the first one are
+// parsed into lists of functions. the first chunk holds the global
+// declarations, it's left to program().
+
+// smaller sources are lexed on the main thread
+#define PARALLEL_THRESHOLD (4 << 20)
+#define MAX_CHUNKS 256
+
+source_chunk chunks[MAX_CHUNKS];
+function* chunk_funcs[MAX_CHUNKS];
+int n_chunks = 0;
+
+void lex_chunks(void* arg, int lo, int hi)
+{
+    (void)arg;
+    for (int i = lo; i < hi; i++)
+    {
+        lex_chunk(&chunks[i]);
+    }
+}
+
+void parse_chunks(void* arg, int lo, int hi)
+{
+    (void)arg;
+    token_struct* cur = save();
+
+    for (int i = lo; i < hi; i++)
+    {
+        token_struct* stop = i + 1 < n_chunks ? chunks[i + 1].tokens : NULL;
+        function* end = NULL;
+
+        restore(chunks[i].tokens);
+        while (token && save() != stop)
+        {
+            function* fun = parse_func();
+            if (end == NULL)
+                chunk_funcs[i] = fun;
+            else
+                end->next = fun;
+            end = fun;
+        }
+    }
+
+    if (cur != NULL)
+    {
+        restore(cur);
+    }
+}
+
+// lexes s, on all threads if it's large enough
+void lex_source(char* s, size_t len)
+{
+    int threads = sched_threads();
+    if (len < PARALLEL_THRESHOLD || threads == 1)
+    {
+        init_lex();
+        return;
+    }
+
+    int n = threads * 4;
+    if (n > MAX_CHUNKS)
+        n = MAX_CHUNKS;
+    n_chunks = split_source(s, len, chunks, n);
+
+    pool_begin_parallel((int)(len / 128));
+    parallel_range(&lex_chunks, NULL, 0, n_chunks);
+    pool_end_parallel();
+
+    join_chunks(chunks, n_chunks);
+    parallel_range(&parse_chunks, NULL, 1, n_chunks);
+    restore(chunks[0].tokens);
+}
+
+// registers the functions of the first chunk,
+// then the ones parse_chunks() found, in source order
+void functions()
+{
+    token_struct* stop = n_chunks > 1 ? chunks[1].tokens : NULL;
+    while (token && save() != stop)
+    {
+        func();
+    }
+
+    for (int i = 1; i < n_chunks; i++)
+    {
+        function* fun = chunk_funcs[i];
+        while (fun != NULL)
+        {
+            function* next = fun->next;
+            add_function(fun);
+            fun = next;
+        }
+    }
+}
+
+// img != NULL: the function table comes from a precompiled image
+void program(image* img)
+{
+    new_scope();
+
+    token_struct* cur;
+
+    // process global variables
+    while(token)
+    {
+        cur = save();
+        parse_type();
+        match(ID);
+
+        if (token == '=' 
+            || token == ',' 
+            || token == ';')
+        {
+            restore(cur);
+            var();
+            // a streamed source doesn't need them anymore
+            lex_discard();
+        }
+        else {
+            restore(cur);
+            break;
+        }
+    }
+
+    if (img != NULL)
+    {
+        load_functions(img);
+        return;
+    }
+
+    functions();
+}
+
+// sources larger than this are streamed, unless there are
+// several threads to lex them with
+#define STREAM_THRESHOLD (64 << 20)
+
+long long file_size(const char* path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        ERROR("no such file\n");
+    }
+    fseek(f, 0, SEEK_END);
+    long long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+char* read_file(const char* path, size_t* len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        ERROR("no such file\n");
+    }
+
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* buf = mem_alloc(*len+1);
+    memset(buf, 0, *len+1);
+    fread(buf, 1, *len, f);
+    fclose(f);
+    return buf;
+}
+
+#include "map.c"
+#include "reload.c"
+#include "server.c"
+
+int main(int argc, char* argv[])
+{
+    char* path = NULL;
+    char* out = NULL;
+    int compile = 0;
+    int show_stats = 0;
+    int profile = 0;
+    int stream = 0;
+    int eager = 0;
+    char* map = NULL;
+    int server = 0;
+    char* socket_path = NULL;
+
+    init_output();
+    stats_thread();
+    mtx_init(&compile_lock, mtx_plain);
+    mtx_init(&parallel_lock, mtx_plain);
+    init_gate();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--compile"))
+            compile = 1;
+        else if (!strcmp(argv[i], "--stats"))
+            show_stats = 1;
+        else if (!strcmp(argv[i], "--profile"))
+            profile = 1;
+        else if (!strcmp(argv[i], "--stream"))
+            stream = 1;
+        else if (!strcmp(argv[i], "--map") && i + 1 < argc)
+            map = argv[++i];
+        else if (!strcmp(argv[i], "--serve"))
+            server = 1;
+        else if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--budget") && i + 1 < argc)
+        {
+            // digits only, no sign or spaces
+            char* ticks = argv[++i];
+            char* end;
+            errno = 0;
+            slice_ticks = strtoll(ticks, &end, 10);
+            if (*ticks < '0' || *ticks > '9' || *end != 0 || errno == ERANGE || slice_ticks <= 0)
+            {
+                ERROR("--budget: %s isn't a number of ticks above 0\n", ticks);
+            }
+        }
+        else if (!strcmp(argv[i], "--watch"))
+            watching = 1;
+        else if (!strcmp(argv[i], "--eager"))
+            eager = 1;
+        else if (!strcmp(argv[i], "--ecs"))
+            ecs_mode = 1;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out = argv[++i];
+        else if (path == NULL)
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+
+    if (path == NULL)
+    {
+        ERROR("usage: entity [--stats] [--profile] [--stream] [--eager] [--ecs] [--map <function>] [--serve [--socket <path>] [--budget <ticks>] [--watch]] [--compile <source> [-o <image>]] <source|image>\n");
+    }
+
+    // foo.ent is cached in foo.entc
+    char* cache = mem_alloc(strlen(path) + 2);
+    strcpy(cache, path);
+    strcat(cache, "c");
+
+    // register native function(s)
+    init_math();
+    new_function(TYPE_ENTITY, pool_add("new"), NULL, NULL, &new_entity);
+    
+    param* p = mem_alloc(sizeof(param));
+    p->next = NULL;
+    p->name = pool_add("e");
+    p->type = TYPE_ANY;
+    new_function(TYPE_VOID, pool_add("del"), p, NULL, &del_entity);
+
+    param* p2 = mem_alloc(sizeof(param));
+    p2->next = NULL;
+    p2->name = pool_add("v");
+    p2->type = TYPE_ANY;
+    new_function(TYPE_VOID, pool_add("print"), p2, NULL, &print_value);
+    new_function(TYPE_VOID, pool_add("flush"), NULL, NULL, &flush_value);
+    new_function(TYPE_INT, pool_add("reload"), NULL, NULL, &reload_script);
+
+    param* p3 = mem_alloc(sizeof(param));
+    p3->next = NULL;
+    p3->name = pool_add("c");
+    p3->type = TYPE_COROUTINE;
+    new_function(TYPE_INT, pool_add("resume"), p3, NULL, &resume_coroutine);
+    new_function(TYPE_ANY, pool_add("yielded"), p3, NULL, &yielded_value);
+
+    // len(a), push(a, v), resize(a, n)
+    param* a = mem_alloc(sizeof(param));
+    a->next = NULL;
+    a->name = pool_add("a");
+    a->type = TYPE_ANY;
+    new_function(TYPE_INT, pool_add("len"), a, NULL, &array_len);
+
+    param* pv = mem_alloc(sizeof(param));
+    pv->next = NULL;
+    pv->name = pool_add("v");
+    pv->type = TYPE_ANY;
+    param* a2 = mem_alloc(sizeof(param));
+    a2->next = pv;
+    a2->name = a->name;
+    a2->type = TYPE_ANY;
+    new_function(TYPE_VOID, pool_add("push"), a2, NULL, &array_push);
+
+    param* pn = mem_alloc(sizeof(param));
+    pn->next = NULL;
+    pn->name = pool_add("n");
+    pn->type = TYPE_INT;
+    param* a3 = mem_alloc(sizeof(param));
+    a3->next = pn;
+    a3->name = a->name;
+    a3->type = TYPE_ANY;
+    new_function(TYPE_VOID, pool_add("resize"), a3, NULL, &array_resize);
+
+    // sum(a), dot(a, b). min & max are intrinsics
+    new_function(TYPE_ANY, pool_add("sum"), a, NULL, &array_sum);
+    param* pb = mem_alloc(sizeof(param));
+    pb->next = NULL;
+    pb->name = pool_add("b");
+    pb->type = TYPE_ANY;
+    param* a4 = mem_alloc(sizeof(param));
+    a4->next = pb;
+    a4->name = a->name;
+    a4->type = TYPE_ANY;
+    new_function(TYPE_ANY, pool_add("dot"), a4, NULL, &array_dot);
+    // cross(a, b) of float3s
+    param* pb3 = mem_alloc(sizeof(param));
+    pb3->next = NULL;
+    pb3->name = pb->name;
+    pb3->type = TYPE_FLOAT3;
+    param* a5 = mem_alloc(sizeof(param));
+    a5->next = pb3;
+    a5->name = a->name;
+    a5->type = TYPE_FLOAT3;
+    new_function(TYPE_FLOAT3, pool_add("cross"), a5, NULL, &vector_cross);
+
+    image* img = NULL;
+    char* orig = NULL;
+    int stale_cache = 0;
+    uint64_t hash = 0;
+
+    if (is_image(path))
+    {
+        if (compile)
+        {
+            ERROR("%s is already compiled\n", path);
+        }
+        img = load_image(path, 0, 0);
+        if (img == NULL)
+        {
+            ERROR("%s is damaged or was compiled by another version of entity\n", path);
+        }
+    }
+    else if (!compile && (stream || (file_size(path) > STREAM_THRESHOLD && sched_threads() == 1)))
+    {
+        // huge sources are read in windows, global declarations are
+        // dropped once evaluated, only function bodies are kept.
+        // there's no image cache, it would need the whole source.
+        FILE* f = fopen(path, "rb");
+        if (f == NULL)
+        {
+            ERROR("no such file\n");
+        }
+        init_lex_stream(f);
+    }
+    else
+    {
+        size_t len;
+        orig = src = read_file(path, &len);
+        hash = source_hash(orig, len);
+
+        if (!compile)
+        {
+            img = load_image(cache, hash, 1);
+            stale_cache = img == NULL && is_image(cache);
+        }
+        if (img == NULL)
+        {
+            lex_source(orig, len);
+        }
+    }
+
+    if (compile)
+    {
+        skip_globals();
+        functions();
+        write_image(out ? out : cache, hash, 0);
+        return 0;
+    }
+
+    // parse
+    program(img);
+    if (!is_image(path))
+    {
+        init_reload(path, hash);
+    }
+
+    if (eager)
+    {
+        thrd_create(&eager_thread, &compile_all, NULL);
+        eager_running = 1;
+    }
+
+    if (profile)
+    {
+        start_profile();
+    }
+
+    if (server)
+    {
+        serve(socket_path);
+    }
+    else if (map != NULL)
+    {
+        map_input(map, 0);
+    }
+    else
+    {
+        char* str = find_string("main");
+        function* entry = find_function(str);
+        if (entry == NULL)
+        {
+            ERROR("main() not found\n");
+        }
+        value result = run_function(entry, NULL);
+
+        // 0 if main() returns nothing
+        if (!IS_NUMBER(result.type))
+        {
+            result.type = TYPE_INT;
+            result.i32 = 0;
+        }
+        output_value(&result);
+        output("\n", 1);
+    }
+    flush_output();
+
+    mem_free(orig);
+
+    if (show_stats)
+    {
+        print_stats(stderr);
+    }
+    if (profile)
+    {
+        // foo.ent -> foo.ent.folded
+        char* folded = mem_alloc(strlen(path) + 8);
+        strcpy(folded, path);
+        strcat(folded, ".folded");
+        print_profile(stderr, folded);
+    }
+
+    // the source changed since it was compiled, the image is refreshed
+    // once the script is done: it compiles every function, and a run
+    // doesn't have to wait for that. not after a reload.
+    if (stale_cache && loaded_hash == hash)
+    {
+        write_image(cache, hash, 1);
+    }
+    return 0;
 }
\ No newline at end of file
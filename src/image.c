@@ -0,0 +1,476 @@
+/*************************
+ * Precompiled Images
+ *************************/
+
+// `entity --compile foo.ent` stores the token stream, the string pool
+// and the function table of foo.ent in foo.entc. loading an image skips
+// lexing, interning and skip_block() over every function body.
+//
+// everything in an image is addressed by index, so it can be mapped
+// anywhere. all functions are compiled before they're written, blocks
+// are linked by relative jumps. the fixups on load turn string indices in ID and STR
+// tokens into pool pointers and rebuild the case tables of switches, done in place
+// on a private mapping.
+//
+// an image is checked before it's used, one that is truncated or
+// corrupt is treated like a stale one: the source is lexed instead.
+// it's written to a temporary file and renamed into place, a reader
+// never sees half of one.
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define IMAGE_MAGIC "ENTC"
+#define IMAGE_VERSION 8
+
+typedef struct image_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t token_size;    // sizeof(token_struct) of the writer
+    uint32_t reserved;
+    uint64_t source_hash;   // fnv-1a of the source the image was made from
+    uint32_t n_tokens;
+    uint32_t tokens_off;
+    uint32_t n_strings;     // NUL-terminated, back to back
+    uint32_t strings_off;
+    uint32_t n_funcs;
+    uint32_t funcs_off;
+    uint32_t n_params;
+    uint32_t params_off;
+} image_header;
+
+typedef struct image_func
+{
+    uint32_t name;          // string index
+    int32_t type;
+    uint32_t body;          // token index of '{'
+    uint32_t params;        // index of the first param
+    uint32_t n_params;
+} image_func;
+
+typedef struct image_param
+{
+    uint32_t name;
+    int32_t type;
+} image_param;
+
+typedef struct image
+{
+    char* base;
+    size_t size;
+    image_header* header;
+    char** strings;         // string index -> pooled string
+} image;
+
+uint64_t source_hash(const char* s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int compare_ptr(const void* a, const void* b)
+{
+    char* x = *(char**)a;
+    char* y = *(char**)b;
+    return (x > y) - (x < y);
+}
+
+// index of a pooled string in the sorted pool
+uint32_t string_index(char** sorted, uint32_t* order, int n, char* s)
+{
+    char** f = bsearch(&s, sorted, n, sizeof(char*), &compare_ptr);
+    if (f == NULL)
+    {
+        ERROR("string %s is not pooled\n", s);
+    }
+    return order[f - sorted];
+}
+
+// --compile fails when the image can't be written, a refresh of a
+// stale cache only warns
+void write_image(const char* path, uint64_t hash, int refresh)
+{
+    for (function* fun = funcs_beg; fun; fun = fun->next)
+    {
+        if (fun->fp == NULL)
+            compile_function(fun);
+    }
+
+    int n_tokens;
+    token_struct* tokens = get_tokens(&n_tokens);
+
+    int n_strings;
+    char** strings = pool_strings(&n_strings);
+
+    // pointer -> index lookup through a sorted copy
+    char** sorted = mem_alloc(n_strings * sizeof(char*));
+    uint32_t* order = mem_alloc(n_strings * sizeof(uint32_t));
+    memcpy(sorted, strings, n_strings * sizeof(char*));
+    qsort(sorted, n_strings, sizeof(char*), &compare_ptr);
+    for (int i = 0; i < n_strings; i++)
+    {
+        char** f = bsearch(&strings[i], sorted, n_strings, sizeof(char*), &compare_ptr);
+        order[f - sorted] = i;
+    }
+
+    uint32_t n_funcs = 0;
+    uint32_t n_params = 0;
+    for (function* f = funcs_beg; f; f = f->next)
+    {
+        if (f->fp != NULL)
+            continue;
+        n_funcs++;
+        for (param* p = f->params; p; p = p->next)
+            n_params++;
+    }
+
+    image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, 4);
+    h.version = IMAGE_VERSION;
+    h.token_size = sizeof(token_struct);
+    h.source_hash = hash;
+    h.n_tokens = n_tokens;
+    h.tokens_off = sizeof(image_header);
+    h.n_funcs = n_funcs;
+    h.funcs_off = h.tokens_off + n_tokens * sizeof(token_struct);
+    h.n_params = n_params;
+    h.params_off = h.funcs_off + n_funcs * sizeof(image_func);
+    h.n_strings = n_strings;
+    h.strings_off = h.params_off + n_params * sizeof(image_param);
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    int failed = f == NULL;
+    if (failed)
+        goto Done;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (int i = 0; i < n_tokens; i++)
+    {
+        token_struct t = tokens[i];
+        if (t.token == ID || t.token == STR)
+        {
+            t.token_val.integer = string_index(sorted, order, n_strings, t.token_val.string);
+        }
+        else if (t.token == SWITCH)
+        {
+            t.token_val.table = NULL;
+        }
+        fwrite(&t, sizeof(t), 1, f);
+    }
+
+    uint32_t param_index = 0;
+    for (function* fun = funcs_beg; fun; fun = fun->next)
+    {
+        if (fun->fp != NULL)
+            continue;
+
+        image_func rec;
+        rec.name = string_index(sorted, order, n_strings, fun->name);
+        rec.type = fun->type;
+        rec.body = (uint32_t)(fun->stat - tokens);
+        rec.params = param_index;
+        rec.n_params = 0;
+        for (param* p = fun->params; p; p = p->next)
+            rec.n_params++;
+        param_index += rec.n_params;
+        fwrite(&rec, sizeof(rec), 1, f);
+    }
+
+    for (function* fun = funcs_beg; fun; fun = fun->next)
+    {
+        if (fun->fp != NULL)
+            continue;
+        for (param* p = fun->params; p; p = p->next)
+        {
+            image_param rec;
+            rec.name = string_index(sorted, order, n_strings, p->name);
+            rec.type = p->type;
+            fwrite(&rec, sizeof(rec), 1, f);
+        }
+    }
+
+    for (int i = 0; i < n_strings; i++)
+    {
+        fwrite(strings[i], strlen(strings[i]) + 1, 1, f);
+    }
+
+    failed = ferror(f);
+    failed |= fclose(f) != 0;
+#ifdef _WIN32
+    // rename() doesn't replace an existing file
+    if (!failed)
+        remove(path);
+#endif
+    failed = failed || rename(tmp, path) != 0;
+
+Done:
+    mem_free(order);
+    mem_free(sorted);
+    mem_free(strings);
+    if (failed)
+    {
+        remove(tmp);
+        if (!refresh)
+        {
+            ERROR("can't write %s\n", path);
+        }
+        fprintf(stderr, "can't refresh %s, the source is lexed again next time\n", path);
+    }
+}
+
+int image_type(int type)
+{
+    return type >= 0 && (type & ~TYPE_ARRAY) < TYPE_ANY;
+}
+
+// every offset, count, index and jump is within the image
+int check_image(char* base, size_t size)
+{
+    image_header* h = (image_header*)base;
+    uint64_t n_tokens = h->n_tokens;
+    if (n_tokens == 0
+        || h->tokens_off % _Alignof(token_struct) != 0
+        || h->funcs_off % _Alignof(image_func) != 0
+        || h->params_off % _Alignof(image_param) != 0
+        || h->tokens_off + n_tokens * sizeof(token_struct) > size
+        || h->funcs_off + (uint64_t)h->n_funcs * sizeof(image_func) > size
+        || h->params_off + (uint64_t)h->n_params * sizeof(image_param) > size
+        || h->strings_off > size)
+        return 0;
+
+    char* s = base + h->strings_off;
+    for (uint32_t i = 0; i < h->n_strings; i++)
+    {
+        char* end = memchr(s, 0, base + size - s);
+        if (end == NULL)
+            return 0;
+        s = end + 1;
+    }
+
+    token_struct* tokens = (token_struct*)(base + h->tokens_off);
+    if (tokens[n_tokens - 1].token != 0)
+        return 0;
+    for (uint64_t i = 0; i < n_tokens; i++)
+    {
+        token_struct* t = &tokens[i];
+        long long left = (long long)(n_tokens - 1 - i);
+        switch (t->token)
+        {
+        case ID:
+        case STR:
+            if ((unsigned long long)t->token_val.integer >= h->n_strings)
+                return 0;
+            break;
+        case TYPE:
+            if (!image_type(t->token_val.type))
+                return 0;
+            break;
+        case '{':
+            if (t->token_val.jump < 0 || t->token_val.jump > left
+                || (t->token_val.jump != 0 && t[t->token_val.jump].token != '}'))
+                return 0;
+            break;
+        case AND:
+        case OR:
+            if (t->token_val.jump <= 0 || t->token_val.jump > left)
+                return 0;
+            break;
+        case FOR:
+            if (t->token_val.integer < 0 || t->token_val.integer > FOR_HOISTED)
+                return 0;
+            break;
+        case MATH:
+            if (t->token_val.integer < 0 || t->token_val.integer >= MATH_COUNT)
+                return 0;
+            break;
+        case LINK:
+            return 0;
+        }
+    }
+
+    image_func* funcs = (image_func*)(base + h->funcs_off);
+    for (uint32_t i = 0; i < h->n_funcs; i++)
+    {
+        if (funcs[i].name >= h->n_strings
+            || !image_type(funcs[i].type)
+            || funcs[i].body >= n_tokens
+            || tokens[funcs[i].body].token != '{'
+            || tokens[funcs[i].body].token_val.jump == 0
+            || (uint64_t)funcs[i].params + funcs[i].n_params > h->n_params)
+            return 0;
+    }
+
+    image_param* params = (image_param*)(base + h->params_off);
+    for (uint32_t i = 0; i < h->n_params; i++)
+    {
+        if (params[i].name >= h->n_strings || !image_type(params[i].type))
+            return 0;
+    }
+    return 1;
+}
+
+// maps the image at path. returns NULL if it doesn't exist, is from
+// another build, is damaged, or (if check_hash) wasn't made from a
+// source with hash.
+image* load_image(const char* path, uint64_t hash, int check_hash)
+{
+    char* base;
+    size_t size;
+
+#ifdef _WIN32
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    base = mem_alloc(size);
+    fread(base, 1, size, f);
+    fclose(f);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    // private & writable: the string fixups are copy-on-write
+    base = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+#endif
+
+    image_header* h = (image_header*)base;
+    if (size < sizeof(image_header)
+        || memcmp(h->magic, IMAGE_MAGIC, 4) != 0
+        || h->version != IMAGE_VERSION
+        || h->token_size != sizeof(token_struct)
+        || (check_hash && h->source_hash != hash)
+        || !check_image(base, size))
+        goto Bad;
+
+    // switches first, a case table that doesn't build is damage too
+    // and nothing points into the image yet
+    token_struct* tokens = (token_struct*)(base + h->tokens_off);
+    jmp_buf* outer = fail_jmp;
+    jmp_buf jmp;
+    if (setjmp(jmp) != 0)
+    {
+        fail_jmp = outer;
+        goto Bad;
+    }
+    fail_jmp = &jmp;
+    for (uint32_t i = 0; i < h->n_tokens; i++)
+    {
+        if (tokens[i].token == SWITCH)
+        {
+            tokens[i].token_val.table = build_switch(&tokens[i]);
+        }
+    }
+    fail_jmp = outer;
+
+    image* img = mem_alloc(sizeof(image));
+    img->base = base;
+    img->size = size;
+    img->header = h;
+    img->strings = mem_alloc((h->n_strings + 1) * sizeof(char*));
+
+    char* s = base + h->strings_off;
+    for (uint32_t i = 0; i < h->n_strings; i++)
+    {
+        img->strings[i] = pool_add_static(s);
+        s += strlen(s) + 1;
+    }
+
+    for (uint32_t i = 0; i < h->n_tokens; i++)
+    {
+        if (tokens[i].token == ID || tokens[i].token == STR)
+        {
+            tokens[i].token_val.string = img->strings[tokens[i].token_val.integer];
+        }
+    }
+    use_tokens(tokens, h->n_tokens);
+
+    return img;
+
+Bad:
+#ifdef _WIN32
+    mem_free(base);
+#else
+    munmap(base, size);
+#endif
+    return NULL;
+}
+
+int is_image(const char* path)
+{
+    char magic[4];
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return 0;
+    size_t n = fread(magic, 1, 4, f);
+    fclose(f);
+    return n == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+}
+
+// registers the function table instead of func()-ing every function
+void load_functions(image* img)
+{
+    image_header* h = img->header;
+    image_func* funcs = (image_func*)(img->base + h->funcs_off);
+    image_param* params = (image_param*)(img->base + h->params_off);
+    int n_tokens;
+    token_struct* tokens = get_tokens(&n_tokens);
+
+    for (uint32_t i = 0; i < h->n_funcs; i++)
+    {
+        param* params_beg = NULL;
+        param* params_end = NULL;
+        for (uint32_t j = 0; j < funcs[i].n_params; j++)
+        {
+            image_param* rec = &params[funcs[i].params + j];
+            param* p = mem_alloc(sizeof(param));
+            p->next = NULL;
+            p->type = rec->type;
+            p->name = img->strings[rec->name];
+
+            if (params_end == NULL)
+            {
+                params_beg = p;
+                params_end = p;
+            }
+            else
+            {
+                params_end->next = p;
+                params_end = p;
+            }
+        }
+
+        function* fun = make_function(
+            funcs[i].type,
+            img->strings[funcs[i].name],
+            params_beg,
+            tokens + funcs[i].body,
+            NULL
+        );
+        atomic_init(&fun->compiled, 1);
+        add_function(fun);
+    }
+}
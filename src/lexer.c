@@ -1,325 +1,922 @@
-#include <stdio.h>
-#include <string.h>
-#include <malloc.h>
-#include "lexer.h"
-#define MAX_NAME_LEN 64
-#define ERROR(...) do { printf(__VA_ARGS__); exit(-1); } while(0);
-
-char *src;
-int token;
-int lineno = 1;
-semantics token_val;
-
-// in value.c
-int get_type(const char* s);
-// forward declaration
-char* pool_add(char* s);
-
-void lex() {
-    char* last_pos;
-
-    while ((token = *src)) {
-        ++src;
-        if (token == '\n') {                // a new line
-            //old_src = src;
-            lineno++;
-        }
-        else if (token == '#') {            // skip comments
-            while (*src != 0 && *src != '\n') {
-                src++;
-            }
-            lineno++;
-        }
-        else if ((token >= 'a' && token <= 'z') || (token >= 'A' && token <= 'Z') || (token == '_')) {
-            last_pos = src - 1;             // process symbols
-            char buf[MAX_NAME_LEN+1];
-            buf[0] = token;
-            while ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') || (*src >= '0' && *src <= '9') || (*src == '_')) {
-                if ((src - last_pos) >= MAX_NAME_LEN) {
-                    ERROR("(%d) identifer too long\n", lineno);
-                }
-                buf[src - last_pos] = *src;
-                src++;
-            }
-            buf[src - last_pos] = 0;                 // get symbol name
-
-            #define KEYWROD(str, T) \
-                if (!strcmp(str, buf)) { token = T; return; }
-
-            KEYWROD("if", IF);
-            KEYWROD("else", ELSE);
-            KEYWROD("while", WHILE);
-            KEYWROD("do", DO);
-            KEYWROD("for", FOR);
-            KEYWROD("continue", CONTINUE);
-            KEYWROD("break", BREAK);
-            KEYWROD("return", RETURN);
-
-            #undef KEYWROD
-
-            int type = get_type(buf);
-            if (type != -1) {
-                token = TYPE;
-                token_val.type = type;
-                return;
-            }
-
-            token = ID;
-            token_val.string = pool_add(buf);
-            return;
-        }
-        else if (token >= '0' && token <= '9') {        // process numbers
-            // TODO: support floating point
-            int integer = token - '0';
-            while (*src >= '0' && *src <= '9') {
-                integer = integer * 10 + *src++ - '0';
-            }
-
-            if (*src != '.')
-            {
-                token = NUM;
-                token_val.integer = integer;
-                return;
-            }
-            else
-            {
-                src++; // skip '.'
-                float floating = (token - '0')/10;
-                while (*src >= '0' && *src <= '9') {
-                    floating = (floating / 10) + (*src++ - '0')/10;
-                }
-                token = FLT;
-                token_val.floating = integer + floating;
-                return;
-            }
-        }
-        else if (token == '\'') {               // parse char
-            // TODO: support escape characters
-            token_val.integer = *src++;
-            token = CHR;
-            src++;
-            return;
-        }
-        else if (token == '"' ) {               // parse string
-            // TODO: support escape characters
-            last_pos = src;
-            int count = 0;
-            while (*src != 0 && *src != '"') {
-                src++;
-                count++;          
-            }
-            if (*src) {
-                *src = 0;
-                token_val.string = pool_add(last_pos);
-                *src = '"';
-                src++;
-            }
-            token = STR;
-            return;
-        }
-        else if (token == '=') {            // parse '==' and '='
-            if (*src == '=') {
-                src++;
-                token = EQU;
-            }
-            return;
-        }
-        else if (token == '!') {               // parse '!='
-            if (*src == '=') {
-                src++;
-                token = NEQ;
-            }
-            return;
-        }
-        else if (token == '<') {               // parse '<=',  or '<'
-            if (*src == '=') {
-                src++;
-                token = LE;
-            }
-            return;
-        }
-        else if (token == '>') {                // parse '>=',  or '>'
-            if (*src == '=') {
-                src++;
-                token = GE;
-            }
-            return;
-        }
-        else if (token == '|') {                // parse  '||'
-            if (*src == '|') {
-                src++;
-                token = OR;
-            }
-            return;
-        }
-        else if (token == '&') {                // parse  '&&'
-            if (*src == '&') {
-                src++;
-                token = AND;
-            }
-            return;
-        }
-        else if (
-            token == '.'
-            || token == '*' 
-            || token == '/'  
-            || token == ';' 
-            || token == ',' 
-            || token == '+' 
-            || token == '-' 
-            || token == '(' 
-            || token == ')' 
-            || token == '{' 
-            || token == '}' 
-            || token == '[' 
-            || token == ']')
-        {
-            return;
-        }
-        else if (token == ' ' || token == '\t') {
-            /* DO NOTHING */
-        }
-        else {
-            ERROR("(%d) unexpected token: %c\n", lineno, token);
-        }
-    }
-}
-
-typedef struct token_struct
-{
-    struct token_struct* next;
-    int token;
-    int lineno;
-    semantics token_val;
-} token_struct;
-
-token_struct* stream_beg = NULL;
-token_struct* stream_end = NULL;
-token_struct* stream_cur = NULL;
-
-void init_lex()
-{
-    // scan all tokens and store them
-    do
-    {
-        lex();
-
-        token_struct* t = malloc(sizeof(token_struct));
-        t->next = NULL;
-        t->token = token;
-        t->lineno = lineno;
-        t->token_val = token_val;
-
-        if (stream_end == NULL)
-        {
-            stream_beg = t;
-            stream_end = t;
-        }
-        else
-        {
-            stream_end->next = t;
-            stream_end = t;
-        }
-    } while (token);
-
-    // load the first token
-    stream_cur = stream_beg;
-    token = stream_cur->token;
-    lineno = stream_cur->lineno;
-    token_val = stream_cur->token_val;
-}
-
-void next()
-{
-    if (stream_cur != stream_end)
-    {
-        // go to next token, if it's not end
-        stream_cur = stream_cur->next;
-    }
-
-    token = stream_cur->token;
-    lineno = stream_cur->lineno;
-    token_val = stream_cur->token_val;
-}
-
-void match(int tk) {
-    if (token == tk) {
-        next();
-    }
-    else {
-        ERROR("(%d) unexpected token: %d, %d required\n", 
-            lineno, token, tk);
-    }
-}
-
-// lexer state management
-
-token_struct* save()
-{
-    return stream_cur;
-}
-
-void restore(token_struct* s)
-{
-    stream_cur = s;
-    token = s->token;
-    token_val = s->token_val;
-    lineno = s->lineno;
-}
-
-// string pool
-
-typedef struct pool_node
-{
-    struct pool_node* next;
-    char* string;
-} pool_node;
-
-pool_node* pool_beg = NULL;
-pool_node* pool_end = NULL;
-
-char* _find_string(pool_node* n, char* s)
-{
-    if (n == NULL)
-    {
-        return NULL;
-    }
-
-    if (!strcmp(n->string, s))
-    {
-        return n->string;
-    }
-
-    return _find_string(n->next, s);
-}
-
-char* find_string(char* s)
-{
-    return _find_string(pool_beg, s);
-}
-
-char* pool_add(char* s)
-{
-    if (pool_end == NULL)
-    {
-        pool_node* n = malloc(sizeof(pool_node));
-        n->next = NULL;
-        n->string = strdup(s);
-        pool_beg = n;
-        pool_end = n;
-        return n->string;
-    }
-
-    char* f = find_string(s);
-    if (f != NULL)
-    {
-        return f;
-    }
-
-    pool_node* n = malloc(sizeof(pool_node));
-    n->next = NULL;
-    n->string = strdup(s);
-    pool_end->next = n;
-    pool_end = n;
-    return n->string;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <threads.h>
+#include "lexer.h"
+#include "stats.h"
+#define MAX_NAME_LEN 64
+#define ERROR(...) do { fail(__VA_ARGS__); } while(0);
+
+THREAD_LOCAL char *src;
+THREAD_LOCAL int token;
+THREAD_LOCAL int lineno = 1;
+THREAD_LOCAL semantics token_val;
+
+// in value.c
+int get_type(const char* s);
+// forward declaration
+char* pool_add(char* s);
+
+// streaming source, see init_lex_stream()
+#define WINDOW_SIZE (1 << 20)
+#define PAGE_TOKENS 65536
+
+FILE* stream_file = NULL;
+char* window = NULL;
+size_t window_size = WINDOW_SIZE;   // doubled for a longer string
+char* window_end = NULL;    // the NUL after the loaded bytes
+char* refill_at = NULL;     // less than half a window left from here on
+int stream_lineno = 1;      // lexer's line, lineno belongs to the parser
+
+// slides the window over the file, returns 0 at the end of the file.
+// a full window is kept and doubled, it holds a string from src on.
+int refill_window()
+{
+    size_t keep = window_end - src;
+    memmove(window, src, keep);
+    if (keep == window_size)
+    {
+        window_size *= 2;
+        window = mem_realloc(window, window_size + 1);
+    }
+    size_t n = fread(window + keep, 1, window_size - keep, stream_file);
+
+    src = window;
+    window_end = window + keep + n;
+    *window_end = 0;
+    // at the end of the file, never again
+    refill_at = n ? window + window_size / 2 : window_end + 1;
+    return n != 0;
+}
+
+// powers of ten that are exact doubles
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// 123 & 0x7f are ints, or longs if they don't fit or end with L.
+// 1.5, 2e-3 are doubles, with an f suffix floats.
+//
+// up to 19 significant digits are collected in an integer. when that's
+// all of them, they fit in a double's 53 bits and the exponent is within
+// 10^22, digits * 10^exp is exact (clinger's fast path). anything else
+// goes to strtod(), which rounds correctly but is slower. a float takes
+// the same path in float, 24 bits and 10^10: rounding to double first
+// and then to float can round twice.
+static void lex_number()
+{
+    char* beg = src - 1;
+    uint64_t n = 0;
+
+    if (token == '0' && (*src == 'x' || *src == 'X')) {
+        src++;
+        int digits = 0;
+        for (;; src++, digits++) {
+            int d;
+            if (*src >= '0' && *src <= '9') d = *src - '0';
+            else if (*src >= 'a' && *src <= 'f') d = *src - 'a' + 10;
+            else if (*src >= 'A' && *src <= 'F') d = *src - 'A' + 10;
+            else break;
+            if (n >> 60) {
+                ERROR("(%d) integer literal too large\n", lineno);
+            }
+            n = n << 4 | d;
+        }
+        if (digits == 0) {
+            ERROR("(%d) bad hex literal\n", lineno);
+        }
+        int is_long = *src == 'L' || *src == 'l';
+        if (is_long) {
+            src++;
+        }
+        // 0xffffffff is an int, all bits set, like it'd be in c
+        token = !is_long && n <= 0xffffffffu ? NUM : LNG;
+        token_val.integer = token == NUM ? (int32_t)(uint32_t)n : (long long)n;
+        goto Suffix;
+    }
+
+    int digits = 0;     // significant digits in n
+    int exp10 = 0;
+    int exact = 1;      // n has all of them
+    int is_float = 0;
+
+    for (src--; *src >= '0' && *src <= '9'; src++) {
+        if (n == 0 && *src == '0')
+            continue;
+        if (digits < 19) {
+            n = n * 10 + (*src - '0');
+            digits++;
+        }
+        else {
+            exact = 0;
+            exp10++;
+        }
+    }
+
+    if (*src == '.') {
+        is_float = 1;
+        for (src++; *src >= '0' && *src <= '9'; src++) {
+            if (n == 0 && *src == '0') {
+                exp10--;
+            }
+            else if (digits < 19) {
+                n = n * 10 + (*src - '0');
+                digits++;
+                exp10--;
+            }
+            else {
+                exact = 0;
+            }
+        }
+    }
+
+    if (*src == 'e' || *src == 'E') {
+        is_float = 1;
+        src++;
+        int sign = 1;
+        if (*src == '+' || *src == '-') {
+            sign = *src++ == '-' ? -1 : 1;
+        }
+        if (*src < '0' || *src > '9') {
+            ERROR("(%d) bad exponent in number\n", lineno);
+        }
+        int e = 0;
+        for (; *src >= '0' && *src <= '9'; src++) {
+            if (e < 100000)
+                e = e * 10 + (*src - '0');
+        }
+        exp10 += sign * e;
+    }
+
+    if (*src == 'f' || *src == 'F') {
+        src++;
+        float f;
+        if (exact && n <= (1ULL << 24) && exp10 >= -10 && exp10 <= 10)
+            f = exp10 < 0 ? (float)n / (float)exact_pow10[-exp10] : (float)n * (float)exact_pow10[exp10];
+        else
+            f = strtof(beg, NULL);
+        token = FLT;
+        token_val.floating = f;
+    }
+    else if (is_float) {
+        if (*src == 'L' || *src == 'l') {
+            ERROR("(%d) long double literals aren't supported\n", lineno);
+        }
+        token = DBL;
+        if (exact && n <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+            token_val.floating = exp10 < 0 ? (double)n / exact_pow10[-exp10] : (double)n * exact_pow10[exp10];
+        else
+            token_val.floating = strtod(beg, NULL);
+    }
+    else {
+        if (!exact || n > INT64_MAX) {
+            ERROR("(%d) integer literal too large\n", lineno);
+        }
+        int is_long = *src == 'L' || *src == 'l';
+        if (is_long) {
+            src++;
+        }
+        token = !is_long && n <= INT32_MAX ? NUM : LNG;
+        token_val.integer = (long long)n;
+    }
+
+Suffix:
+    if ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') || *src == '_' || *src == '.') {
+        ERROR("(%d) bad suffix on number\n", lineno);
+    }
+}
+
+void lex() {
+    char* last_pos;
+
+    for (;;) {
+        // every token starts with at least half a window ahead of it
+        if (stream_file != NULL && src >= refill_at) {
+            refill_window();
+        }
+        if (!(token = *src)) {
+            break;
+        }
+        ++src;
+        if (token == '\n') {                // a new line
+            //old_src = src;
+            lineno++;
+        }
+        else if (token == '#') {            // skip comments
+            while (*src != '\n') {
+                if (*src == 0 && !(stream_file != NULL && refill_window())) {
+                    break;
+                }
+                else if (*src != 0) {
+                    src++;
+                }
+            }
+            lineno++;
+        }
+        else if ((token >= 'a' && token <= 'z') || (token >= 'A' && token <= 'Z') || (token == '_')) {
+            last_pos = src - 1;             // process symbols
+            char buf[MAX_NAME_LEN+1];
+            buf[0] = token;
+            while ((*src >= 'a' && *src <= 'z') || (*src >= 'A' && *src <= 'Z') || (*src >= '0' && *src <= '9') || (*src == '_')) {
+                if ((src - last_pos) >= MAX_NAME_LEN) {
+                    ERROR("(%d) identifer too long\n", lineno);
+                }
+                buf[src - last_pos] = *src;
+                src++;
+            }
+            buf[src - last_pos] = 0;                 // get symbol name
+
+            #define KEYWROD(str, T) \
+                if (!strcmp(str, buf)) { token = T; token_val.integer = 0; return; }
+
+            KEYWROD("if", IF);
+            KEYWROD("else", ELSE);
+            KEYWROD("while", WHILE);
+            KEYWROD("do", DO);
+            KEYWROD("for", FOR);
+            KEYWROD("continue", CONTINUE);
+            KEYWROD("break", BREAK);
+            KEYWROD("return", RETURN);
+            KEYWROD("switch", SWITCH);
+            KEYWROD("case", CASE);
+            KEYWROD("default", DEFAULT);
+            KEYWROD("parallel", PARALLEL);
+            KEYWROD("yield", YIELD);
+            KEYWROD("query", QUERY);
+
+            #undef KEYWROD
+
+            int type = get_type(buf);
+            if (type != -1) {
+                token = TYPE;
+                token_val.type = type;
+                return;
+            }
+
+            token = ID;
+            token_val.string = pool_add(buf);
+            return;
+        }
+        else if (token >= '0' && token <= '9') {        // process numbers
+            lex_number();
+            // it started half a window ahead of the end and ran into it
+            if (stream_file != NULL && src == window_end && !feof(stream_file)) {
+                ERROR("(%d) number too long\n", lineno);
+            }
+            return;
+        }
+        else if (token == '\'') {               // parse char
+            // TODO: support escape characters
+            token_val.integer = *src++;
+            token = CHR;
+            src++;
+            return;
+        }
+        else if (token == '"' ) {               // parse string
+            // TODO: support escape characters
+            last_pos = src;
+            int count = 0;
+            while (*src != '"') {
+                if (*src == 0) {
+                    // longer than the window, refilled from the string on
+                    if (stream_file == NULL) {
+                        break;
+                    }
+                    src = last_pos;
+                    int more = refill_window();
+                    last_pos = src;
+                    src += count;
+                    if (!more) {
+                        break;
+                    }
+                    continue;
+                }
+                src++;
+                count++;          
+            }
+            if (*src) {
+                *src = 0;
+                token_val.string = pool_add(last_pos);
+                *src = '"';
+                src++;
+            }
+            token = STR;
+            return;
+        }
+        else if (token == '=') {            // parse '==' and '='
+            if (*src == '=') {
+                src++;
+                token = EQU;
+            }
+            return;
+        }
+        else if (token == '!') {               // parse '!='
+            if (*src == '=') {
+                src++;
+                token = NEQ;
+            }
+            return;
+        }
+        else if (token == '<') {               // parse '<=',  or '<'
+            if (*src == '=') {
+                src++;
+                token = LE;
+            }
+            return;
+        }
+        else if (token == '>') {                // parse '>=',  or '>'
+            if (*src == '=') {
+                src++;
+                token = GE;
+            }
+            return;
+        }
+        else if (token == '|') {                // parse  '||'
+            if (*src == '|') {
+                src++;
+                token = OR;
+                token_val.jump = 0;
+            }
+            return;
+        }
+        else if (token == '&') {                // parse  '&&'
+            if (*src == '&') {
+                src++;
+                token = AND;
+                token_val.jump = 0;
+            }
+            return;
+        }
+        else if (
+            token == '.'
+            || token == '*' 
+            || token == '/'  
+            || token == ';' 
+            || token == ':'
+            || token == ',' 
+            || token == '+' 
+            || token == '-' 
+            || token == '(' 
+            || token == ')' 
+            || token == '{' 
+            || token == '}' 
+            || token == '[' 
+            || token == ']')
+        {
+            token_val.jump = 0;
+            return;
+        }
+        else if (token == ' ' || token == '\t' || token == '\r') {
+            /* DO NOTHING */
+        }
+        else {
+            ERROR("(%d) unexpected token: %c\n", lineno, token);
+        }
+    }
+}
+
+token_struct* stream_beg = NULL;
+token_struct* stream_end = NULL; // the terminating 0 token, or the last one lexed
+THREAD_LOCAL token_struct* stream_cur = NULL;
+
+// pages of a streamed token stream. a page holds PAGE_TOKENS tokens,
+// a full page ends in a LINK token pointing to the next one.
+token_struct* page_beg = NULL;
+token_struct* page_cur = NULL;  // the page being written
+int page_used = 0;
+
+// scans the tokens from src to its NUL, back to back
+token_struct* lex_all(int* count)
+{
+    int n = 0;
+    int capacity = 1024;
+    token_struct* tokens = mem_alloc(capacity * sizeof(token_struct));
+    int depth = 0;
+    int open = 0;           // the '{' of the current top-level block
+
+    do
+    {
+        lex();
+
+        if (n == capacity)
+        {
+            capacity *= 2;
+            tokens = mem_realloc(tokens, capacity * sizeof(token_struct));
+        }
+
+        token_struct* t = &tokens[n++];
+        t->token = token;
+        t->lineno = lineno;
+        t->token_val = token_val;
+
+        if (token == '{' && depth++ == 0)
+        {
+            open = n - 1;
+        }
+        else if (token == '}' && depth > 0 && --depth == 0)
+        {
+            tokens[open].token_val.jump = n - 1 - open;
+        }
+    } while (token);
+
+    *count = n;
+    return tokens;
+}
+
+void init_lex()
+{
+    int count;
+    token_struct* tokens = lex_all(&count);
+    use_tokens(tokens, count);
+}
+
+void link_blocks(token_struct* t)
+{
+    int capacity = 64;
+    int depth = 0;
+    token_struct** open = mem_alloc(capacity * sizeof(token_struct*));
+
+    for (; t->token; t++)
+    {
+        if (t->token == '{')
+        {
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                open = mem_realloc(open, capacity * sizeof(token_struct*));
+            }
+            open[depth++] = t;
+        }
+        else if (t->token == '}')
+        {
+            token_struct* o = open[--depth];
+            o->token_val.jump = t - o;
+            if (depth == 0)
+                break;
+        }
+    }
+    mem_free(open);
+}
+
+// parallel lexing
+
+// skips a string, char or comment starting at s. lines are counted
+// the way lex() does: not inside literals, one extra after a comment.
+static char* skip_literal(char* s, int* lines)
+{
+    if (*s == '"')
+    {
+        s++;
+        while (*s && *s != '"')
+            s++;
+        return *s ? s + 1 : s;
+    }
+    if (*s == '\'')
+    {
+        for (int i = 0; i < 3 && *s; i++)
+            s++;
+        return s;
+    }
+    // '#'
+    while (*s && *s != '\n')
+    {
+        s++;
+    }
+    (*lines)++;
+    return s;
+}
+
+int split_source(char* s, size_t len, source_chunk* chunks, int n)
+{
+    size_t target = len / n;
+    int count = 0;
+    int lines = 1;
+    int depth = 0;
+    char* end = s + len;
+    char* beg = s;
+    char* p = s;
+
+    while (p < end && count < n - 1)
+    {
+        if (*p == '"' || *p == '\'' || *p == '#')
+        {
+            p = skip_literal(p, &lines);
+            continue;
+        }
+        if (*p == '{')
+            depth++;
+        else if (*p == '}')
+            depth--;
+        else if (*p == '\n')
+            lines++;
+
+        // cut at the line break right after a top-level '}'
+        if (*p == '}' && depth == 0 && p - beg >= (ptrdiff_t)target)
+        {
+            char* q = p + 1;
+            while (*q == ' ' || *q == '\t' || *q == '\r')
+                q++;
+            if (*q == '\n')
+            {
+                source_chunk* c = &chunks[count++];
+                c->beg = beg;
+                c->end = q;
+                c->lineno = chunks == c ? 1 : c[-1].end_lineno;
+                c->end_lineno = ++lines;
+                *q = 0;
+                beg = p = q + 1;
+                continue;
+            }
+        }
+        p++;
+    }
+
+    source_chunk* c = &chunks[count++];
+    c->beg = beg;
+    c->end = NULL;
+    c->lineno = count == 1 ? 1 : c[-1].end_lineno;
+    return count;
+}
+
+void lex_chunk(source_chunk* c)
+{
+    src = c->beg;
+    lineno = c->lineno;
+    c->tokens = lex_all(&c->count);
+}
+
+void join_chunks(source_chunk* chunks, int n)
+{
+    int total = 1;
+    for (int i = 0; i < n; i++)
+    {
+        total += chunks[i].count - 1;
+    }
+
+    token_struct* tokens = mem_alloc(total * sizeof(token_struct));
+    int at = 0;
+    for (int i = 0; i < n; i++)
+    {
+        source_chunk* c = &chunks[i];
+        // every chunk but the last drops its terminating 0 token
+        int count = i == n - 1 ? c->count : c->count - 1;
+        memcpy(tokens + at, c->tokens, count * sizeof(token_struct));
+        mem_free(c->tokens);
+        c->tokens = tokens + at;
+        at += count;
+
+        if (c->end != NULL)
+        {
+            *c->end = '\n';
+        }
+    }
+
+    use_tokens(tokens, total);
+}
+
+void use_tokens(token_struct* tokens, int count)
+{
+    stream_beg = tokens;
+    stream_end = tokens + count - 1;
+
+    // load the first token
+    restore(stream_beg);
+}
+
+void append_token()
+{
+    if (page_used == PAGE_TOKENS)
+    {
+        token_struct* page = mem_alloc((PAGE_TOKENS + 1) * sizeof(token_struct));
+        page_cur[PAGE_TOKENS].token = LINK;
+        page_cur[PAGE_TOKENS].token_val.link = page;
+        page_cur = page;
+        page_used = 0;
+    }
+
+    token_struct* t = &page_cur[page_used++];
+    t->token = token;
+    t->lineno = lineno;
+    t->token_val = token_val;
+    stream_end = t;
+}
+
+// lexes the next token of a streamed source
+void lex_stream()
+{
+    int parser_lineno = lineno;
+    lineno = stream_lineno;
+    lex();
+    stream_lineno = lineno;
+    append_token();
+    lineno = parser_lineno;
+
+    if (token == 0)
+    {
+        // everything is lexed, the rest are plain tokens
+        fclose(stream_file);
+        stream_file = NULL;
+        mem_free(window);
+        window = NULL;
+    }
+}
+
+void init_lex_stream(FILE* f)
+{
+    stream_file = f;
+    window_size = WINDOW_SIZE;
+    window = mem_alloc(window_size + 1);
+    src = window;
+    window_end = window;
+    *window_end = 0;
+    refill_at = window;
+
+    page_beg = mem_alloc((PAGE_TOKENS + 1) * sizeof(token_struct));
+    page_cur = page_beg;
+    page_used = 0;
+    stream_beg = page_beg;
+
+    lex_stream();
+    restore(stream_beg);
+}
+
+void lex_discard()
+{
+    if (page_beg == NULL)
+        return;
+
+    // the tokens still ahead of the parser, usually just one
+    int ahead = 0;
+    token_struct tmp[16];
+    for (token_struct* t = stream_cur; ; t++)
+    {
+        if (t->token == LINK)
+            t = t->token_val.link;
+        if (ahead == 16)
+            return;
+        tmp[ahead++] = *t;
+        if (t == stream_end)
+            break;
+    }
+
+    for (token_struct* p = page_beg; p != page_cur; )
+    {
+        token_struct* next_page = p[PAGE_TOKENS].token_val.link;
+        if (p != page_beg)
+            mem_free(p);
+        p = next_page;
+    }
+    if (page_cur != page_beg)
+        mem_free(page_cur);
+
+    page_cur = page_beg;
+    page_used = 0;
+    for (int i = 0; i < ahead; i++)
+    {
+        page_beg[page_used++] = tmp[i];
+    }
+    stream_end = &page_beg[page_used - 1];
+    stream_cur = page_beg;
+}
+
+token_struct* get_tokens(int* count)
+{
+    *count = (int)(stream_end - stream_beg) + 1;
+    return stream_beg;
+}
+
+void next()
+{
+    if (stream_cur == stream_end && stream_file != NULL)
+    {
+        lex_stream();
+    }
+
+    if (stream_cur->token != 0)
+    {
+        // go to next token, if it's not end
+        stream_cur++;
+        if (stream_cur->token == LINK)
+        {
+            stream_cur = stream_cur->token_val.link;
+        }
+    }
+
+    token = stream_cur->token;
+    lineno = stream_cur->lineno;
+    token_val = stream_cur->token_val;
+}
+
+void match(int tk) {
+    if (token == tk) {
+        next();
+    }
+    else {
+        ERROR("(%d) unexpected token: %d, %d required\n", 
+            lineno, token, tk);
+    }
+}
+
+// lexer state management
+
+token_struct* save()
+{
+    return stream_cur;
+}
+
+void restore(token_struct* s)
+{
+    stream_cur = s;
+    token = s->token;
+    token_val = s->token_val;
+    lineno = s->lineno;
+}
+
+// string pool
+// a hash table of interned strings. while lexing in parallel, every
+// bucket is guarded by one of POOL_STRIPES locks.
+
+#define POOL_STRIPES 64
+#define POOL_MIN_BUCKETS 1024
+
+typedef struct pool_node
+{
+    struct pool_node* next; // next in the same bucket
+    unsigned hash;
+    char* string;
+} pool_node;
+
+pool_node** pool_buckets = NULL;
+unsigned pool_mask = 0;             // number of buckets - 1
+int pool_counts[POOL_STRIPES];      // strings per stripe
+int pool_locking = 0;
+mtx_t pool_locks[POOL_STRIPES];
+
+unsigned hash_string(const char* s)
+{
+    unsigned h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int pool_size()
+{
+    int size = 0;
+    for (int i = 0; i < POOL_STRIPES; i++)
+    {
+        size += pool_counts[i];
+    }
+    return size;
+}
+
+// room for about n strings, single threaded only
+void pool_reserve(int n)
+{
+    unsigned buckets = POOL_MIN_BUCKETS;
+    while (buckets < (unsigned)n)
+    {
+        buckets *= 2;
+    }
+    if (pool_buckets != NULL && buckets <= pool_mask + 1)
+    {
+        return;
+    }
+
+    pool_node** old = pool_buckets;
+    unsigned old_count = pool_buckets ? pool_mask + 1 : 0;
+
+    pool_buckets = mem_alloc(buckets * sizeof(pool_node*));
+    memset(pool_buckets, 0, buckets * sizeof(pool_node*));
+    pool_mask = buckets - 1;
+
+    for (unsigned i = 0; i < old_count; i++)
+    {
+        pool_node* n = old[i];
+        while (n != NULL)
+        {
+            pool_node* next = n->next;
+            n->next = pool_buckets[n->hash & pool_mask];
+            pool_buckets[n->hash & pool_mask] = n;
+            n = next;
+        }
+    }
+    mem_free(old);
+}
+
+void pool_begin_parallel(int expected)
+{
+    pool_reserve(expected);
+    for (int i = 0; i < POOL_STRIPES; i++)
+    {
+        mtx_init(&pool_locks[i], mtx_plain);
+    }
+    pool_locking = 1;
+}
+
+void pool_end_parallel()
+{
+    pool_locking = 0;
+    for (int i = 0; i < POOL_STRIPES; i++)
+    {
+        mtx_destroy(&pool_locks[i]);
+    }
+}
+
+pool_node* pool_find(char* s, unsigned hash)
+{
+    for (pool_node* n = pool_buckets[hash & pool_mask]; n; n = n->next)
+    {
+        STAT_INC(pool_probes);
+        if (n->hash == hash && !strcmp(n->string, s))
+        {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+char* find_string(char* s)
+{
+    if (pool_buckets == NULL)
+    {
+        return NULL;
+    }
+    pool_node* n = pool_find(s, hash_string(s));
+    return n ? n->string : NULL;
+}
+
+// copy != 0: a copy of s goes into the pool,
+// otherwise s itself, which must stay alive.
+char* pool_insert(char* s, int copy)
+{
+    if (pool_buckets == NULL)
+    {
+        pool_reserve(0);
+    }
+
+    unsigned hash = hash_string(s);
+    int stripe = hash % POOL_STRIPES;
+    if (pool_locking)
+    {
+        mtx_lock(&pool_locks[stripe]);
+    }
+
+    pool_node* n = pool_find(s, hash);
+    if (n == NULL)
+    {
+        n = mem_alloc(sizeof(pool_node));
+        n->hash = hash;
+        n->string = s;
+        if (copy)
+        {
+            n->string = mem_alloc(strlen(s) + 1);
+            strcpy(n->string, s);
+        }
+        n->next = pool_buckets[hash & pool_mask];
+        pool_buckets[hash & pool_mask] = n;
+        pool_counts[stripe]++;
+    }
+
+    if (pool_locking)
+    {
+        mtx_unlock(&pool_locks[stripe]);
+    }
+    else if (pool_counts[stripe] * POOL_STRIPES > 2 * (int)(pool_mask + 1))
+    {
+        pool_reserve(4 * (pool_mask + 1));
+    }
+    return n->string;
+}
+
+char* pool_add(char* s)
+{
+    return pool_insert(s, 1);
+}
+
+char* pool_add_static(char* s)
+{
+    return pool_insert(s, 0);
+}
+
+char** pool_strings(int* count)
+{
+    char** strings = mem_alloc((pool_size() + 1) * sizeof(char*));
+    int i = 0;
+    for (unsigned b = 0; pool_buckets && b <= pool_mask; b++)
+    {
+        for (pool_node* n = pool_buckets[b]; n; n = n->next)
+        {
+            strings[i++] = n->string;
+        }
+    }
+    *count = i;
+    return strings;
 }
\ No newline at end of file
@@ -1,36 +1,100 @@
-#ifndef ENTITY_LEXER_H
-#define ENTITY_LEXER_H
-
-// tokens
-enum {
-    TYPE = 128, ID, NUM, FLT, CHR, STR,
-    IF, ELSE, WHILE, DO, FOR, CONTINUE, BREAK, RETURN,
-    EQU, NEQ, LE, GE, OR, AND,
-};
-
-typedef union semantics {
-    int type;
-    char* string;
-    double floating;
-    long long integer;
-} semantics;
-
-extern char *src;
-extern int token;
-extern int lineno;
-extern semantics token_val;
-
-void init_lex();
-void next();
-void match(int tk);
-
-typedef struct token_struct token_struct;
-
-token_struct* save();
-void restore(token_struct* s);
-
-// string pool
-char* find_string(char* s);
-char* pool_add(char* s);
-
+#ifndef ENTITY_LEXER_H
+#define ENTITY_LEXER_H
+
+// tokens
+enum {
+    TYPE = 128, ID, NUM, LNG, FLT, DBL, CHR, STR, // int, long, float & double literals
+    IF, ELSE, WHILE, DO, FOR, CONTINUE, BREAK, RETURN,
+    SWITCH, CASE, DEFAULT,
+    EQU, NEQ, LE, GE, OR, AND,
+    PARALLEL, YIELD, QUERY,
+    MATH, // a call of a math intrinsic, made from ID by compile_function()
+    LINK, // joins the pages of a streamed token stream, never seen by the parser
+};
+
+// interpreter state that every thread owns a copy of
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// reports an error, see output.c. a server request, a parallel for or
+// a reload catches it, otherwise it exits.
+_Noreturn void fail(const char* fmt, ...);
+
+typedef union semantics {
+    struct token_struct* link;
+    int type;
+    char* string;
+    double floating;
+    long long integer;
+    long long jump;     // '{': tokens to the matching '}', 0 if not linked yet
+    struct switch_table* table; // SWITCH: its cases, NULL if not built
+} semantics;
+
+extern THREAD_LOCAL char *src;
+extern THREAD_LOCAL int token;
+extern THREAD_LOCAL int lineno;
+extern THREAD_LOCAL semantics token_val;
+
+typedef struct token_struct
+{
+    int token;
+    int lineno;
+    semantics token_val;
+} token_struct;
+
+// the lexer links the braces of top-level blocks only,
+// link_blocks() links every block nested in the block at t.
+void link_blocks(token_struct* t);
+
+void init_lex();
+void next();
+void match(int tk);
+
+// the token stream is one array ending with a 0 token.
+// use_tokens() takes over an array that was lexed elsewhere.
+void use_tokens(token_struct* tokens, int count);
+token_struct* get_tokens(int* count);
+
+// streaming mode: the source is read in windows and tokens are lexed
+// as the parser asks for them. lex_discard() drops every token behind
+// the parser, it must not be restore()d to them again.
+void init_lex_stream(FILE* f);
+void lex_discard();
+
+// parallel lexing: split_source() cuts a source into at most n chunks
+// at line breaks after top-level '}', so every chunk but the first one
+// starts with a function. lex_chunk() can run on any thread while the
+// pool is in parallel mode. join_chunks() makes one token stream of
+// them, chunk->tokens then points to the chunk's part of it.
+typedef struct source_chunk
+{
+    char* beg;
+    char* end;          // the line break replaced by NUL, NULL for the last one
+    int lineno;
+    int end_lineno;
+    token_struct* tokens;
+    int count;
+} source_chunk;
+
+int split_source(char* s, size_t len, source_chunk* chunks, int n);
+void lex_chunk(source_chunk* c);
+void join_chunks(source_chunk* chunks, int n);
+
+token_struct* save();
+void restore(token_struct* s);
+
+// string pool
+char* find_string(char* s);
+char* pool_add(char* s);
+char* pool_add_static(char* s);
+// make room for about `expected` strings and guard the pool with
+// locks, for lexing on several threads at once.
+void pool_begin_parallel(int expected);
+void pool_end_parallel();
+// every pooled string, in no particular order. free() the array.
+char** pool_strings(int* count);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+/*************************
+ * Map Mode
+ *************************/
+
+// `entity --map fn script.ent < in.csv > out.csv` calls fn once for
+// every line of stdin. the comma separated fields of the line are its
+// arguments, converted to the types of its parameters, and what fn
+// returns is printed on a line of its own. a void fn prints nothing,
+// blank lines are skipped.
+//
+// stdin is read in blocks, only the line being mapped is kept. fields
+// of up to 15 chars are inline strings, longer ones and the strings
+// made while a record is mapped are freed after it, see str.c.
+
+#define MAP_BLOCK (64 * 1024)
+#define MAX_FIELDS 64
+
+// runs fun from the host, like call() does from a script.
+// args are of the types of its parameters.
+value run_function(function* fun, value* args)
+{
+    new_scope();
+    int i = 0;
+    for (param* p = fun->params; p; p = p->next)
+    {
+        new_variable(p->name, args[i++]);
+    }
+
+    prof_frame frame;
+    profile_enter(&frame, fun);
+    compile_function(fun);
+    token_struct* cur = save();
+    restore(fun->stat);
+    value ret = block();
+    // NULL on a thread that hasn't run any script yet
+    if (cur != NULL)
+        restore(cur);
+    profile_exit(&frame);
+    exit_scope();
+
+    if (IS_NUMBER(ret.type) && IS_NUMBER(fun->type))
+    {
+        convert_number(&ret, fun->type);
+    }
+    retflag = 0;
+    return ret;
+}
+
+// splits a line in place. a quoted field may hold commas and "" for ".
+// returns the number of fields, at most max.
+int split_record(char* line, char** fields, int* lens, int max)
+{
+    int n = 0;
+    char* p = line;
+    for (;;)
+    {
+        if (n == max)
+            return max + 1;
+
+        char* beg = p;
+        char* out = p;
+        if (*p == '"')
+        {
+            for (p++; *p; p++)
+            {
+                if (*p == '"' && p[1] == '"')
+                    *out++ = *p++;
+                else if (*p == '"')
+                    break;
+                else
+                    *out++ = *p;
+            }
+            if (*p == '"')
+                p++;
+        }
+        else
+        {
+            while (*p && *p != ',')
+                p++;
+            out = p;
+        }
+
+        int last = *p != ',';
+        *out = 0;
+        fields[n] = beg;
+        lens[n] = (int)(out - beg);
+        n++;
+        if (last)
+            return n;
+        p++;
+    }
+}
+
+value parse_field(int type, char* s, int len, long long line, int field)
+{
+    value v;
+    memset(&v, 0, sizeof(value));
+    v.type = type;
+    if (type == TYPE_STRING || type == TYPE_ANY)
+    {
+        v.type = TYPE_STRING;
+        v.str = string_from(s, len);
+        return v;
+    }
+    if (type == TYPE_CHAR)
+    {
+        if (len != 1)
+        {
+            ERROR("line %lld, field %d: '%s' isn't a char\n", line, field, s);
+        }
+        v.i8 = s[0];
+        return v;
+    }
+
+    char* end;
+    if (type == TYPE_FLOAT || type == TYPE_DOUBLE)
+    {
+        v.type = TYPE_DOUBLE;
+        v.f64 = strtod(s, &end);
+    }
+    else if (type == TYPE_ULONG)
+    {
+        v.type = TYPE_ULONG;
+        v.u64 = strtoull(s, &end, 10);
+    }
+    else
+    {
+        v.type = TYPE_LONG;
+        v.i64 = strtoll(s, &end, 10);
+    }
+    // spaces around a number are fine
+    while (*end == ' ')
+        end++;
+    if (len == 0 || *end != 0)
+    {
+        ERROR("line %lld, field %d: '%s' can't be read as %s\n", line, field, s, type_name(type));
+    }
+    convert_number(&v, type);
+    return v;
+}
+
+// binds the fields of s to the parameters of fun
+void bind_record(function* fun, int n_params, char* s, value* args, long long line)
+{
+    char* fields[MAX_FIELDS];
+    int lens[MAX_FIELDS];
+
+    int n = split_record(s, fields, lens, n_params);
+    if (n != n_params)
+    {
+        ERROR("line %lld: %s%d fields, %s takes %d\n",
+            line, n > n_params ? "more than " : "", n > n_params ? n_params : n, fun->name, n_params);
+    }
+
+    int i = 0;
+    for (param* p = fun->params; p; p = p->next, i++)
+    {
+        args[i] = parse_field(p->type, fields[i], lens[i], line, i + 1);
+    }
+}
+
+// the number of parameters of a function that can take records
+int record_params(function* fun)
+{
+    if (fun->fp != NULL)
+    {
+        ERROR("%s is native\n", fun->name);
+    }
+    if (fun->type == TYPE_COROUTINE)
+    {
+        ERROR("%s is a coroutine\n", fun->name);
+    }
+
+    int n_params = 0;
+    for (param* p = fun->params; p; p = p->next)
+    {
+        if (!IS_NUMBER(p->type) && p->type != TYPE_STRING && p->type != TYPE_ANY)
+        {
+            ERROR("%s can't take a %s from a record\n", fun->name, type_name(p->type));
+        }
+        n_params++;
+    }
+    if (n_params > MAX_FIELDS)
+    {
+        ERROR("%s takes more than %d parameters\n", fun->name, MAX_FIELDS);
+    }
+    return n_params;
+}
+
+// reads with read(), a pipe or socket gives what it has so far
+typedef struct line_reader
+{
+    int fd;
+    char* buf;
+    size_t size;
+    size_t beg;     // buf[beg, end) isn't read yet
+    size_t end;
+} line_reader;
+
+void init_reader(line_reader* r, int fd)
+{
+    r->fd = fd;
+    r->size = MAP_BLOCK;
+    r->buf = mem_alloc(r->size + 1);
+    r->beg = 0;
+    r->end = 0;
+}
+
+void free_reader(line_reader* r)
+{
+    mem_free(r->buf);
+}
+
+// the next whole line in the buffer without its line break, NULL if
+// there's none yet. at the end of the input the rest is the last line.
+// it's valid until the reader is used again.
+char* next_line(line_reader* r, size_t* len, int at_end)
+{
+    char* nl = memchr(r->buf + r->beg, '\n', r->end - r->beg);
+    if (nl == NULL)
+    {
+        if (!at_end || r->beg == r->end)
+            return NULL;
+        // the last line has no line break
+        nl = r->buf + r->end;
+    }
+
+    char* line = r->buf + r->beg;
+    size_t n = nl - line;
+    r->beg = nl == r->buf + r->end ? r->end : r->beg + n + 1;
+    if (n > 0 && line[n - 1] == '\r')
+        n--;
+    line[n] = 0;
+    *len = n;
+    return line;
+}
+
+// reads what the fd has, 0 at the end of the input
+int fill_reader(line_reader* r)
+{
+    // move the partial line to the front, make room if it's long
+    memmove(r->buf, r->buf + r->beg, r->end - r->beg);
+    r->end -= r->beg;
+    r->beg = 0;
+    if (r->end == r->size)
+    {
+        r->size *= 2;
+        r->buf = mem_realloc(r->buf, r->size + 1);
+    }
+    int got = (int)read(r->fd, r->buf + r->end, (unsigned)(r->size - r->end));
+    if (got <= 0)
+        return 0;
+    r->end += got;
+    return 1;
+}
+
+// the next line, NULL at the end of the input
+char* read_line(line_reader* r, size_t* len)
+{
+    for (;;)
+    {
+        char* line = next_line(r, len, 0);
+        if (line != NULL)
+            return line;
+        if (!fill_reader(r))
+            return next_line(r, len, 1);
+    }
+}
+
+void map_input(const char* name, int fd)
+{
+    function* fun = find_function(find_string((char*)name));
+    if (fun == NULL)
+    {
+        ERROR("--map: no function %s in the script\n", name);
+    }
+    int n_params = record_params(fun);
+
+    line_reader r;
+    init_reader(&r, fd);
+    value args[MAX_FIELDS];
+    long long n_lines = 0;
+    size_t len;
+    for (char* line; (line = read_line(&r, &len)) != NULL; )
+    {
+        // blank lines aren't records
+        n_lines++;
+        if (len == 0)
+            continue;
+
+        // the strings of a record are freed with it
+        str_mark mark = str_mark_arena();
+        bind_record(fun, n_params, line, args, n_lines);
+        value ret = run_function(fun, args);
+        if (ret.type != TYPE_VOID)
+        {
+            output_value(&ret);
+            output("\n", 1);
+        }
+        str_release(mark);
+    }
+    free_reader(&r);
+}
@@ -0,0 +1,219 @@
+/*************************
+ * Math Intrinsics
+ *************************/
+
+// sqrt, sin, cos, floor, abs, min, max & pow are evaluated right in
+// factor(), no scope is made for their arguments. compile_function()
+// turns their calls into MATH tokens holding the index of the
+// intrinsic, unless the script defines a function of the same name.
+//
+// a float argument gives a float, other numbers a double, except abs,
+// min & max, which keep the type of their operands like c operators.
+// min(a) & max(a) of an array are the simd reductions.
+
+#include <math.h>
+
+value expression();
+
+enum { MATH_SQRT, MATH_SIN, MATH_COS, MATH_FLOOR, MATH_ABS, MATH_MIN, MATH_MAX, MATH_POW, MATH_COUNT };
+
+const char* math_names[MATH_COUNT] = { "sqrt", "sin", "cos", "floor", "abs", "min", "max", "pow" };
+char* math_pooled[MATH_COUNT];
+
+void init_math()
+{
+    for (int i = 0; i < MATH_COUNT; i++)
+        math_pooled[i] = pool_add((char*)math_names[i]);
+}
+
+// name is pooled. -1 if it isn't an intrinsic
+int find_intrinsic(const char* name)
+{
+    for (int i = 0; i < MATH_COUNT; i++)
+    {
+        if (math_pooled[i] == name)
+            return i;
+    }
+    return -1;
+}
+
+// t is a linked '{'
+void link_intrinsics(token_struct* t)
+{
+    for (token_struct* end = t + t->token_val.jump; t < end; t++)
+    {
+        if (t->token != ID || t[1].token != '(')
+            continue;
+        int fn = find_intrinsic(t->token_val.string);
+        if (fn >= 0 && find_function(t->token_val.string) == NULL)
+        {
+            t->token = MATH;
+            t->token_val.integer = fn;
+        }
+    }
+}
+
+void check_number(int fn, const value* v)
+{
+    if (!IS_NUMBER(v->type))
+    {
+        ERROR("(%d) %s of %s\n", lineno, math_names[fn], type_name(v->type));
+    }
+}
+
+value math_abs(value x)
+{
+    value r;
+    memset(&r, 0, sizeof(value));
+    switch (x.type)
+    {
+    case TYPE_FLOAT:
+        r.type = TYPE_FLOAT;
+        r.f32 = fabsf(x.f32);
+        break;
+    case TYPE_DOUBLE:
+        r.type = TYPE_DOUBLE;
+        r.f64 = fabs(x.f64);
+        break;
+    case TYPE_LONG:
+        r.type = TYPE_LONG;
+        r.i64 = x.i64 < 0 ? (int64_t)(0 - (uint64_t)x.i64) : x.i64;
+        break;
+    case TYPE_UINT:
+    case TYPE_ULONG:
+        r = x;
+        break;
+    default:
+        // char & short are promoted, like c
+        r.type = TYPE_INT;
+        r.i32 = (int32_t)number_i64(&x);
+        if (r.i32 < 0)
+            r.i32 = (int32_t)(0 - (uint32_t)r.i32);
+        break;
+    }
+    return r;
+}
+
+value math_min_max(int fn, value a, value b)
+{
+    value r;
+    memset(&r, 0, sizeof(value));
+    r.type = common_type(&a, &b);
+    if (r.type == TYPE_INT && a.type == TYPE_INT && b.type == TYPE_INT)
+    {
+        r.i32 = (a.i32 < b.i32) == (fn == MATH_MIN) ? a.i32 : b.i32;
+    }
+    else if (r.type == TYPE_FLOAT || r.type == TYPE_DOUBLE)
+    {
+        double x = number_f64(&a);
+        double y = number_f64(&b);
+        r.type = TYPE_DOUBLE;
+        r.f64 = fn == MATH_MIN ? fmin(x, y) : fmax(x, y);
+        convert_number(&r, common_type(&a, &b));
+    }
+    else
+    {
+        int64_t x = number_i64(&a);
+        int64_t y = number_i64(&b);
+        r.type = TYPE_LONG;
+        r.i64 = (x < y) == (fn == MATH_MIN) ? x : y;
+        convert_number(&r, common_type(&a, &b));
+    }
+    return r;
+}
+
+value math_func(int fn, value x)
+{
+    value r;
+    memset(&r, 0, sizeof(value));
+    if (x.type == TYPE_FLOAT)
+    {
+        r.type = TYPE_FLOAT;
+        switch (fn)
+        {
+        case MATH_SQRT:  r.f32 = sqrtf(x.f32); break;
+        case MATH_SIN:   r.f32 = sinf(x.f32); break;
+        case MATH_COS:   r.f32 = cosf(x.f32); break;
+        default:         r.f32 = floorf(x.f32); break;
+        }
+    }
+    else
+    {
+        double d = number_f64(&x);
+        r.type = TYPE_DOUBLE;
+        switch (fn)
+        {
+        case MATH_SQRT:  r.f64 = sqrt(d); break;
+        case MATH_SIN:   r.f64 = sin(d); break;
+        case MATH_COS:   r.f64 = cos(d); break;
+        default:         r.f64 = floor(d); break;
+        }
+    }
+    return r;
+}
+
+value math_pow(value a, value b)
+{
+    value r;
+    memset(&r, 0, sizeof(value));
+    if (common_type(&a, &b) == TYPE_FLOAT)
+    {
+        r.type = TYPE_FLOAT;
+        r.f32 = powf((float)number_f64(&a), (float)number_f64(&b));
+    }
+    else
+    {
+        r.type = TYPE_DOUBLE;
+        r.f64 = pow(number_f64(&a), number_f64(&b));
+    }
+    return r;
+}
+
+// the current token is the '(' after the name
+value math_call(int fn)
+{
+    value args[2];
+    int n = 0;
+    match('(');
+    while (token != ')')
+    {
+        if (n == 2)
+        {
+            ERROR("(%d) too many arguments to %s\n", lineno, math_names[fn]);
+        }
+        args[n++] = expression();
+        if (token != ')')
+            match(',');
+    }
+    match(')');
+
+    int arity = fn == MATH_POW ? 2 : fn == MATH_MIN || fn == MATH_MAX ? n : 1;
+    if (n == 0 || n != arity)
+    {
+        ERROR("(%d) %s takes %d argument%s\n", lineno, math_names[fn],
+            arity == 2 ? 2 : 1, arity == 2 ? "s" : "");
+    }
+
+    // min(a), max(a)
+    if (n == 1 && (fn == MATH_MIN || fn == MATH_MAX))
+    {
+        if (!IS_ARRAY(args[0].type))
+        {
+            ERROR("(%d) %s of one %s, an array or 2 numbers required\n",
+                lineno, math_names[fn], type_name(args[0].type));
+        }
+        return reduce_array(numeric_array(args[0].arr), fn == MATH_MIN ? '<' : '>');
+    }
+
+    for (int i = 0; i < n; i++)
+        check_number(fn, &args[i]);
+
+    switch (fn)
+    {
+    case MATH_ABS:  return math_abs(args[0]);
+    case MATH_MIN:
+    case MATH_MAX:  return math_min_max(fn, args[0], args[1]);
+    case MATH_POW:  return math_pow(args[0], args[1]);
+    default:        return math_func(fn, args[0]);
+    }
+}
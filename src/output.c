@@ -0,0 +1,158 @@
+/*************************
+ * Output
+ *************************/
+
+// print() appends to one buffer shared by all threads. it's written to
+// stdout when it's full, on flush(), before an error message and at
+// exit. on a terminal every print() is written at once.
+
+#include <stdarg.h>
+#include <setjmp.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define read _read
+#else
+#include <unistd.h>
+#endif
+
+#define OUT_SIZE (64 * 1024)
+
+char out_buf[OUT_SIZE];
+size_t out_len = 0;
+int out_tty = 0;
+mtx_t out_lock;
+
+// out_lock is held
+void write_output()
+{
+    fwrite(out_buf, 1, out_len, stdout);
+    fflush(stdout);
+    out_len = 0;
+}
+
+void flush_output()
+{
+    mtx_lock(&out_lock);
+    write_output();
+    mtx_unlock(&out_lock);
+}
+
+void init_output()
+{
+    mtx_init(&out_lock, mtx_plain);
+    out_tty = isatty(1);
+    atexit(&flush_output);
+}
+
+void output(const char* s, size_t len)
+{
+    mtx_lock(&out_lock);
+    if (out_len + len > OUT_SIZE)
+        write_output();
+    if (len >= OUT_SIZE)
+    {
+        fwrite(s, 1, len, stdout);
+    }
+    else
+    {
+        memcpy(out_buf + out_len, s, len);
+        out_len += len;
+    }
+    if (out_tty)
+        write_output();
+    mtx_unlock(&out_lock);
+}
+
+// a char, number or vector as text, buf has room for 96 chars
+size_t format_value(char* buf, const value* v)
+{
+    size_t len = 0;
+    if (v->type == TYPE_CHAR)
+    {
+        buf[len++] = v->i8;
+    }
+    else if (IS_NUMBER(v->type))
+    {
+        len = format_number(buf, 96, v);
+    }
+    else if (IS_VECTOR(v->type))
+    {
+        // (x, y, z)
+        buf[len++] = '(';
+        for (int i = 0; i < (v->type == TYPE_FLOAT3 ? 3 : 4); i++)
+        {
+            value lane;
+            lane.type = TYPE_FLOAT;
+            lane.f32 = v->v4[i];
+            if (i > 0)
+            {
+                buf[len++] = ',';
+                buf[len++] = ' ';
+            }
+            len += format_number(buf + len, 96 - len, &lane);
+        }
+        buf[len++] = ')';
+    }
+    else
+    {
+        ERROR("(%d) can't print %s\n", lineno, type_name(v->type));
+    }
+    return len;
+}
+
+void output_value(const value* v)
+{
+    if (v->type == TYPE_STRING)
+    {
+        output(STR_PTR(&v->str), STR_LEN(&v->str));
+        return;
+    }
+    char buf[96];
+    output(buf, format_value(buf, v));
+}
+
+// a server request that's running on this thread catches errors,
+// see server.c. anywhere else they end the process.
+THREAD_LOCAL jmp_buf* fail_jmp = NULL;
+THREAD_LOCAL char fail_msg[256];
+
+_Noreturn void fail(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (fail_jmp != NULL)
+    {
+        vsnprintf(fail_msg, sizeof(fail_msg), fmt, ap);
+        va_end(ap);
+        longjmp(*fail_jmp, 1);
+    }
+    // after what the script printed, on stderr
+    flush_output();
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+// print(v) of a string, char, number or vector
+value print_value()
+{
+    value v = arg("v");
+    output_value(&v);
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+    return ret;
+}
+
+value flush_value()
+{
+    flush_output();
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+    return ret;
+}
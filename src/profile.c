@@ -0,0 +1,207 @@
+/*************************
+ * Profiler
+ *************************/
+
+// `entity --profile` records every call() in a call tree: one node per
+// distinct call path, with call counts, time and allocations. at exit
+// the tree is folded into a per-function report (sorted by exclusive
+// time) and a collapsed-stack file for flamegraph tools.
+//
+// only the main thread is profiled, workers of parallel loops aren't.
+// the profiler allocates with plain malloc, so its nodes aren't counted
+// in the allocs of the calls it measures.
+
+#include <time.h>
+
+typedef struct prof_node
+{
+    struct prof_node* parent;
+    struct prof_node* child;    // first callee
+    struct prof_node* sibling;
+    function* fun;
+    long long calls;
+    long long ns;               // inclusive
+    long long child_ns;         // spent in callees
+    long long allocs;           // inclusive
+    long long child_allocs;
+} prof_node;
+
+// a call in progress, lives on the c stack of call()
+typedef struct prof_frame
+{
+    prof_node* node;
+    long long start;
+    long long allocs;
+} prof_frame;
+
+prof_node prof_root;
+// current call path on this thread, NULL when not profiling
+THREAD_LOCAL prof_node* prof_cur = NULL;
+
+long long now_ns()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void start_profile()
+{
+    memset(&prof_root, 0, sizeof(prof_root));
+    prof_cur = &prof_root;
+}
+
+void profile_enter(prof_frame* f, function* fun)
+{
+    if (prof_cur == NULL)
+    {
+        f->node = NULL;
+        return;
+    }
+
+    prof_node* n = prof_cur->child;
+    while (n != NULL && n->fun != fun)
+    {
+        n = n->sibling;
+    }
+    if (n == NULL)
+    {
+        n = calloc(1, sizeof(prof_node));
+        n->parent = prof_cur;
+        n->fun = fun;
+        n->sibling = prof_cur->child;
+        prof_cur->child = n;
+    }
+
+    n->calls++;
+    f->node = n;
+    f->allocs = thread_stats.allocs;
+    prof_cur = n;
+    f->start = now_ns();
+}
+
+void profile_exit(prof_frame* f)
+{
+    if (f->node == NULL)
+        return;
+
+    long long ns = now_ns() - f->start;
+    long long allocs = thread_stats.allocs - f->allocs;
+
+    prof_node* n = f->node;
+    n->ns += ns;
+    n->allocs += allocs;
+    n->parent->child_ns += ns;
+    n->parent->child_allocs += allocs;
+    prof_cur = n->parent;
+}
+
+// per-function totals
+typedef struct prof_entry
+{
+    function* fun;
+    long long calls;
+    long long incl_ns;
+    long long excl_ns;
+    long long incl_allocs;
+    long long excl_allocs;
+    int active;                 // on the path being folded, for recursion
+} prof_entry;
+
+prof_entry* prof_entries = NULL;
+int prof_count = 0;
+
+prof_entry* prof_entry_of(function* fun)
+{
+    for (int i = 0; i < prof_count; i++)
+    {
+        if (prof_entries[i].fun == fun)
+            return &prof_entries[i];
+    }
+    prof_entries = realloc(prof_entries, (prof_count + 1) * sizeof(prof_entry));
+    prof_entry* e = &prof_entries[prof_count++];
+    memset(e, 0, sizeof(prof_entry));
+    e->fun = fun;
+    return e;
+}
+
+void fold_profile(prof_node* n)
+{
+    for (; n; n = n->sibling)
+    {
+        prof_entry* e = prof_entry_of(n->fun);
+        e->calls += n->calls;
+        e->excl_ns += n->ns - n->child_ns;
+        e->excl_allocs += n->allocs - n->child_allocs;
+        // inclusive totals of a recursive call are already
+        // part of the outermost one
+        if (!e->active)
+        {
+            e->incl_ns += n->ns;
+            e->incl_allocs += n->allocs;
+        }
+
+        e->active++;
+        fold_profile(n->child);
+        e = prof_entry_of(n->fun); // entries may have moved
+        e->active--;
+    }
+}
+
+int compare_entries(const void* a, const void* b)
+{
+    long long x = ((prof_entry*)a)->excl_ns;
+    long long y = ((prof_entry*)b)->excl_ns;
+    return (x < y) - (x > y);
+}
+
+// main;fib;fib <exclusive ns>
+void write_folded(FILE* f, prof_node* n, char* path, size_t len)
+{
+    for (; n; n = n->sibling)
+    {
+        size_t name_len = strlen(n->fun->name);
+        if (len + name_len + 2 >= 4096)
+            continue;
+
+        size_t l = len;
+        if (l > 0)
+            path[l++] = ';';
+        memcpy(path + l, n->fun->name, name_len + 1);
+
+        long long self = n->ns - n->child_ns;
+        if (self > 0)
+        {
+            fprintf(f, "%s %lld\n", path, self);
+        }
+        write_folded(f, n->child, path, l + name_len);
+    }
+}
+
+void print_profile(FILE* f, const char* folded_path)
+{
+    fold_profile(prof_root.child);
+    qsort(prof_entries, prof_count, sizeof(prof_entry), &compare_entries);
+
+    fprintf(f, "%-24s %10s %12s %12s %12s %12s\n",
+        "function", "calls", "incl ms", "excl ms", "incl allocs", "excl allocs");
+    for (int i = 0; i < prof_count; i++)
+    {
+        prof_entry* e = &prof_entries[i];
+        fprintf(f, "%-24s %10lld %12.3f %12.3f %12lld %12lld\n",
+            e->fun->name, e->calls, e->incl_ns / 1e6, e->excl_ns / 1e6,
+            e->incl_allocs, e->excl_allocs);
+    }
+
+    FILE* out = fopen(folded_path, "w");
+    if (out == NULL)
+    {
+        fprintf(f, "can't write %s\n", folded_path);
+        return;
+    }
+    char path[4096];
+    path[0] = 0;
+    write_folded(out, prof_root.child, path, 0);
+    fclose(out);
+    fprintf(f, "collapsed stacks written to %s\n", folded_path);
+}
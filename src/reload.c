@@ -0,0 +1,431 @@
+/*************************
+ * Hot Reload
+ *************************/
+
+// reload() reads the script's source again if it changed since it was
+// loaded. functions whose tokens changed are replaced, new ones are
+// added, the others keep their compiled bodies. globals keep their
+// values, only new ones are declared and initialized, and entities
+// aren't touched. a running function (or a suspended coroutine) goes on
+// with the body it started with, its next call gets the new one.
+//
+// a script calls reload() where it's safe to, between the frames of a
+// simulation say, but not in a parallel for. it returns the number of
+// functions replaced or added, -1 if the new source has an error, which
+// is printed to stderr. a source that doesn't parse, or whose new
+// globals fail to initialize, changes nothing and is tried again when
+// the file is written again.
+// `--serve --watch` looks at the source every second and reloads it
+// between requests.
+//
+// functions removed from the source stay. errors in an unchanged
+// function give the line numbers of the source it was loaded from.
+
+#include <sys/stat.h>
+
+char* source_path = NULL;   // NULL if the script came from an image
+uint64_t loaded_hash = 0;
+long long loaded_mtime = 0;
+long long loaded_size = 0;
+
+// in nanoseconds, two writes within a second of the same size differ
+long long mtime_ns(const struct stat* st)
+{
+#if defined(__APPLE__)
+    return (long long)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (long long)st->st_mtime * 1000000000;
+#else
+    return (long long)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+void init_reload(char* path, uint64_t hash)
+{
+    struct stat st;
+    source_path = path;
+    loaded_hash = hash;
+    if (stat(path, &st) == 0)
+    {
+        loaded_mtime = mtime_ns(&st);
+        loaded_size = (long long)st.st_size;
+    }
+}
+
+// has the file been written since we last looked
+int source_changed()
+{
+    struct stat st;
+    if (source_path == NULL || stat(source_path, &st) != 0)
+        return 0;
+    if (mtime_ns(&st) == loaded_mtime && (long long)st.st_size == loaded_size)
+        return 0;
+    loaded_mtime = mtime_ns(&st);
+    loaded_size = (long long)st.st_size;
+    return 1;
+}
+
+// intrinsics the new source defines a function for, callers linked
+// to the intrinsic have to be compiled again
+int math_shadowed[MATH_COUNT];
+
+// compile_function() rewrites some tokens in place,
+// a is compared to b as it was lexed
+int same_token(const token_struct* a, const token_struct* b)
+{
+    if (a->token == MATH)
+        return b->token == ID && b->token_val.string == math_pooled[a->token_val.integer]
+            && !math_shadowed[a->token_val.integer];
+    if (a->token != b->token)
+        return 0;
+
+    switch (a->token)
+    {
+    case ID:
+    case STR:
+        return a->token_val.string == b->token_val.string;
+    case TYPE:
+        return a->token_val.type == b->token_val.type;
+    case NUM:
+    case LNG:
+    case CHR:
+        return a->token_val.integer == b->token_val.integer;
+    case FLT:
+    case DBL:
+        return a->token_val.floating == b->token_val.floating;
+    default:
+        // jumps, for loop kinds and case tables
+        return 1;
+    }
+}
+
+int same_function(function* a, function* b)
+{
+    if (a->fp != NULL || a->type != b->type)
+        return 0;
+
+    param* p = a->params;
+    param* q = b->params;
+    for (; p && q; p = p->next, q = q->next)
+    {
+        if (p->type != q->type || p->name != q->name)
+            return 0;
+    }
+    if (p != q)
+        return 0;
+
+    // a streamed body isn't linked, it's taken as changed
+    long long n = a->stat->token_val.jump;
+    if (n == 0 || n != b->stat->token_val.jump)
+        return 0;
+    for (long long i = 1; i < n; i++)
+    {
+        if (!same_token(a->stat + i, b->stat + i))
+            return 0;
+    }
+    return 1;
+}
+
+// drops the globals declared after last
+void drop_globals(variable* last)
+{
+    variable* var = last ? last->next : scope_beg->beg;
+    if (last)
+        last->next = NULL;
+    else
+        scope_beg->beg = NULL;
+    scope_beg->end = last;
+    while (var)
+    {
+        variable* next = var->next;
+        free_slot(var->val);
+        mem_free(var);
+        var = next;
+    }
+}
+
+// declares the globals the script doesn't have yet. the others
+// keep their values, their initializers are skipped.
+void new_globals()
+{
+    while (token)
+    {
+        token_struct* cur = save();
+        parse_type();
+        match(ID);
+        int is_var = token == '=' || token == ',' || token == ';';
+        restore(cur);
+        if (!is_var)
+            break;
+
+        int type = parse_type();
+        for (;;)
+        {
+            char* name = token_val.string;
+            match(ID);
+            if (_find_variable(scope_beg->beg, name) == NULL)
+            {
+                declare(type, name);
+            }
+            else
+            {
+                for (int depth = 0; token && (depth > 0 || (token != ',' && token != ';')); next())
+                {
+                    depth += (token == '(' || token == '[') - (token == ')' || token == ']');
+                }
+            }
+            if (token != ',')
+                break;
+            match(',');
+        }
+        match(';');
+    }
+}
+
+// lexes the source again and applies what changed, the current
+// token stream is the new one
+int apply_source()
+{
+    size_t len;
+    char* s = read_file(source_path, &len);
+    uint64_t hash = source_hash(s, len);
+    if (hash == loaded_hash)
+    {
+        mem_free(s);
+        return 0;
+    }
+
+    src = s;
+    lineno = 1;
+    init_lex();
+    mem_free(s);
+    token_struct* globals = save();
+    skip_globals();
+
+    // everything is parsed and checked before anything is replaced
+    function* beg = NULL;
+    function* end = NULL;
+    while (token)
+    {
+        function* fun = parse_func();
+        function* old = find_function(fun->name);
+        if (old != NULL && old->fp != NULL)
+        {
+            ERROR("(%d) redefinition of function %s\n", fun->stat->lineno, fun->name);
+        }
+        for (function* f = beg; f; f = f->next)
+        {
+            if (f->name == fun->name)
+            {
+                ERROR("(%d) redefinition of function %s\n", fun->stat->lineno, fun->name);
+            }
+        }
+        if (end == NULL)
+            beg = fun;
+        else
+            end->next = fun;
+        end = fun;
+    }
+
+    for (int i = 0; i < MATH_COUNT; i++)
+        math_shadowed[i] = 0;
+    for (function* fun = beg; fun; fun = fun->next)
+    {
+        int fn = find_intrinsic(fun->name);
+        if (fn >= 0)
+            math_shadowed[fn] = 1;
+    }
+
+    // what was put in place, old is NULL for an added function
+    int n_funcs = 0;
+    for (function* fun = beg; fun; fun = fun->next)
+        n_funcs++;
+    function** news = mem_alloc((n_funcs + 1) * sizeof(function*));
+    function** olds = mem_alloc((n_funcs + 1) * sizeof(function*));
+
+    int changed = 0;
+    for (function* fun = beg; fun; )
+    {
+        function* next = fun->next;
+        function* old = find_function(fun->name);
+        if (old == NULL || !same_function(old, fun))
+        {
+            if (old == NULL)
+                add_function(fun);
+            else
+                replace_function(old, fun);
+            news[changed] = fun;
+            olds[changed] = old;
+            changed++;
+        }
+        else
+        {
+            for (param* p = fun->params; p; )
+            {
+                param* q = p->next;
+                mem_free(p);
+                p = q;
+            }
+            mem_free(fun);
+        }
+        fun = next;
+    }
+
+    // initializers may call the new functions. if one fails the old
+    // ones are put back and the new globals dropped.
+    variable* last = scope_beg->end;
+    jmp_buf* outer = fail_jmp;
+    jmp_buf jmp;
+    if (setjmp(jmp) != 0)
+    {
+        fail_jmp = outer;
+        for (int i = changed - 1; i >= 0; i--)
+        {
+            if (olds[i] == NULL)
+                remove_function(news[i]);
+            else
+                replace_function(news[i], olds[i]);
+        }
+        drop_globals(last);
+        mem_free(news);
+        mem_free(olds);
+        char msg[sizeof(fail_msg)];
+        strcpy(msg, fail_msg);
+        ERROR("%s", msg);
+    }
+    fail_jmp = &jmp;
+    restore(globals);
+    scope_end = scope_beg;
+    new_globals();
+    fail_jmp = outer;
+
+    loaded_hash = hash;
+    mem_free(news);
+    mem_free(olds);
+    return changed;
+}
+
+// the number of functions replaced or added, -1 on an error
+int reload_source()
+{
+    // the thread's own lexer state and scope are put back
+    token_struct* cur = save();
+    char* old_src = src;
+    int n_tokens;
+    token_struct* tokens = get_tokens(&n_tokens);
+    scope* scp = scope_end;
+    prof_node* prof = prof_cur;
+    jmp_buf* outer = fail_jmp;
+
+    jmp_buf jmp;
+    int changed = -1;
+    join_eager();
+    if (setjmp(jmp) == 0)
+    {
+        fail_jmp = &jmp;
+        changed = apply_source();
+    }
+    else
+    {
+        fprintf(stderr, "reload: %s", fail_msg);
+        prof_cur = prof;
+    }
+    fail_jmp = outer;
+
+    use_tokens(tokens, n_tokens);
+    src = old_src;
+    if (cur != NULL)
+        restore(cur);
+    scope_end = scp;
+    return changed;
+}
+
+/*************************
+ * Watching
+ *************************/
+
+// with --watch, server workers run script code inside the gate. a
+// reload closes it, waits for them to leave and opens it again.
+int watching = 0;
+mtx_t gate_lock;
+cnd_t gate_cnd;
+int gate_users = 0;
+int gate_closed = 0;
+THREAD_LOCAL int in_gate = 0;
+
+void init_gate()
+{
+    mtx_init(&gate_lock, mtx_plain);
+    cnd_init(&gate_cnd);
+}
+
+void enter_gate()
+{
+    mtx_lock(&gate_lock);
+    while (gate_closed)
+        cnd_wait(&gate_cnd, &gate_lock);
+    gate_users++;
+    mtx_unlock(&gate_lock);
+    in_gate = 1;
+}
+
+void leave_gate()
+{
+    in_gate = 0;
+    mtx_lock(&gate_lock);
+    if (--gate_users == 0 && gate_closed)
+        cnd_broadcast(&gate_cnd);
+    mtx_unlock(&gate_lock);
+}
+
+int watch_source(void* arg)
+{
+    (void)arg;
+    stats_thread();
+    for (;;)
+    {
+        struct timespec second = { 1, 0 };
+        thrd_sleep(&second, NULL);
+        if (!source_changed())
+            continue;
+
+        mtx_lock(&gate_lock);
+        gate_closed = 1;
+        while (gate_users > 0)
+            cnd_wait(&gate_cnd, &gate_lock);
+        mtx_unlock(&gate_lock);
+
+        int changed = reload_source();
+
+        mtx_lock(&gate_lock);
+        gate_closed = 0;
+        cnd_broadcast(&gate_cnd);
+        mtx_unlock(&gate_lock);
+
+        if (changed > 0)
+            fprintf(stderr, "reload: %d function%s changed\n", changed, changed == 1 ? "" : "s");
+    }
+    return 0;
+}
+
+// reload() in a script
+value reload_script()
+{
+    if (source_path == NULL)
+    {
+        ERROR("(%d) reload() needs the source, not an image\n", lineno);
+    }
+    if (in_gate)
+    {
+        ERROR("(%d) reload() in a request, use --watch\n", lineno);
+    }
+    if (in_parallel > 0)
+    {
+        ERROR("(%d) reload() in a parallel for\n", lineno);
+    }
+
+    value ret;
+    ret.type = TYPE_INT;
+    ret.i32 = source_changed() ? reload_source() : 0;
+    return ret;
+}
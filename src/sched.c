@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "lexer.h"
+#include "sched.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define ERROR(...) do { fail(__VA_ARGS__); } while(0);
+#define DEQUE_SIZE 1024     // tasks per worker, the rest run inline
+#define TASKS_PER_THREAD 4  // granularity of a parallel loop
+
+typedef struct task
+{
+    range_fn fn;
+    void* arg;
+    int lo;
+    int hi;
+    atomic_int* pending;    // unfinished tasks of the same loop
+} task;
+
+typedef struct deque
+{
+    mtx_t lock;
+    int top;                // thieves take from here
+    int bottom;             // the owner pushes and pops here
+    task tasks[DEQUE_SIZE];
+} deque;
+
+static deque* deques = NULL;
+static int n_threads = 0;
+
+// idle workers sleep here until something is pushed
+static atomic_int n_queued;
+static mtx_t idle_lock;
+static cnd_t idle_cond;
+static once_flag init_flag = ONCE_FLAG_INIT;
+
+// the deque owned by this thread. the main thread owns deque 0.
+static THREAD_LOCAL int self = 0;
+
+static int push(deque* d, task* t)
+{
+    mtx_lock(&d->lock);
+    if (d->bottom - d->top == DEQUE_SIZE)
+    {
+        mtx_unlock(&d->lock);
+        return 0;
+    }
+    d->tasks[d->bottom % DEQUE_SIZE] = *t;
+    d->bottom++;
+    mtx_unlock(&d->lock);
+
+    atomic_fetch_add(&n_queued, 1);
+    mtx_lock(&idle_lock);
+    cnd_broadcast(&idle_cond);
+    mtx_unlock(&idle_lock);
+    return 1;
+}
+
+// LIFO for the owner, the most recently split task is the hottest one.
+static int pop(deque* d, task* t)
+{
+    mtx_lock(&d->lock);
+    if (d->bottom == d->top)
+    {
+        mtx_unlock(&d->lock);
+        return 0;
+    }
+    d->bottom--;
+    *t = d->tasks[d->bottom % DEQUE_SIZE];
+    mtx_unlock(&d->lock);
+
+    atomic_fetch_sub(&n_queued, 1);
+    return 1;
+}
+
+// FIFO for thieves, so they take the oldest and largest work.
+static int steal(deque* d, task* t)
+{
+    mtx_lock(&d->lock);
+    if (d->bottom == d->top)
+    {
+        mtx_unlock(&d->lock);
+        return 0;
+    }
+    *t = d->tasks[d->top % DEQUE_SIZE];
+    d->top++;
+    mtx_unlock(&d->lock);
+
+    atomic_fetch_sub(&n_queued, 1);
+    return 1;
+}
+
+static int find_task(task* t)
+{
+    if (pop(&deques[self], t))
+        return 1;
+    for (int i = 1; i < n_threads; i++)
+    {
+        if (steal(&deques[(self + i) % n_threads], t))
+            return 1;
+    }
+    return 0;
+}
+
+static void run(task* t)
+{
+    t->fn(t->arg, t->lo, t->hi);
+    atomic_fetch_sub(t->pending, 1);
+}
+
+static int worker(void* arg)
+{
+    self = (int)(intptr_t)arg;
+    stats_thread();
+
+    task t;
+    for (;;)
+    {
+        if (find_task(&t))
+        {
+            run(&t);
+            continue;
+        }
+
+        mtx_lock(&idle_lock);
+        while (atomic_load(&n_queued) == 0)
+        {
+            cnd_wait(&idle_cond, &idle_lock);
+        }
+        mtx_unlock(&idle_lock);
+    }
+    return 0;
+}
+
+static int online_processors()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static void init_sched()
+{
+    char* env = getenv("ENTITY_THREADS");
+    n_threads = env ? atoi(env) : online_processors();
+    if (n_threads < 1)
+    {
+        n_threads = 1;
+    }
+
+    deques = calloc(n_threads, sizeof(deque));
+    for (int i = 0; i < n_threads; i++)
+    {
+        mtx_init(&deques[i].lock, mtx_plain);
+    }
+    mtx_init(&idle_lock, mtx_plain);
+    cnd_init(&idle_cond);
+
+    // workers live until the process exits
+    for (int i = 1; i < n_threads; i++)
+    {
+        thrd_t thrd;
+        if (thrd_create(&thrd, worker, (void*)(intptr_t)i) != thrd_success)
+        {
+            ERROR("failed to start worker thread\n");
+        }
+        thrd_detach(thrd);
+    }
+}
+
+int sched_threads()
+{
+    call_once(&init_flag, init_sched);
+    return n_threads;
+}
+
+void parallel_range(range_fn fn, void* arg, int lo, int hi)
+{
+    if (lo >= hi)
+        return;
+
+    int n = sched_threads();
+    if (n == 1)
+    {
+        fn(arg, lo, hi);
+        return;
+    }
+
+    // hi - lo overflows an int for ranges over INT_MAX
+    long long chunks = n * TASKS_PER_THREAD;
+    long long step = ((long long)hi - lo + chunks - 1) / chunks;
+
+    atomic_int pending;
+    atomic_init(&pending, 0);
+
+    for (long long i = lo; i < hi; i += step)
+    {
+        task t;
+        t.fn = fn;
+        t.arg = arg;
+        t.lo = (int)i;
+        t.hi = (hi - i > step) ? (int)(i + step) : hi;
+        t.pending = &pending;
+
+        atomic_fetch_add(&pending, 1);
+        if (!push(&deques[self], &t))
+        {
+            // deque is full, don't bother anybody else
+            run(&t);
+        }
+    }
+
+    // help out until the whole loop is done
+    task t;
+    while (atomic_load(&pending) > 0)
+    {
+        if (find_task(&t))
+        {
+            run(&t);
+        }
+        else
+        {
+            thrd_yield();
+        }
+    }
+}
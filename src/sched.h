@@ -0,0 +1,20 @@
+#ifndef ENTITY_SCHED_H
+#define ENTITY_SCHED_H
+
+// work-stealing scheduler used by `parallel for`.
+// every worker owns a deque: the owner pushes and pops at the bottom,
+// idle workers steal from the top of somebody else's deque.
+
+// runs the iterations [lo, hi) of a parallel loop.
+typedef void (*range_fn)(void* arg, int lo, int hi);
+
+// number of threads taking part in parallel loops, including the caller.
+// ENTITY_THREADS overrides the number of online processors.
+int sched_threads();
+
+// split [lo, hi) into tasks, run them on all workers and block
+// until every iteration is done. the calling thread helps while waiting,
+// so nested parallel loops don't deadlock.
+void parallel_range(range_fn fn, void* arg, int lo, int hi);
+
+#endif
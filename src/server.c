@@ -0,0 +1,493 @@
+/*************************
+ * Server Mode
+ *************************/
+
+// `entity --serve script.ent` loads the script once and answers
+// requests on stdin, `entity --serve --socket path script.ent` on a unix
+// socket, with one worker thread per processor (or ENTITY_THREADS) each
+// serving a connection at a time. parsed functions, the string pool
+// and globals stay warm between requests.
+//
+// a request is a line, a function name and its arguments as a record:
+//     transform apple,3,0.5
+// the answer is a line too, '=' and the result (nothing for void), or
+// '!' and the error message. an error only ends the request: the
+// worker longjmp()s back from fail() and drops the request's state.
+// print() still goes to the server's stdout. the strings a request
+// made are freed after its answer, a client that went away only ends
+// its connection.
+//
+// requests on different workers run at the same time, like iterations
+// of a parallel for. globals are shared without locks.
+//
+// with --budget n a worker serves all its connections at once: each
+// request runs on a coroutine of its own, n ticks (loop iterations and
+// calls) at a time, and the worker takes turns between them. a request
+// stuck in a long loop only slows the others down, they don't wait for
+// it. a script coroutine or a parallel for runs on until it's back in
+// the request, only the request itself is suspended.
+//
+// with --watch the script is reloaded when its source changes, between
+// requests, see reload.c.
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+void answer(FILE* out, char tag, const char* s, size_t len)
+{
+    // what the request print()ed comes first
+    if (out == stdout)
+        flush_output();
+    fputc(tag, out);
+    fwrite(s, 1, len, out);
+    fputc('\n', out);
+}
+
+void answer_value(FILE* out, const value* v)
+{
+    char buf[96];
+    if (v->type == TYPE_VOID)
+        answer(out, '=', "", 0);
+    else if (v->type == TYPE_STRING)
+        answer(out, '=', STR_PTR(&v->str), STR_LEN(&v->str));
+    else
+        answer(out, '=', buf, format_value(buf, v));
+}
+
+void answer_error(FILE* out, const char* msg)
+{
+    size_t len = strlen(msg);
+    if (len > 0 && msg[len - 1] == '\n')
+        len--;
+    answer(out, '!', msg, len);
+}
+
+// line n is the request
+value call_request(char* line, long long n)
+{
+    char* name = line;
+    char* args = strchr(line, ' ');
+    if (args != NULL)
+        *args++ = 0;
+    else
+        args = name + strlen(name);
+
+    char* pooled = find_string(name);
+    function* fun = pooled ? find_function(pooled) : NULL;
+    if (fun == NULL)
+    {
+        ERROR("no function %s\n", name);
+    }
+    int n_params = record_params(fun);
+    value argv[MAX_FIELDS];
+    if (n_params > 0 || *args != 0)
+    {
+        bind_record(fun, n_params, args, argv, n);
+    }
+    return run_function(fun, argv);
+}
+
+void serve_request(char* line, long long n, FILE* out)
+{
+    // the thread's interpreter state after an error left the request
+    thread_state state;
+    save_state(&state);
+    jmp_buf jmp;
+    if (setjmp(jmp) != 0)
+    {
+        fail_jmp = NULL;
+        recover_state(&state);
+        answer_error(out, fail_msg);
+        return;
+    }
+    fail_jmp = &jmp;
+    value ret = call_request(line, n);
+    fail_jmp = NULL;
+    answer_value(out, &ret);
+}
+
+void serve_stream(int fd, FILE* out)
+{
+    line_reader r;
+    init_reader(&r, fd);
+    long long n = 0;
+    size_t len;
+    for (char* line; (line = read_line(&r, &len)) != NULL; )
+    {
+        n++;
+        if (len == 0)
+            continue;
+        str_mark mark = str_mark_arena();
+        if (watching)
+            enter_gate();
+        serve_request(line, n, out);
+        if (watching)
+            leave_gate();
+        fflush(out);
+        str_release(mark);
+        // the client is gone
+        if (ferror(out))
+            break;
+    }
+    free_reader(&r);
+}
+
+/*************************
+ * Time Slicing
+ *************************/
+
+// ticks per slice, 0 if requests run to the end
+long long slice_ticks = 0;
+
+// recursion gets as deep as on a worker's own stack,
+// pages are only committed when touched
+#define REQUEST_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct request
+{
+    coro* ctx;
+    char* line;
+    long long n;
+    jmp_buf* jmp;       // the request's fail_jmp while it's suspended
+    int queries;        // and its thread_queries
+    str_arena_state strings;
+    str_mark mark;      // strings.arena when it started
+    int failed;
+    value ret;
+    char msg[256];
+} request;
+
+// the request running on this thread, NULL if none
+THREAD_LOCAL request* slicing = NULL;
+
+void request_main(void* arg)
+{
+    request* rq = arg;
+    // not inside the scopes of a suspended request
+    scope_end = scope_beg;
+    thread_state state;
+    save_state(&state);
+    jmp_buf jmp;
+    if (setjmp(jmp) != 0)
+    {
+        fail_jmp = NULL;
+        recover_state(&state);
+        rq->failed = 1;
+        strcpy(rq->msg, fail_msg);
+        return;
+    }
+    fail_jmp = &jmp;
+    rq->mark = str_mark_arena();
+    rq->ret = call_request(rq->line, rq->n);
+    fail_jmp = NULL;
+}
+
+request* new_request(const char* line, size_t len, long long n)
+{
+    request* rq = mem_alloc(sizeof(request));
+    memset(rq, 0, sizeof(request));
+    rq->line = mem_alloc(len + 1);
+    memcpy(rq->line, line, len + 1);
+    rq->n = n;
+    rq->ctx = coro_new(&request_main, rq, REQUEST_STACK_SIZE);
+    return rq;
+}
+
+void free_request(request* rq)
+{
+    // what the request's strings take, after it's answered
+    str_swap(&rq->strings);
+    str_release(rq->mark);
+    str_swap(&rq->strings);
+    coro_free(rq->ctx);
+    mem_free(rq->line);
+    mem_free(rq);
+}
+
+// runs rq until it's finished or has used up a slice,
+// non-zero once it's finished
+int run_slice(request* rq)
+{
+    slicing = rq;
+    ticks_left = slice_ticks;
+    fail_jmp = rq->jmp;
+    int queries = thread_queries;
+    thread_queries = rq->queries;
+    str_swap(&rq->strings);
+    coro_resume(rq->ctx);
+    str_swap(&rq->strings);
+    rq->queries = thread_queries;
+    thread_queries = queries;
+    rq->jmp = fail_jmp;
+    fail_jmp = NULL;
+    ticks_left = LLONG_MAX;
+    slicing = NULL;
+    return coro_finished(rq->ctx);
+}
+
+// called by TICK()
+void out_of_ticks()
+{
+    if (slicing == NULL)
+    {
+        ticks_left = LLONG_MAX;
+        return;
+    }
+    ticks_left = slice_ticks;
+    // in a script coroutine or a parallel for, try again next slice
+    if (running != NULL || in_parallel > 0)
+        return;
+
+    // the next request overwrites the lexer state and scope
+    token_struct* cur = save();
+    scope* scp = scope_end;
+    prof_node* prof = prof_cur;
+    coro_yield();
+    restore(cur);
+    scope_end = scp;
+    prof_cur = prof;
+}
+
+#ifndef _WIN32
+
+typedef struct connection
+{
+    line_reader r;
+    FILE* out;
+    long long n;        // lines so far
+    request* rq;        // NULL while waiting for a line
+    int at_end;
+} connection;
+
+connection* new_connection(int fd, FILE* out)
+{
+    connection* c = mem_alloc(sizeof(connection));
+    init_reader(&c->r, fd);
+    c->out = out;
+    c->n = 0;
+    c->rq = NULL;
+    c->at_end = 0;
+    return c;
+}
+
+void close_connection(connection* c)
+{
+    if (c->out != stdout)
+        fclose(c->out);
+    free_reader(&c->r);
+    mem_free(c);
+}
+
+// starts the next request if a whole line is buffered
+void start_request(connection* c)
+{
+    size_t len;
+    while (c->rq == NULL)
+    {
+        char* line = next_line(&c->r, &len, c->at_end);
+        if (line == NULL)
+            return;
+        c->n++;
+        if (len > 0)
+            c->rq = new_request(line, len, c->n);
+    }
+}
+
+void finish_request(connection* c)
+{
+    request* rq = c->rq;
+    if (rq->failed)
+        answer_error(c->out, rq->msg);
+    else
+        answer_value(c->out, &rq->ret);
+    fflush(c->out);
+    free_request(rq);
+    c->rq = NULL;
+    // the client is gone, what it sent after is dropped
+    if (ferror(c->out))
+    {
+        c->at_end = 1;
+        c->r.beg = c->r.end;
+    }
+}
+
+// serves the connections accepted on listen (-1: none) and the one on
+// fd (-1: none) a slice at a time, until they're all closed
+void serve_slices(int listen, int fd, FILE* out)
+{
+    connection** conns = NULL;
+    struct pollfd* fds = NULL;
+    int n_conns = 0;
+    int cap = 0;
+
+    if (fd != -1)
+    {
+        cap = 1;
+        conns = mem_alloc(sizeof(connection*));
+        conns[n_conns++] = new_connection(fd, out);
+    }
+    fds = mem_alloc((cap + 1) * sizeof(struct pollfd));
+
+    for (;;)
+    {
+        // fds[0] is the listening socket, fds[i + 1] conns[i].
+        // poll() skips negative fds, connections running a request
+        // aren't read until it's answered.
+        int busy = 0;
+        fds[0].fd = listen;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < n_conns; i++)
+        {
+            connection* c = conns[i];
+            start_request(c);
+            if (c->rq == NULL && c->at_end)
+            {
+                close_connection(c);
+                conns[i--] = conns[--n_conns];
+                continue;
+            }
+            busy |= c->rq != NULL;
+            fds[i + 1].fd = c->rq != NULL ? -1 : c->r.fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (listen == -1 && n_conns == 0)
+            break;
+
+        // don't wait while there are requests to run
+        if (poll(fds, n_conns + 1, busy ? 0 : -1) > 0)
+        {
+            for (int i = 0; i < n_conns; i++)
+            {
+                if (fds[i + 1].fd != -1 && fds[i + 1].revents != 0 && !fill_reader(&conns[i]->r))
+                    conns[i]->at_end = 1;
+            }
+            // another worker may have taken it, listen is non-blocking
+            int client = fds[0].revents != 0 ? accept(listen, NULL, NULL) : -1;
+            if (client != -1)
+            {
+                if (n_conns == cap)
+                {
+                    cap = cap ? cap * 2 : 8;
+                    conns = mem_realloc(conns, cap * sizeof(connection*));
+                    fds = mem_realloc(fds, (cap + 1) * sizeof(struct pollfd));
+                }
+                conns[n_conns++] = new_connection(client, fdopen(client, "w"));
+            }
+        }
+
+        // a slice for every request
+        if (watching)
+            enter_gate();
+        for (int i = 0; i < n_conns; i++)
+        {
+            if (conns[i]->rq != NULL && run_slice(conns[i]->rq))
+                finish_request(conns[i]);
+        }
+        if (watching)
+            leave_gate();
+    }
+    mem_free(conns);
+    mem_free(fds);
+}
+
+int listen_fd = -1;
+
+int serve_worker(void* arg)
+{
+    (void)arg;
+    stats_thread();
+    scope_end = scope_beg;
+    if (slice_ticks > 0)
+    {
+        serve_slices(listen_fd, -1, NULL);
+        return 0;
+    }
+    for (;;)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        FILE* out = fdopen(fd, "w");
+        serve_stream(fd, out);
+        fclose(out);
+    }
+    return 0;
+}
+
+void serve_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        ERROR("socket path too long: %s\n", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listen_fd == -1
+        || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(listen_fd, 64) == -1)
+    {
+        ERROR("can't listen on %s\n", path);
+    }
+    // workers polling it race for each connection
+    if (slice_ticks > 0)
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    // this thread is a worker too
+    int n = sched_threads();
+    for (int i = 1; i < n; i++)
+    {
+        thrd_t t;
+        thrd_create(&t, &serve_worker, NULL);
+        thrd_detach(t);
+    }
+    serve_worker(NULL);
+}
+
+#else
+
+void serve_slices(int listen, int fd, FILE* out)
+{
+    ERROR("--budget isn't supported on windows\n");
+}
+
+void serve_socket(const char* path)
+{
+    ERROR("--socket isn't supported on windows\n");
+}
+
+#endif
+
+void serve(const char* socket_path)
+{
+    scope_end = scope_beg;
+#ifndef _WIN32
+    // a client that disconnects gives EPIPE, not a signal
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (watching)
+    {
+        if (source_path == NULL)
+        {
+            ERROR("--watch needs the source, not an image\n");
+        }
+        thrd_t t;
+        thrd_create(&t, &watch_source, NULL);
+        thrd_detach(t);
+    }
+    if (socket_path != NULL)
+        serve_socket(socket_path);
+    else if (slice_ticks > 0)
+        serve_slices(-1, 0, stdout);
+    else
+        serve_stream(0, stdout);
+}
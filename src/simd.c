@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+enum { LEVEL_SCALAR, LEVEL_SSE, LEVEL_AVX2 };
+static const char* level_names[] = { "scalar", "sse", "avx2" };
+
+typedef struct kernels
+{
+    void (*f32)(int, float*, const float*, int, const float*, int, size_t);
+    void (*i32)(int, int32_t*, const int32_t*, int, const int32_t*, int, size_t);
+    float (*sum_f32)(const float*, size_t);
+    float (*min_f32)(const float*, size_t);
+    float (*max_f32)(const float*, size_t);
+    float (*dot_f32)(const float*, const float*, size_t);
+    int32_t (*sum_i32)(const int32_t*, size_t);
+    int32_t (*min_i32)(const int32_t*, size_t);
+    int32_t (*max_i32)(const int32_t*, size_t);
+    int32_t (*dot_i32)(const int32_t*, const int32_t*, size_t);
+} kernels;
+
+#define ADD(x, y) ((x) + (y))
+#define MIN(x, y) ((y) < (x) ? (y) : (x))
+#define MAX(x, y) ((y) > (x) ? (y) : (x))
+// ints wrap around like the interpreter's
+#define ADD_I32(x, y) ((int32_t)((uint32_t)(x) + (uint32_t)(y)))
+#define MUL_I32(x, y) ((int32_t)((uint32_t)(x) * (uint32_t)(y)))
+
+// out[i] = a[i] op b[i], the vector part then the tail.
+// a step of 0 keeps using the broadcast first element.
+#define ELEMENTWISE(V, W, load, store, set1, vop, sop)              \
+    {                                                               \
+        size_t i = 0;                                               \
+        V ka = set1(a[0]);                                          \
+        V kb = set1(b[0]);                                          \
+        for (; i + W <= n; i += W)                                  \
+        {                                                           \
+            V x = a_step ? load((void*)(a + i)) : ka;               \
+            V y = b_step ? load((void*)(b + i)) : kb;               \
+            store((void*)(out + i), vop(x, y));                     \
+        }                                                           \
+        for (; i < n; i++)                                          \
+            out[i] = sop(a[i * a_step], b[i * b_step]);             \
+    }
+
+#define SCALAR_LOOP(sop)                                            \
+    for (size_t i = 0; i < n; i++)                                  \
+        out[i] = sop(a[i * a_step], b[i * b_step]);
+
+#define REDUCE(T, V, W, load, store, start, vop, sop)               \
+    {                                                               \
+        size_t i = 0;                                               \
+        V acc = start;                                              \
+        for (; i + W <= n; i += W)                                  \
+            acc = vop(acc, load((void*)(a + i)));                   \
+        T lanes[W];                                                 \
+        store((void*)lanes, acc);                                   \
+        T r = lanes[0];                                             \
+        for (int l = 1; l < W; l++)                                 \
+            r = sop(r, lanes[l]);                                   \
+        for (; i < n; i++)                                          \
+            r = sop(r, a[i]);                                       \
+        return r;                                                   \
+    }
+
+#define DOT(T, V, W, load, store, zero, vadd, vmul, sadd, smul)     \
+    {                                                               \
+        size_t i = 0;                                               \
+        V acc = zero;                                               \
+        for (; i + W <= n; i += W)                                  \
+            acc = vadd(acc, vmul(load((void*)(a + i)), load((void*)(b + i)))); \
+        T lanes[W];                                                 \
+        store((void*)lanes, acc);                                   \
+        T r = 0;                                                    \
+        for (int l = 0; l < W; l++)                                 \
+            r = sadd(r, lanes[l]);                                  \
+        for (; i < n; i++)                                          \
+            r = sadd(r, smul(a[i], b[i]));                          \
+        return r;                                                   \
+    }
+
+#define SUB(x, y) ((x) - (y))
+#define MUL(x, y) ((x) * (y))
+#define DIV(x, y) ((x) / (y))
+#define SUB_I32(x, y) ((int32_t)((uint32_t)(x) - (uint32_t)(y)))
+
+/*************************
+ * Scalar
+ *************************/
+
+static void f32_scalar(int op, float* out, const float* a, int a_step, const float* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': SCALAR_LOOP(ADD); break;
+    case '-': SCALAR_LOOP(SUB); break;
+    case '*': SCALAR_LOOP(MUL); break;
+    case '/': SCALAR_LOOP(DIV); break;
+    }
+}
+
+static void i32_scalar(int op, int32_t* out, const int32_t* a, int a_step, const int32_t* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': SCALAR_LOOP(ADD_I32); break;
+    case '-': SCALAR_LOOP(SUB_I32); break;
+    case '*': SCALAR_LOOP(MUL_I32); break;
+    case '/': SCALAR_LOOP(DIV); break;
+    }
+}
+
+#define SCALAR_REDUCE(T, name, start, sop)                          \
+    static T name(const T* a, size_t n)                             \
+    {                                                               \
+        T r = start;                                                \
+        for (size_t i = 0; i < n; i++)                              \
+            r = sop(r, a[i]);                                       \
+        return r;                                                   \
+    }
+
+SCALAR_REDUCE(float, sum_f32_scalar, 0, ADD)
+SCALAR_REDUCE(float, min_f32_scalar, a[0], MIN)
+SCALAR_REDUCE(float, max_f32_scalar, a[0], MAX)
+SCALAR_REDUCE(int32_t, sum_i32_scalar, 0, ADD_I32)
+SCALAR_REDUCE(int32_t, min_i32_scalar, a[0], MIN)
+SCALAR_REDUCE(int32_t, max_i32_scalar, a[0], MAX)
+
+static float dot_f32_scalar(const float* a, const float* b, size_t n)
+{
+    float r = 0;
+    for (size_t i = 0; i < n; i++)
+        r += a[i] * b[i];
+    return r;
+}
+
+static int32_t dot_i32_scalar(const int32_t* a, const int32_t* b, size_t n)
+{
+    int32_t r = 0;
+    for (size_t i = 0; i < n; i++)
+        r = ADD_I32(r, MUL_I32(a[i], b[i]));
+    return r;
+}
+
+static const kernels scalar_kernels = {
+    f32_scalar, i32_scalar,
+    sum_f32_scalar, min_f32_scalar, max_f32_scalar, dot_f32_scalar,
+    sum_i32_scalar, min_i32_scalar, max_i32_scalar, dot_i32_scalar,
+};
+
+#ifdef SIMD_X86
+
+/*************************
+ * SSE4.1, 4 lanes
+ *************************/
+
+#define load_ps _mm_loadu_ps
+#define store_ps _mm_storeu_ps
+#define load_si(p) _mm_loadu_si128((const __m128i*)(p))
+#define store_si(p, v) _mm_storeu_si128((__m128i*)(p), v)
+
+TARGET("sse4.1")
+static void f32_sse(int op, float* out, const float* a, int a_step, const float* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': ELEMENTWISE(__m128, 4, load_ps, store_ps, _mm_set1_ps, _mm_add_ps, ADD); break;
+    case '-': ELEMENTWISE(__m128, 4, load_ps, store_ps, _mm_set1_ps, _mm_sub_ps, SUB); break;
+    case '*': ELEMENTWISE(__m128, 4, load_ps, store_ps, _mm_set1_ps, _mm_mul_ps, MUL); break;
+    case '/': ELEMENTWISE(__m128, 4, load_ps, store_ps, _mm_set1_ps, _mm_div_ps, DIV); break;
+    }
+}
+
+TARGET("sse4.1")
+static void i32_sse(int op, int32_t* out, const int32_t* a, int a_step, const int32_t* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': ELEMENTWISE(__m128i, 4, load_si, store_si, _mm_set1_epi32, _mm_add_epi32, ADD_I32); break;
+    case '-': ELEMENTWISE(__m128i, 4, load_si, store_si, _mm_set1_epi32, _mm_sub_epi32, SUB_I32); break;
+    case '*': ELEMENTWISE(__m128i, 4, load_si, store_si, _mm_set1_epi32, _mm_mullo_epi32, MUL_I32); break;
+    // no integer division in sse
+    case '/': SCALAR_LOOP(DIV); break;
+    }
+}
+
+TARGET("sse4.1") static float sum_f32_sse(const float* a, size_t n)
+    REDUCE(float, __m128, 4, load_ps, store_ps, _mm_setzero_ps(), _mm_add_ps, ADD)
+TARGET("sse4.1") static float min_f32_sse(const float* a, size_t n)
+    REDUCE(float, __m128, 4, load_ps, store_ps, _mm_set1_ps(a[0]), _mm_min_ps, MIN)
+TARGET("sse4.1") static float max_f32_sse(const float* a, size_t n)
+    REDUCE(float, __m128, 4, load_ps, store_ps, _mm_set1_ps(a[0]), _mm_max_ps, MAX)
+TARGET("sse4.1") static float dot_f32_sse(const float* a, const float* b, size_t n)
+    DOT(float, __m128, 4, load_ps, store_ps, _mm_setzero_ps(), _mm_add_ps, _mm_mul_ps, ADD, MUL)
+
+TARGET("sse4.1") static int32_t sum_i32_sse(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m128i, 4, load_si, store_si, _mm_setzero_si128(), _mm_add_epi32, ADD_I32)
+TARGET("sse4.1") static int32_t min_i32_sse(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m128i, 4, load_si, store_si, _mm_set1_epi32(a[0]), _mm_min_epi32, MIN)
+TARGET("sse4.1") static int32_t max_i32_sse(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m128i, 4, load_si, store_si, _mm_set1_epi32(a[0]), _mm_max_epi32, MAX)
+TARGET("sse4.1") static int32_t dot_i32_sse(const int32_t* a, const int32_t* b, size_t n)
+    DOT(int32_t, __m128i, 4, load_si, store_si, _mm_setzero_si128(), _mm_add_epi32, _mm_mullo_epi32, ADD_I32, MUL_I32)
+
+static const kernels sse_kernels = {
+    f32_sse, i32_sse,
+    sum_f32_sse, min_f32_sse, max_f32_sse, dot_f32_sse,
+    sum_i32_sse, min_i32_sse, max_i32_sse, dot_i32_sse,
+};
+
+/*************************
+ * AVX2, 8 lanes
+ *************************/
+
+#define load_ps8 _mm256_loadu_ps
+#define store_ps8 _mm256_storeu_ps
+#define load_si8(p) _mm256_loadu_si256((const __m256i*)(p))
+#define store_si8(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+
+TARGET("avx2")
+static void f32_avx2(int op, float* out, const float* a, int a_step, const float* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': ELEMENTWISE(__m256, 8, load_ps8, store_ps8, _mm256_set1_ps, _mm256_add_ps, ADD); break;
+    case '-': ELEMENTWISE(__m256, 8, load_ps8, store_ps8, _mm256_set1_ps, _mm256_sub_ps, SUB); break;
+    case '*': ELEMENTWISE(__m256, 8, load_ps8, store_ps8, _mm256_set1_ps, _mm256_mul_ps, MUL); break;
+    case '/': ELEMENTWISE(__m256, 8, load_ps8, store_ps8, _mm256_set1_ps, _mm256_div_ps, DIV); break;
+    }
+}
+
+TARGET("avx2")
+static void i32_avx2(int op, int32_t* out, const int32_t* a, int a_step, const int32_t* b, int b_step, size_t n)
+{
+    switch (op)
+    {
+    case '+': ELEMENTWISE(__m256i, 8, load_si8, store_si8, _mm256_set1_epi32, _mm256_add_epi32, ADD_I32); break;
+    case '-': ELEMENTWISE(__m256i, 8, load_si8, store_si8, _mm256_set1_epi32, _mm256_sub_epi32, SUB_I32); break;
+    case '*': ELEMENTWISE(__m256i, 8, load_si8, store_si8, _mm256_set1_epi32, _mm256_mullo_epi32, MUL_I32); break;
+    case '/': SCALAR_LOOP(DIV); break;
+    }
+}
+
+TARGET("avx2") static float sum_f32_avx2(const float* a, size_t n)
+    REDUCE(float, __m256, 8, load_ps8, store_ps8, _mm256_setzero_ps(), _mm256_add_ps, ADD)
+TARGET("avx2") static float min_f32_avx2(const float* a, size_t n)
+    REDUCE(float, __m256, 8, load_ps8, store_ps8, _mm256_set1_ps(a[0]), _mm256_min_ps, MIN)
+TARGET("avx2") static float max_f32_avx2(const float* a, size_t n)
+    REDUCE(float, __m256, 8, load_ps8, store_ps8, _mm256_set1_ps(a[0]), _mm256_max_ps, MAX)
+TARGET("avx2") static float dot_f32_avx2(const float* a, const float* b, size_t n)
+    DOT(float, __m256, 8, load_ps8, store_ps8, _mm256_setzero_ps(), _mm256_add_ps, _mm256_mul_ps, ADD, MUL)
+
+TARGET("avx2") static int32_t sum_i32_avx2(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m256i, 8, load_si8, store_si8, _mm256_setzero_si256(), _mm256_add_epi32, ADD_I32)
+TARGET("avx2") static int32_t min_i32_avx2(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m256i, 8, load_si8, store_si8, _mm256_set1_epi32(a[0]), _mm256_min_epi32, MIN)
+TARGET("avx2") static int32_t max_i32_avx2(const int32_t* a, size_t n)
+    REDUCE(int32_t, __m256i, 8, load_si8, store_si8, _mm256_set1_epi32(a[0]), _mm256_max_epi32, MAX)
+TARGET("avx2") static int32_t dot_i32_avx2(const int32_t* a, const int32_t* b, size_t n)
+    DOT(int32_t, __m256i, 8, load_si8, store_si8, _mm256_setzero_si256(), _mm256_add_epi32, _mm256_mullo_epi32, ADD_I32, MUL_I32)
+
+static const kernels avx2_kernels = {
+    f32_avx2, i32_avx2,
+    sum_f32_avx2, min_f32_avx2, max_f32_avx2, dot_f32_avx2,
+    sum_i32_avx2, min_i32_avx2, max_i32_avx2, dot_i32_avx2,
+};
+
+#endif
+
+/*************************
+ * Dispatch
+ *************************/
+
+static const kernels* use = &scalar_kernels;
+static int level = LEVEL_SCALAR;
+static once_flag init_flag = ONCE_FLAG_INIT;
+
+static int cpu_level()
+{
+#if defined(SIMD_X86) && defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 0);
+    int max_leaf = r[0];
+    __cpuid(r, 1);
+    int sse41 = (r[2] >> 19) & 1;
+    int osxsave = (r[2] >> 27) & 1;
+    int avx = (r[2] >> 28) & 1;
+    int avx2 = 0;
+    // the os must save the ymm registers too
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(r, 7, 0);
+        avx2 = (r[1] >> 5) & 1;
+    }
+    return avx2 ? LEVEL_AVX2 : sse41 ? LEVEL_SSE : LEVEL_SCALAR;
+#elif defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return LEVEL_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return LEVEL_SSE;
+    return LEVEL_SCALAR;
+#else
+    return LEVEL_SCALAR;
+#endif
+}
+
+static void init()
+{
+    level = cpu_level();
+
+    const char* env = getenv("ENTITY_SIMD");
+    for (int i = 0; env && i < level; i++)
+    {
+        if (!strcmp(env, level_names[i]))
+            level = i;
+    }
+
+#ifdef SIMD_X86
+    if (level == LEVEL_AVX2)
+        use = &avx2_kernels;
+    else if (level == LEVEL_SSE)
+        use = &sse_kernels;
+#endif
+}
+
+static const kernels* k()
+{
+    call_once(&init_flag, &init);
+    return use;
+}
+
+const char* simd_level()
+{
+    k();
+    return level_names[level];
+}
+
+void simd_f32(int op, float* out, const float* a, int a_step, const float* b, int b_step, size_t n)
+{
+    if (n > 0)
+        k()->f32(op, out, a, a_step, b, b_step, n);
+}
+
+void simd_i32(int op, int32_t* out, const int32_t* a, int a_step, const int32_t* b, int b_step, size_t n)
+{
+    if (n > 0)
+        k()->i32(op, out, a, a_step, b, b_step, n);
+}
+
+float simd_sum_f32(const float* a, size_t n) { return k()->sum_f32(a, n); }
+float simd_min_f32(const float* a, size_t n) { return k()->min_f32(a, n); }
+float simd_max_f32(const float* a, size_t n) { return k()->max_f32(a, n); }
+float simd_dot_f32(const float* a, const float* b, size_t n) { return k()->dot_f32(a, b, n); }
+
+int32_t simd_sum_i32(const int32_t* a, size_t n) { return k()->sum_i32(a, n); }
+int32_t simd_min_i32(const int32_t* a, size_t n) { return k()->min_i32(a, n); }
+int32_t simd_max_i32(const int32_t* a, size_t n) { return k()->max_i32(a, n); }
+int32_t simd_dot_i32(const int32_t* a, const int32_t* b, size_t n) { return k()->dot_i32(a, b, n); }
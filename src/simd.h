@@ -0,0 +1,102 @@
+#ifndef ENTITY_SIMD_H
+#define ENTITY_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// kernels for whole-array arithmetic. the widest instruction set the
+// cpu supports is picked on first use: avx2, sse4.1, or plain c.
+// ENTITY_SIMD=scalar|sse|avx2 caps it.
+
+// name of the instruction set in use
+const char* simd_level();
+
+// out[i] = a[i] op b[i], op is one of '+' '-' '*' '/'.
+// a step of 0 broadcasts the first element, i.e. a scalar operand.
+void simd_f32(int op, float* out, const float* a, int a_step, const float* b, int b_step, size_t n);
+void simd_i32(int op, int32_t* out, const int32_t* a, int a_step, const int32_t* b, int b_step, size_t n);
+
+// reductions, n > 0 for min & max
+float simd_sum_f32(const float* a, size_t n);
+float simd_min_f32(const float* a, size_t n);
+float simd_max_f32(const float* a, size_t n);
+float simd_dot_f32(const float* a, const float* b, size_t n);
+
+int32_t simd_sum_i32(const int32_t* a, size_t n);
+int32_t simd_min_i32(const int32_t* a, size_t n);
+int32_t simd_max_i32(const int32_t* a, size_t n);
+int32_t simd_dot_i32(const int32_t* a, const int32_t* b, size_t n);
+
+// float3/float4 arithmetic, all 4 lanes at once. sse2 is part of
+// x86-64, these don't need any dispatch.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+static inline void vec4_op(int op, float* out, const float* a, const float* b)
+{
+    __m128 x = _mm_loadu_ps(a);
+    __m128 y = _mm_loadu_ps(b);
+    switch (op)
+    {
+    case '+': x = _mm_add_ps(x, y); break;
+    case '-': x = _mm_sub_ps(x, y); break;
+    case '*': x = _mm_mul_ps(x, y); break;
+    case '/': x = _mm_div_ps(x, y); break;
+    }
+    _mm_storeu_ps(out, x);
+}
+
+static inline float vec4_dot(const float* a, const float* b)
+{
+    __m128 m = _mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b));
+    m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(m);
+}
+
+// a.yzx * b.zxy - a.zxy * b.yzx, w ends up 0
+static inline void vec3_cross(float* out, const float* a, const float* b)
+{
+    __m128 x = _mm_loadu_ps(a);
+    __m128 y = _mm_loadu_ps(b);
+    __m128 x_yzx = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 y_yzx = _mm_shuffle_ps(y, y, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(x, y_yzx), _mm_mul_ps(x_yzx, y));
+    _mm_storeu_ps(out, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+#else
+
+static inline void vec4_op(int op, float* out, const float* a, const float* b)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        switch (op)
+        {
+        case '+': out[i] = a[i] + b[i]; break;
+        case '-': out[i] = a[i] - b[i]; break;
+        case '*': out[i] = a[i] * b[i]; break;
+        case '/': out[i] = a[i] / b[i]; break;
+        }
+    }
+}
+
+static inline float vec4_dot(const float* a, const float* b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+}
+
+static inline void vec3_cross(float* out, const float* a, const float* b)
+{
+    float x = a[1] * b[2] - a[2] * b[1];
+    float y = a[2] * b[0] - a[0] * b[2];
+    float z = a[0] * b[1] - a[1] * b[0];
+    out[0] = x;
+    out[1] = y;
+    out[2] = z;
+    out[3] = 0;
+}
+
+#endif
+
+#endif
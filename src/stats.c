@@ -0,0 +1,87 @@
+#include <threads.h>
+#include "stats.h"
+
+THREAD_LOCAL stats thread_stats;
+
+static stats* stats_beg = NULL;
+static stats stats_exited;      // threads that are gone
+static mtx_t stats_lock;
+static tss_t stats_key;
+static once_flag stats_flag = ONCE_FLAG_INIT;
+
+static void add_stats(stats* sum, const stats* s)
+{
+    sum->allocs += s->allocs;
+    sum->frees += s->frees;
+    sum->var_steps += s->var_steps;
+    sum->scope_steps += s->scope_steps;
+    sum->member_steps += s->member_steps;
+    sum->pool_probes += s->pool_probes;
+    sum->scopes_entered += s->scopes_entered;
+    sum->scopes_exited += s->scopes_exited;
+    sum->skipped_tokens += s->skipped_tokens;
+    sum->binops += s->binops;
+    sum->binop_checks += s->binop_checks;
+}
+
+// a thread's copy dies with it, its counts are kept in stats_exited
+static void exit_thread(void* p)
+{
+    stats* t = p;
+    mtx_lock(&stats_lock);
+    add_stats(&stats_exited, t);
+    for (stats** s = &stats_beg; *s; s = &(*s)->next)
+    {
+        if (*s == t)
+        {
+            *s = t->next;
+            break;
+        }
+    }
+    mtx_unlock(&stats_lock);
+}
+
+static void init_stats()
+{
+    mtx_init(&stats_lock, mtx_plain);
+    tss_create(&stats_key, exit_thread);
+}
+
+void stats_thread()
+{
+    call_once(&stats_flag, init_stats);
+
+    mtx_lock(&stats_lock);
+    thread_stats.next = stats_beg;
+    stats_beg = &thread_stats;
+    mtx_unlock(&stats_lock);
+    tss_set(stats_key, &thread_stats);
+}
+
+void print_stats(FILE* f)
+{
+    stats sum = { 0 };
+
+    call_once(&stats_flag, init_stats);
+    mtx_lock(&stats_lock);
+    add_stats(&sum, &stats_exited);
+    for (stats* s = stats_beg; s; s = s->next)
+    {
+        add_stats(&sum, s);
+    }
+    mtx_unlock(&stats_lock);
+
+    fprintf(f, "allocs=%lld\n", sum.allocs);
+    fprintf(f, "frees=%lld\n", sum.frees);
+#ifdef ENTITY_STATS
+    fprintf(f, "var_steps=%lld\n", sum.var_steps);
+    fprintf(f, "scope_steps=%lld\n", sum.scope_steps);
+    fprintf(f, "member_steps=%lld\n", sum.member_steps);
+    fprintf(f, "pool_probes=%lld\n", sum.pool_probes);
+    fprintf(f, "scopes_entered=%lld\n", sum.scopes_entered);
+    fprintf(f, "scopes_exited=%lld\n", sum.scopes_exited);
+    fprintf(f, "skipped_tokens=%lld\n", sum.skipped_tokens);
+    fprintf(f, "binops=%lld\n", sum.binops);
+    fprintf(f, "binop_checks=%lld\n", sum.binop_checks);
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef ENTITY_STATS_H
+#define ENTITY_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lexer.h"
+
+// event counters, every thread counts into its own copy.
+// print_stats() adds them up, `entity --stats` prints them at exit.
+// allocations are always counted, everything else only in builds
+// with ENTITY_STATS defined (cmake -DENTITY_STATS=ON).
+typedef struct stats
+{
+    struct stats* next;
+    long long allocs;
+    long long frees;
+    long long var_steps;        // variables compared by find_variable()
+    long long scope_steps;      // scopes walked by find_variable()
+    long long member_steps;     // members compared by find_member()
+    long long pool_probes;      // strings compared by pool_add()
+    long long scopes_entered;   // new_scope()
+    long long scopes_exited;    // exit_scope()
+    long long skipped_tokens;   // tokens passed over by skip_block()
+    long long binops;           // binary_op() calls
+    long long binop_checks;     // operator/type cases tried by binary_op()
+} stats;
+
+extern THREAD_LOCAL stats thread_stats;
+
+#ifdef ENTITY_STATS
+#define STAT_INC(name) (thread_stats.name++)
+#else
+#define STAT_INC(name) ((void)0)
+#endif
+
+// call once on every thread that runs scripts, the counts are kept
+// when the thread exits
+void stats_thread();
+// key=value lines, one per counter
+void print_stats(FILE* f);
+
+// the interpreter allocates through these, so allocations are counted.
+// not counted: the profiler's own call tree (it would show up in the
+// allocs it reports) and the scheduler's deques, made once at startup.
+static inline void* mem_alloc(size_t size)
+{
+    thread_stats.allocs++;
+    return malloc(size);
+}
+
+static inline void* mem_realloc(void* p, size_t size)
+{
+    if (p == NULL)
+        thread_stats.allocs++;
+    return realloc(p, size);
+}
+
+static inline void mem_free(void* p)
+{
+    if (p != NULL)
+        thread_stats.frees++;
+    free(p);
+}
+
+#endif
@@ -0,0 +1,725 @@
+/*************************
+ * Runtime Strings
+ *************************/
+
+// a string value carries its length. up to 15 chars are stored inline in
+// the value, longer ones point into the pool (literals) or into a per
+// thread arena (strings made at run time). strings are immutable so
+// slices are views, no copies.
+//
+// the arena only grows, unless whoever runs the script frees it back to
+// a mark: str_release() drops every string made since str_mark_arena(),
+// after a --map record or a --serve request say. until then a string
+// made since the mark is transient, stored into a global, a member or
+// an array it's copied out to memory that's kept.
+//
+// concatenation onto the string at the top of the arena grows it in
+// place, `s = s + x` in a loop doesn't copy s again.
+
+#include <math.h>
+
+#define STR_CHUNK (64 * 1024)
+
+typedef struct str_chunk
+{
+    struct str_chunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+} str_chunk;
+
+THREAD_LOCAL str_chunk* str_arena = NULL;
+// a released chunk kept for the next one, so a mark that's released
+// over and over doesn't allocate every time
+THREAD_LOCAL str_chunk* str_spare = NULL;
+
+// room for n bytes at the top of the arena
+char* str_reserve(size_t n)
+{
+    if (str_arena == NULL || str_arena->used + n > str_arena->size)
+    {
+        // twice the size, so the string can grow in place
+        size_t size = n * 2 > STR_CHUNK ? n * 2 : STR_CHUNK;
+        str_chunk* c;
+        if (str_spare != NULL && str_spare->size >= size)
+        {
+            c = str_spare;
+            str_spare = NULL;
+        }
+        else
+        {
+            c = mem_alloc(sizeof(str_chunk) + size);
+            c->size = size;
+        }
+        c->next = str_arena;
+        c->used = 0;
+        str_arena = c;
+    }
+    return str_arena->data + str_arena->used;
+}
+
+typedef struct str_mark
+{
+    str_chunk* chunk;
+    size_t used;
+} str_mark;
+
+// the outermost mark that isn't released yet, strings above it are
+// transient
+THREAD_LOCAL int str_marks = 0;
+THREAD_LOCAL str_mark str_floor;
+
+// the top of this thread's arena, every mark is released
+str_mark str_mark_arena()
+{
+    str_mark m;
+    m.chunk = str_arena;
+    m.used = str_arena ? str_arena->used : 0;
+    if (str_marks++ == 0)
+        str_floor = m;
+    return m;
+}
+
+// a --serve request run in slices has an arena of its own,
+// it's swapped in while the request runs
+typedef struct str_arena_state
+{
+    str_chunk* arena;
+    int marks;
+    str_mark floor;
+} str_arena_state;
+
+// exchanges this thread's arena with s
+void str_swap(str_arena_state* s)
+{
+    str_arena_state t = { str_arena, str_marks, str_floor };
+    str_arena = s->arena;
+    str_marks = s->marks;
+    str_floor = s->floor;
+    *s = t;
+}
+
+// frees every string made on this thread since m was taken
+void str_release(str_mark m)
+{
+    str_marks--;
+    while (str_arena != m.chunk)
+    {
+        str_chunk* c = str_arena;
+        str_arena = c->next;
+        if (str_spare == NULL && c->size == STR_CHUNK)
+        {
+            str_spare = c;
+        }
+        else
+        {
+            mem_free(c);
+        }
+    }
+    if (str_arena != NULL)
+    {
+        str_arena->used = m.used;
+    }
+}
+
+// s is freed by the release of a mark
+int str_transient(const string* s)
+{
+    if (str_marks == 0 || s->sso[STR_INLINE] != STR_HEAP)
+        return 0;
+
+    const char* p = s->ptr;
+    str_chunk* c = str_arena;
+    for (; c != str_floor.chunk; c = c->next)
+    {
+        if (p >= c->data && p < c->data + c->used)
+            return 1;
+    }
+    // or it was grown in place over the mark
+    return c != NULL && p >= c->data && p < c->data + c->used
+        && p + s->len > c->data + str_floor.used;
+}
+
+// strings copied out of the arena, never freed
+THREAD_LOCAL str_chunk* str_kept = NULL;
+
+string string_keep(const string* s)
+{
+    size_t len = s->len;
+    if (str_kept == NULL || str_kept->used + len > str_kept->size)
+    {
+        size_t size = len > STR_CHUNK ? len : STR_CHUNK;
+        str_chunk* c = mem_alloc(sizeof(str_chunk) + size);
+        c->next = str_kept;
+        c->size = size;
+        c->used = 0;
+        str_kept = c;
+    }
+
+    string str = *s;
+    char* p = str_kept->data + str_kept->used;
+    memcpy(p, s->ptr, len);
+    str_kept->used += len;
+    str.ptr = p;
+    return str;
+}
+
+string string_from(const char* s, size_t len)
+{
+    string str;
+    if (len <= STR_INLINE)
+    {
+        memcpy(str.sso, s, len);
+        memset(str.sso + len, 0, STR_INLINE - len);
+        str.sso[STR_INLINE] = (char)len;
+        return str;
+    }
+    if (len > UINT32_MAX)
+    {
+        ERROR("(%d) string too long\n", lineno);
+    }
+
+    char* p = str_reserve(len);
+    memcpy(p, s, len);
+    str_arena->used += len;
+    str.ptr = p;
+    str.len = (uint32_t)len;
+    str.sso[STR_INLINE] = STR_HEAP;
+    return str;
+}
+
+// a pooled string, shared not copied
+string string_pooled(const char* s)
+{
+    size_t len = strlen(s);
+    if (len <= STR_INLINE)
+        return string_from(s, len);
+
+    string str;
+    str.ptr = s;
+    str.len = (uint32_t)len;
+    str.sso[STR_INLINE] = STR_POOL;
+    return str;
+}
+
+string string_concat(const string* a, const char* b, size_t b_len)
+{
+    size_t a_len = STR_LEN(a);
+    size_t len = a_len + b_len;
+    const char* a_ptr = STR_PTR(a);
+
+    if (len <= STR_INLINE || STR_IS_INLINE(a))
+    {
+        char buf[STR_INLINE * 2];
+        if (len <= sizeof(buf))
+        {
+            memcpy(buf, a_ptr, a_len);
+            memcpy(buf + a_len, b, b_len);
+            return string_from(buf, len);
+        }
+    }
+    else if (str_arena != NULL
+        && a_ptr + a_len == str_arena->data + str_arena->used
+        && str_arena->used + b_len <= str_arena->size
+        && len <= UINT32_MAX)
+    {
+        // a ends at the top of the arena, nothing else can be there
+        memcpy(str_arena->data + str_arena->used, b, b_len);
+        str_arena->used += b_len;
+        string str = *a;
+        str.len = (uint32_t)len;
+        return str;
+    }
+
+    if (len > UINT32_MAX)
+    {
+        ERROR("(%d) string too long\n", lineno);
+    }
+    char* p = str_reserve(len);
+    memcpy(p, a_ptr, a_len);
+    memcpy(p + a_len, b, b_len);
+    str_arena->used += len;
+
+    string str;
+    str.ptr = p;
+    str.len = (uint32_t)len;
+    str.sso[STR_INLINE] = STR_HEAP;
+    return str;
+}
+
+// s[beg:end], a view into s
+string string_slice(const string* s, int beg, int end)
+{
+    int len = (int)STR_LEN(s);
+    if (beg < 0 || end > len || beg > end)
+    {
+        ERROR("(%d) slice [%d:%d] out of bounds, length is %d\n", lineno, beg, end, len);
+    }
+    if (end - beg <= STR_INLINE)
+        return string_from(STR_PTR(s) + beg, end - beg);
+
+    string str;
+    str.ptr = STR_PTR(s) + beg;
+    str.len = end - beg;
+    str.sso[STR_INLINE] = STR_HEAP;
+    return str;
+}
+
+char string_at(const string* s, int i)
+{
+    int len = (int)STR_LEN(s);
+    if (i < 0 || i >= len)
+    {
+        ERROR("(%d) index %d out of bounds, length is %d\n", lineno, i, len);
+    }
+    return STR_PTR(s)[i];
+}
+
+int string_compare(const string* a, const string* b)
+{
+    size_t a_len = STR_LEN(a);
+    size_t b_len = STR_LEN(b);
+    int c = memcmp(STR_PTR(a), STR_PTR(b), a_len < b_len ? a_len : b_len);
+    if (c != 0)
+        return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+int string_equal(const string* a, const string* b)
+{
+    size_t len = STR_LEN(a);
+    if (len != STR_LEN(b))
+        return 0;
+    const char* a_ptr = STR_PTR(a);
+    const char* b_ptr = STR_PTR(b);
+    // same storage, e.g. the same literal
+    return a_ptr == b_ptr || memcmp(a_ptr, b_ptr, len) == 0;
+}
+
+const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// n in decimal, 2 digits at a time
+size_t format_integer(char* buf, uint64_t n, int negative)
+{
+    char tmp[24];
+    char* end = tmp + sizeof(tmp);
+    char* p = end;
+    while (n >= 100)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + (n % 100) * 2, 2);
+        n /= 100;
+    }
+    if (n >= 10)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + n * 2, 2);
+    }
+    else
+    {
+        *--p = (char)('0' + n);
+    }
+    if (negative)
+        *--p = '-';
+    memcpy(buf, p, end - p);
+    return end - p;
+}
+
+// exact shortest digits, after Burger & Dybvig's free-format printing.
+// v = f * 2^e is scaled to r / s and digits are made until the rest is
+// within the gap to the neighbouring floats, m- below and m+ above. the
+// numbers get as large as 2^1130, for a subnormal double.
+
+#define BIG_WORDS 40
+
+typedef struct big
+{
+    int n;
+    uint32_t d[BIG_WORDS];
+} big;
+
+static void big_set(big* a, uint64_t v)
+{
+    a->n = 0;
+    for (; v; v >>= 32)
+        a->d[a->n++] = (uint32_t)v;
+}
+
+static void big_mul(big* a, uint32_t m)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < a->n; i++)
+    {
+        carry += (uint64_t)a->d[i] * m;
+        a->d[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry)
+        a->d[a->n++] = (uint32_t)carry;
+}
+
+static void big_pow10(big* a, int k)
+{
+    static const uint32_t pow10[9] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+    for (; k >= 9; k -= 9)
+        big_mul(a, 1000000000);
+    if (k)
+        big_mul(a, pow10[k]);
+}
+
+static void big_shl(big* a, int bits)
+{
+    int words = bits / 32;
+    bits %= 32;
+    if (bits)
+    {
+        uint32_t carry = 0;
+        for (int i = 0; i < a->n; i++)
+        {
+            uint32_t x = a->d[i];
+            a->d[i] = x << bits | carry;
+            carry = x >> (32 - bits);
+        }
+        if (carry)
+            a->d[a->n++] = carry;
+    }
+    if (words && a->n)
+    {
+        memmove(a->d + words, a->d, a->n * sizeof(uint32_t));
+        memset(a->d, 0, words * sizeof(uint32_t));
+        a->n += words;
+    }
+}
+
+static uint64_t big_u64(const big* a)
+{
+    return a->n == 0 ? 0 : a->n == 1 ? a->d[0] : (uint64_t)a->d[1] << 32 | a->d[0];
+}
+
+static int big_cmp(const big* a, const big* b)
+{
+    if (a->n != b->n)
+        return a->n < b->n ? -1 : 1;
+    for (int i = a->n - 1; i >= 0; i--)
+    {
+        if (a->d[i] != b->d[i])
+            return a->d[i] < b->d[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void big_add(big* out, const big* a, const big* b)
+{
+    if (a->n < b->n)
+    {
+        const big* t = a;
+        a = b;
+        b = t;
+    }
+    uint64_t carry = 0;
+    for (int i = 0; i < a->n; i++)
+    {
+        carry += (uint64_t)a->d[i] + (i < b->n ? b->d[i] : 0);
+        out->d[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    out->n = a->n;
+    if (carry)
+        out->d[out->n++] = (uint32_t)carry;
+}
+
+// a -= b, a >= b
+static void big_sub(big* a, const big* b)
+{
+    int64_t borrow = 0;
+    for (int i = 0; i < a->n; i++)
+    {
+        borrow += (int64_t)a->d[i] - (i < b->n ? b->d[i] : 0);
+        a->d[i] = (uint32_t)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    while (a->n > 0 && a->d[a->n - 1] == 0)
+        a->n--;
+}
+
+// the digits of x > 0, a float of `bits` bits of precision whose
+// subnormals have the exponent min_e. x is 0.d1d2... * 10^k
+static int shortest_digits(char* digits, double x, int bits, int min_e, int* k)
+{
+    int e;
+    frexp(x, &e);
+    e = e - bits < min_e ? min_e : e - bits;
+    uint64_t f = (uint64_t)ldexp(x, -e);
+    // reading back rounds to even, an even f owns the ends of its gap
+    int even = (f & 1) == 0;
+
+    // at a power of two the gap above is twice the one below
+    int uneven = f == (uint64_t)1 << (bits - 1) && e > min_e;
+    big r, s, mp, mm;
+    if (e >= 0)
+    {
+        big_set(&r, f);
+        big_shl(&r, e + 1 + uneven);
+        big_set(&s, 2 << uneven);
+        big_set(&mp, 1);
+        big_shl(&mp, e + uneven);
+        big_set(&mm, 1);
+        big_shl(&mm, e);
+    }
+    else
+    {
+        big_set(&r, f << (1 + uneven));
+        big_set(&s, 1);
+        big_shl(&s, 1 - e + uneven);
+        big_set(&mp, 1 << uneven);
+        big_set(&mm, 1);
+    }
+
+    // an estimate of k that's never too high, at most one too low
+    *k = (int)ceil(log10(x) - 1e-10);
+    if (*k >= 0)
+    {
+        big_pow10(&s, *k);
+    }
+    else
+    {
+        big_pow10(&r, 0 - *k);
+        big_pow10(&mp, 0 - *k);
+        if (uneven)
+            big_pow10(&mm, 0 - *k);
+    }
+    big* low_gap = uneven ? &mm : &mp;
+    big t;
+    big_add(&t, &r, &mp);
+    int c = big_cmp(&t, &s);
+    if (even ? c >= 0 : c > 0)
+    {
+        big_mul(&s, 10);
+        (*k)++;
+    }
+
+    int n = 0;
+    if (s.n < 2 || (s.n == 2 && s.d[1] < 1u << 28))
+    {
+        // s < 2^60 and the others are below it, ten times them fits in
+        // 64 bits. that's most numbers from 0.1 to 2^53
+        uint64_t r64 = big_u64(&r), s64 = big_u64(&s);
+        uint64_t mp64 = big_u64(&mp), mm64 = big_u64(low_gap);
+        for (;;)
+        {
+            r64 *= 10;
+            mp64 *= 10;
+            mm64 *= 10;
+            int d = (int)(r64 / s64);
+            r64 %= s64;
+            int low = even ? r64 <= mm64 : r64 < mm64;
+            int high = even ? r64 + mp64 >= s64 : r64 + mp64 > s64;
+            if (low && high)
+                d += r64 * 2 > s64 || (r64 * 2 == s64 && (d & 1));
+            else if (high)
+                d++;
+            digits[n++] = (char)('0' + d);
+            if (low || high)
+                return n;
+        }
+    }
+
+    for (;;)
+    {
+        big_mul(&r, 10);
+        big_mul(&mp, 10);
+        if (uneven)
+            big_mul(&mm, 10);
+        int d = 0;
+        while (big_cmp(&r, &s) >= 0)
+        {
+            big_sub(&r, &s);
+            d++;
+        }
+        c = big_cmp(&r, low_gap);
+        int low = even ? c <= 0 : c < 0;
+        big_add(&t, &r, &mp);
+        c = big_cmp(&t, &s);
+        int high = even ? c >= 0 : c > 0;
+        if (low && high)
+        {
+            // both fit, the nearer one, ties to even like printf
+            big_add(&t, &r, &r);
+            c = big_cmp(&t, &s);
+            d += c > 0 || (c == 0 && (d & 1));
+        }
+        else if (high)
+        {
+            d++;
+        }
+        digits[n++] = (char)('0' + d);
+        if (low || high)
+            return n;
+    }
+}
+
+// x the way %g prints it with the fewest digits that read back as x,
+// at least `precision` digits before it switches to an exponent
+static size_t format_float(char* buf, size_t size, double x, int bits, int min_e, int precision)
+{
+    if (!isfinite(x))
+        return snprintf(buf, size, "%g", x);
+
+    char tmp[32];
+    char* p = tmp;
+    if (signbit(x))
+        *p++ = '-';
+    if (x == 0)
+    {
+        *p++ = '0';
+    }
+    else
+    {
+        char digits[20];
+        int k;
+        int n = shortest_digits(digits, fabs(x), bits, min_e, &k);
+        int exp = k - 1;
+        if (n > precision)
+            precision = n;
+
+        if (exp < -4 || exp >= precision)
+        {
+            *p++ = digits[0];
+            if (n > 1)
+            {
+                *p++ = '.';
+                memcpy(p, digits + 1, n - 1);
+                p += n - 1;
+            }
+            *p++ = 'e';
+            *p++ = exp < 0 ? '-' : '+';
+            if (exp < 0)
+                exp = 0 - exp;
+            if (exp < 10)
+                *p++ = '0';
+            p += format_integer(p, (uint64_t)exp, 0);
+        }
+        else if (exp < 0)
+        {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = exp + 1; i < 0; i++)
+                *p++ = '0';
+            memcpy(p, digits, n);
+            p += n;
+        }
+        else
+        {
+            for (int i = 0; i <= exp; i++)
+                *p++ = i < n ? digits[i] : '0';
+            if (n > exp + 1)
+            {
+                *p++ = '.';
+                memcpy(p, digits + exp + 1, n - exp - 1);
+                p += n - exp - 1;
+            }
+        }
+    }
+
+    size_t len = p - tmp;
+    if (len >= size)
+        len = size - 1;
+    memcpy(buf, tmp, len);
+    buf[len] = '\0';
+    return len;
+}
+
+// the shortest text that reads back as the same number
+size_t format_number(char* buf, size_t size, const value* v)
+{
+    // whole numbers %g would print without an exponent
+    double whole = v->type == TYPE_FLOAT ? v->f32 : v->f64;
+    double limit = v->type == TYPE_FLOAT ? 1e6 : 1e15;
+    if ((v->type == TYPE_FLOAT || v->type == TYPE_DOUBLE)
+        && whole > -limit && whole < limit && whole == (double)(int64_t)whole
+        && (whole != 0 || !signbit(whole)))
+    {
+        int64_t i = (int64_t)whole;
+        return format_integer(buf, i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0);
+    }
+
+    switch (v->type)
+    {
+    case TYPE_FLOAT:
+        return format_float(buf, size, v->f32, 24, -149, 6);
+    case TYPE_DOUBLE:
+        return format_float(buf, size, v->f64, 53, -1074, 15);
+    case TYPE_ULONG:
+        return format_integer(buf, v->u64, 0);
+    default:
+    {
+        int64_t i = number_i64(v);
+        return format_integer(buf, i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0);
+    }
+    }
+}
+
+// string + string, string + char, string + number, and comparisons
+void string_op(value* out, const value* lhs, int op, const value* rhs)
+{
+    if (lhs->type != TYPE_STRING)
+    {
+        ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+            lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+    }
+
+    if (op == '+')
+    {
+        char buf[32];
+        const char* b;
+        size_t len;
+        switch (rhs->type)
+        {
+        case TYPE_STRING:
+            b = STR_PTR(&rhs->str);
+            len = STR_LEN(&rhs->str);
+            break;
+        case TYPE_CHAR:
+            buf[0] = rhs->i8;
+            b = buf;
+            len = 1;
+            break;
+        default:
+            if (!IS_NUMBER(rhs->type))
+                ERROR("(%d) can't append %s to a string\n", lineno, type_name(rhs->type));
+            b = buf;
+            len = format_number(buf, sizeof(buf), rhs);
+            break;
+        }
+        out->str = string_concat(&lhs->str, b, len);
+        out->type = TYPE_STRING;
+        return;
+    }
+
+    if (rhs->type == TYPE_STRING && (op == EQU || op == NEQ))
+    {
+        out->type = TYPE_INT;
+        out->i32 = string_equal(&lhs->str, &rhs->str) == (op == EQU);
+        return;
+    }
+
+    if (rhs->type == TYPE_STRING && (op == '<' || op == '>' || op == LE || op == GE))
+    {
+        int c = string_compare(&lhs->str, &rhs->str);
+        out->type = TYPE_INT;
+        switch (op)
+        {
+        case '<': out->i32 = c < 0; break;
+        case '>': out->i32 = c > 0; break;
+        case LE:  out->i32 = c <= 0; break;
+        default:  out->i32 = c >= 0; break;
+        }
+        return;
+    }
+
+    ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+        lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+}
@@ -1,360 +1,1475 @@
-typedef struct entity entity;
-typedef struct value
-{
-    int type; // data type
-    union {
-        int8_t i8;
-        int16_t i16;
-        int32_t i32;
-        int64_t i64;
-        uint8_t u8;
-        uint16_t u16;
-        uint32_t u32;
-        uint64_t u64;
-        float f32;
-        double f64;
-        char *str;
-        entity *obj; // entity
-    };
-} value;
-
-typedef struct member
-{
-    struct member* next;
-    char* name;
-    value val;
-} member;
-
-typedef struct entity
-{
-    member* mbeg;
-    member* mend;
-} entity;
-
-// data types
-enum { 
-    TYPE_VOID, TYPE_CHAR, TYPE_SHORT, TYPE_INT, TYPE_LONG,
-    TYPE_UCHAR, TYPE_USHORT, TYPE_UINT, TYPE_ULONG,
-    TYPE_FLOAT, TYPE_DOUBLE, TYPE_STRING, TYPE_ENTITY,
-};
-
-const char* type_name(int type)
-{
-    switch(type)
-    {
-    case TYPE_VOID:      return "void";
-    case TYPE_CHAR:      return "char";
-    case TYPE_SHORT:     return "short";
-    case TYPE_INT:       return "int";
-    case TYPE_LONG:      return "long";
-    case TYPE_UCHAR:     return "uchar";
-    case TYPE_USHORT:    return "ushort";
-    case TYPE_UINT:      return "uint";
-    case TYPE_ULONG:     return "ulong";
-    case TYPE_FLOAT:     return "float";
-    case TYPE_DOUBLE:    return "double";
-    case TYPE_STRING:    return "string";
-    case TYPE_ENTITY:    return "entity";
-    default:             return "unknown type";
-    }
-}
-
-int get_type(const char* s)
-{
-#define CMP(type, str)  \
-    if (!strcmp(str, s)) return type;
-
-    CMP(TYPE_VOID,      "void");
-    CMP(TYPE_CHAR,      "char");
-    CMP(TYPE_SHORT,     "short");
-    CMP(TYPE_INT,       "int");
-    CMP(TYPE_LONG,      "long");
-    CMP(TYPE_UCHAR,     "uchar");
-    CMP(TYPE_USHORT,    "ushort");
-    CMP(TYPE_UINT,      "uint");
-    CMP(TYPE_ULONG,     "ulong");
-    CMP(TYPE_FLOAT,     "float");
-    CMP(TYPE_DOUBLE,    "double");
-    CMP(TYPE_STRING,    "string");
-    CMP(TYPE_ENTITY,    "entity");
-    return -1;
-
-#undef CMP
-}
-
-#define MATCH_OP(ltype, _op, rtype)                                     \
-    if (lhs->type == ltype                                              \
-        && rhs->type == rtype                                           \
-        && op == _op)
-
-#define IMPL_OP(ltype, _op, rtype, otype, ofield, lfield, _op2, rfield) \
-    MATCH_OP(ltype, _op, rtype)                                         \
-    {                                                                   \
-        out->type = otype;                                              \
-        out->ofield = lhs->lfield _op2 rhs->rfield;                     \
-        return;                                                         \
-    }
-
-double fmod(double, double);
-
-void binary_op(value* out, const value* lhs, int op, const value* rhs)
-{
-    // operators between 2 ints
-    IMPL_OP(
-        TYPE_INT, '+', TYPE_INT,
-        TYPE_INT, i32, i32, +, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '-', TYPE_INT,
-        TYPE_INT, i32, i32, -, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '*', TYPE_INT,
-        TYPE_INT, i32, i32, *, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '/', TYPE_INT,
-        TYPE_INT, i32, i32, /, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '%', TYPE_INT,
-        TYPE_INT, i32, i32, %, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '<', TYPE_INT,
-        TYPE_INT, i32, i32, <, i32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '>', TYPE_INT,
-        TYPE_INT, i32, i32, >, i32
-    );
-
-    // operators between 2 floats
-    IMPL_OP(
-        TYPE_FLOAT, '+', TYPE_FLOAT,
-        TYPE_FLOAT, f32, f32, +, f32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '-', TYPE_FLOAT,
-        TYPE_FLOAT, f32, f32, -, f32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '*', TYPE_FLOAT,
-        TYPE_FLOAT, f32, f32, *, f32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '/', TYPE_FLOAT,
-        TYPE_FLOAT, f32, f32, /, f32
-    );
-
-    MATCH_OP(TYPE_FLOAT, '%', TYPE_FLOAT)
-    {
-        out->type = TYPE_FLOAT;
-        out->f32 = fmod(lhs->f32, rhs->f32);
-        return; 
-    }
-
-    IMPL_OP(
-        TYPE_FLOAT, '<', TYPE_FLOAT,
-        TYPE_INT, i32, f32, <, f32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '>', TYPE_FLOAT,
-        TYPE_INT, i32, f32, >, f32
-    );
-
-    // operators between float and int
-    IMPL_OP(
-        TYPE_FLOAT, '+', TYPE_INT,
-        TYPE_FLOAT, f32, f32, +, i32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '-', TYPE_INT,
-        TYPE_FLOAT, f32, f32, -, i32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '*', TYPE_INT,
-        TYPE_FLOAT, f32, f32, *, i32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '/', TYPE_INT,
-        TYPE_FLOAT, f32, f32, /, i32
-    );
-
-    MATCH_OP(TYPE_FLOAT, '%', TYPE_INT)
-    {
-        out->type = TYPE_FLOAT;
-        out->f32 = fmod(lhs->f32, rhs->i32);
-        return; 
-    }
-
-    IMPL_OP(
-        TYPE_FLOAT, '<', TYPE_INT,
-        TYPE_INT, i32, f32, <, i32
-    );
-
-    IMPL_OP(
-        TYPE_FLOAT, '>', TYPE_INT,
-        TYPE_INT, i32, f32, >, i32
-    );
-
-    // operators between int and float
-    IMPL_OP(
-        TYPE_INT, '+', TYPE_FLOAT,
-        TYPE_FLOAT, f32, i32, +, f32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '-', TYPE_FLOAT,
-        TYPE_FLOAT, f32, i32, -, f32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '*', TYPE_FLOAT,
-        TYPE_FLOAT, f32, i32, *, f32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '/', TYPE_FLOAT,
-        TYPE_FLOAT, f32, i32, /, f32
-    );
-
-    MATCH_OP(TYPE_INT, '%', TYPE_FLOAT)
-    {
-        out->type = TYPE_FLOAT;
-        out->f32 = fmod(lhs->i32, rhs->f32);
-        return; 
-    }
-
-    IMPL_OP(
-        TYPE_INT, '<', TYPE_FLOAT,
-        TYPE_INT, i32, i32, <, f32
-    );
-
-    IMPL_OP(
-        TYPE_INT, '>', TYPE_FLOAT,
-        TYPE_INT, i32, i32, >, f32
-    );
-
-    ERROR("(%d) unknown operator between types '%s' and '%s': %c\n",
-        lineno, type_name(lhs->type), type_name(rhs->type), op);
-}
-
-void type_convert(value* val, int type)
-{
-    if (val->type == type)
-        return;
-    ERROR("(%d) can't convert from %s to %s\n", 
-        lineno, type_name(val->type), type_name(type));
-}
-
-value* _find_member(member* m, char* name)
-{
-    if (m == NULL)
-        return NULL;
-
-    if (m->name == name)
-        return &m->val;
-    
-    return _find_member(m->next, name);
-}
-
-value* find_member(entity* e, char* name)
-{
-    return _find_member(e->mbeg, name);
-}
-
-value* get_member(entity* e, char* name)
-{
-    value* val = find_member(e, name);
-    if (val == NULL)
-        ERROR("(%d) no such member: %s\n", lineno, name);
-    return val;
-}
-
-void append_member(value var, char* name, value val)
-{
-    if (var.type != TYPE_ENTITY)
-    {
-        ERROR("(%d) can't append member to non-entity object\n", lineno);
-    }
-    entity* e = var.obj;
-    if (find_member(e, name) != NULL)
-    {
-        ERROR("(%d) member %s already exists\n", lineno, name);
-    }
-    member* m = malloc(sizeof(member));
-    m->next = NULL;
-    m->name = name;
-    m->val = val;
-    if (e->mend == NULL)
-    {
-        e->mbeg = m;
-        e->mend = m;
-    }
-    else
-    {
-        e->mend->next = m;
-        e->mend = m;
-    }
-}
-
-value new_entity()
-{
-    entity* e = malloc(sizeof(entity));
-    e->mbeg = NULL;
-    e->mend = NULL;
-
-    value ret;
-    ret.type = TYPE_ENTITY;
-    ret.obj = e;
-    return ret;
-}
-
-void free_members(member* m)
-{
-    if (m == NULL)
-    {
-        return;
-    }
-    free_members(m->next);
-    free(m);
-}
-
-value* get_variable(const char* name);
-
-value del_entity()
-{
-    value var = *get_variable(find_string("e"));
-    entity* e = var.obj;
-    free_members(e->mbeg);
-    free(e);
-
-    value ret;
-    memset(&ret, 0, sizeof(value));
-    ret.type = TYPE_VOID;
-    return ret;
-}
-
-value print_str()
-{
-    printf("%s", get_variable(find_string("s"))->str);
-
-    value ret;
-    memset(&ret, 0, sizeof(value));
-    ret.type = TYPE_VOID;
-    return ret;
+typedef struct entity entity;
+typedef struct coroutine coroutine;
+typedef struct array array;
+
+// 16 bytes: up to 15 chars inline with the length in the last byte, so
+// a zeroed string is "". longer strings point into the pool or the
+// string arena (str.c). only a whole pooled string (STR_POOL) is
+// NUL-terminated, use the length.
+typedef struct string
+{
+    union {
+        struct {
+            const char* ptr;
+            uint32_t len;
+        };
+        char sso[16];
+    };
+} string;
+
+#define STR_INLINE 15
+#define STR_HEAP ((char)0xff)
+#define STR_POOL ((char)0xfe)
+#define STR_IS_INLINE(s) ((unsigned char)(s)->sso[STR_INLINE] <= STR_INLINE)
+#define STR_LEN(s) (STR_IS_INLINE(s) ? (size_t)(s)->sso[STR_INLINE] : (size_t)(s)->len)
+#define STR_PTR(s) (STR_IS_INLINE(s) ? (s)->sso : (s)->ptr)
+
+typedef struct value
+{
+    int type; // data type
+    union {
+        int8_t i8;
+        int16_t i16;
+        int32_t i32;
+        int64_t i64;
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        float f32;
+        double f64;
+        string str;
+        entity *obj; // entity
+        coroutine *co;
+        array *arr;
+        float v4[4];    // float3 & float4, a float3 keeps w at 0
+    };
+} value;
+
+// variables & members are stored nan-boxed in a slot, see load_slot()
+typedef uint64_t slot;
+
+typedef struct member
+{
+    struct member* next;
+    char* name;
+    slot val;
+} member;
+
+typedef struct archetype archetype;
+typedef struct entity
+{
+    member* mbeg;
+    member* mend;
+    archetype* arch;    // --ecs: the table the entity lives in
+    int row;
+} entity;
+
+// elements are packed back to back, `size` bytes each
+typedef struct array
+{
+    int type;   // element type
+    int size;
+    int len;
+    int cap;
+    char* data;
+} array;
+
+// data types
+enum { 
+    TYPE_VOID, TYPE_CHAR, TYPE_SHORT, TYPE_INT, TYPE_LONG,
+    TYPE_UCHAR, TYPE_USHORT, TYPE_UINT, TYPE_ULONG,
+    TYPE_FLOAT, TYPE_DOUBLE, TYPE_STRING, TYPE_ENTITY,
+    TYPE_COROUTINE, TYPE_FLOAT3, TYPE_FLOAT4,
+    TYPE_ANY, // native functions only, accepts/returns any type
+};
+
+// int[] is TYPE_INT | TYPE_ARRAY. arrays don't nest.
+#define TYPE_ARRAY 0x100
+#define ARRAY_OF(type) ((type) | TYPE_ARRAY)
+#define IS_ARRAY(type) ((type) & TYPE_ARRAY)
+#define ELEM_TYPE(type) ((type) & ~TYPE_ARRAY)
+
+const char* array_type_name(int type)
+{
+    switch(ELEM_TYPE(type))
+    {
+    case TYPE_CHAR:      return "char[]";
+    case TYPE_SHORT:     return "short[]";
+    case TYPE_INT:       return "int[]";
+    case TYPE_LONG:      return "long[]";
+    case TYPE_UCHAR:     return "uchar[]";
+    case TYPE_USHORT:    return "ushort[]";
+    case TYPE_UINT:      return "uint[]";
+    case TYPE_ULONG:     return "ulong[]";
+    case TYPE_FLOAT:     return "float[]";
+    case TYPE_DOUBLE:    return "double[]";
+    case TYPE_STRING:    return "string[]";
+    case TYPE_ENTITY:    return "entity[]";
+    case TYPE_COROUTINE: return "coroutine[]";
+    case TYPE_FLOAT3:    return "float3[]";
+    case TYPE_FLOAT4:    return "float4[]";
+    default:             return "unknown type";
+    }
+}
+
+const char* type_name(int type)
+{
+    if (IS_ARRAY(type))
+        return array_type_name(type);
+
+    switch(type)
+    {
+    case TYPE_VOID:      return "void";
+    case TYPE_CHAR:      return "char";
+    case TYPE_SHORT:     return "short";
+    case TYPE_INT:       return "int";
+    case TYPE_LONG:      return "long";
+    case TYPE_UCHAR:     return "uchar";
+    case TYPE_USHORT:    return "ushort";
+    case TYPE_UINT:      return "uint";
+    case TYPE_ULONG:     return "ulong";
+    case TYPE_FLOAT:     return "float";
+    case TYPE_DOUBLE:    return "double";
+    case TYPE_STRING:    return "string";
+    case TYPE_ENTITY:    return "entity";
+    case TYPE_COROUTINE: return "coroutine";
+    case TYPE_FLOAT3:    return "float3";
+    case TYPE_FLOAT4:    return "float4";
+    case TYPE_ANY:       return "any";
+    default:             return "unknown type";
+    }
+}
+
+int get_type(const char* s)
+{
+#define CMP(type, str)  \
+    if (!strcmp(str, s)) return type;
+
+    CMP(TYPE_VOID,      "void");
+    CMP(TYPE_CHAR,      "char");
+    CMP(TYPE_SHORT,     "short");
+    CMP(TYPE_INT,       "int");
+    CMP(TYPE_LONG,      "long");
+    CMP(TYPE_UCHAR,     "uchar");
+    CMP(TYPE_USHORT,    "ushort");
+    CMP(TYPE_UINT,      "uint");
+    CMP(TYPE_ULONG,     "ulong");
+    CMP(TYPE_FLOAT,     "float");
+    CMP(TYPE_DOUBLE,    "double");
+    CMP(TYPE_STRING,    "string");
+    CMP(TYPE_ENTITY,    "entity");
+    CMP(TYPE_COROUTINE, "coroutine");
+    CMP(TYPE_FLOAT3,    "float3");
+    CMP(TYPE_FLOAT4,    "float4");
+    return -1;
+
+#undef CMP
+}
+
+// slots: 8 bytes instead of a 24-byte value. a double is stored as
+// itself (nans as one canonical nan), everything else in the payload of
+// a negative quiet nan with a tag in bits 48-50:
+//   small     the type in bits 32-39, the bits of a <= 32-bit number
+//   long      a long that fits in 48 bits
+//   pointers  entity, coroutine & array (its element type is in the array)
+//   string    up to 6 chars without a NUL, padded with NULs
+//   pooled    a whole pooled string, it's NUL-terminated
+//   wide      a cell with the value: other strings, vectors, big longs
+#define BOX_NAN     0x7ff8000000000000ULL
+#define BOX_PREFIX  0xfff8000000000000ULL
+#define BOX_MASK    0x0000ffffffffffffULL
+#define BOX(tag, payload) (BOX_PREFIX | (uint64_t)(tag) << 48 | (payload))
+#define BOX_TAG(s) ((s) >= BOX_PREFIX ? (int)((s) >> 48 & 7) : BOX_DOUBLE)
+#define BOX_STRING_MAX 6
+
+enum { BOX_STRING, BOX_SMALL, BOX_LONG, BOX_ENTITY, BOX_COROUTINE, BOX_ARRAY, BOX_WIDE, BOX_POOLED, BOX_DOUBLE };
+
+int fits_48(uint64_t bits)
+{
+    return (int64_t)(bits << 16) >> 16 == (int64_t)bits;
+}
+
+// cells are recycled through a free list per thread, a slot that goes
+// wide doesn't allocate once the thread has freed a few
+#define CELL_BLOCK 64
+
+typedef union cell
+{
+    value val;
+    union cell* next;
+} cell;
+
+THREAD_LOCAL cell* free_cells = NULL;
+
+value* new_cell()
+{
+    if (free_cells == NULL)
+    {
+        cell* block = mem_alloc(CELL_BLOCK * sizeof(cell));
+        if (!fits_48((uintptr_t)(block + CELL_BLOCK)))
+        {
+            ERROR("(%d) pointer doesn't fit in a slot\n", lineno);
+        }
+        for (int i = 0; i < CELL_BLOCK; i++)
+        {
+            block[i].next = free_cells;
+            free_cells = &block[i];
+        }
+    }
+    cell* c = free_cells;
+    free_cells = c->next;
+    return &c->val;
+}
+
+void free_cell(value* v)
+{
+    cell* c = (cell*)v;
+    c->next = free_cells;
+    free_cells = c;
+}
+
+value load_slot(slot s)
+{
+    value v;
+    // numbers first, most loads are
+    if (BOX_TAG(s) == BOX_SMALL)
+    {
+        v.type = (int)(s >> 32 & 0xff);
+        v.u64 = (uint32_t)s;
+        return v;
+    }
+    switch (BOX_TAG(s))
+    {
+    case BOX_DOUBLE:
+        v.type = TYPE_DOUBLE;
+        memcpy(&v.f64, &s, sizeof(double));
+        break;
+    case BOX_SMALL:
+        v.type = (int)(s >> 32 & 0xff);
+        v.u64 = (uint32_t)s;
+        break;
+    case BOX_LONG:
+        v.type = TYPE_LONG;
+        v.i64 = (int64_t)(s << 16) >> 16;
+        break;
+    case BOX_ENTITY:
+        v.type = TYPE_ENTITY;
+        v.obj = (entity*)(uintptr_t)(s & BOX_MASK);
+        break;
+    case BOX_COROUTINE:
+        v.type = TYPE_COROUTINE;
+        v.co = (coroutine*)(uintptr_t)(s & BOX_MASK);
+        break;
+    case BOX_ARRAY:
+        v.arr = (array*)(uintptr_t)(s & BOX_MASK);
+        v.type = ARRAY_OF(v.arr->type);
+        break;
+    case BOX_STRING:
+    {
+        uint64_t chars = s & BOX_MASK;
+        v.type = TYPE_STRING;
+        memset(v.str.sso, 0, sizeof(v.str.sso));
+        memcpy(v.str.sso, &chars, BOX_STRING_MAX);
+        v.str.sso[STR_INLINE] = (char)strnlen(v.str.sso, BOX_STRING_MAX);
+        break;
+    }
+    case BOX_POOLED:
+        v.type = TYPE_STRING;
+        v.str.ptr = (const char*)(uintptr_t)(s & BOX_MASK);
+        v.str.len = (uint32_t)strlen(v.str.ptr);
+        v.str.sso[STR_INLINE] = STR_POOL;
+        break;
+    default:
+        v = *(value*)(uintptr_t)(s & BOX_MASK);
+        break;
+    }
+    return v;
+}
+
+int slot_type(slot s)
+{
+    switch (BOX_TAG(s))
+    {
+    case BOX_DOUBLE:     return TYPE_DOUBLE;
+    case BOX_SMALL:      return (int)(s >> 32 & 0xff);
+    case BOX_LONG:       return TYPE_LONG;
+    case BOX_ENTITY:     return TYPE_ENTITY;
+    case BOX_COROUTINE:  return TYPE_COROUTINE;
+    case BOX_ARRAY:      return ARRAY_OF(((array*)(uintptr_t)(s & BOX_MASK))->type);
+    case BOX_STRING:
+    case BOX_POOLED:     return TYPE_STRING;
+    default:             return ((value*)(uintptr_t)(s & BOX_MASK))->type;
+    }
+}
+
+void store_slot(slot* s, value v)
+{
+    slot n;
+    uint32_t bits;
+    // ints first, most stores are
+    if (v.type == TYPE_INT && BOX_TAG(*s) != BOX_WIDE)
+    {
+        *s = BOX(BOX_SMALL, (uint64_t)TYPE_INT << 32 | v.u32);
+        return;
+    }
+    switch (v.type)
+    {
+    case TYPE_DOUBLE:
+        if (v.f64 != v.f64)
+            n = BOX_NAN;
+        else
+            memcpy(&n, &v.f64, sizeof(double));
+        goto Store;
+    case TYPE_VOID:      bits = 0; goto Small;
+    case TYPE_CHAR:      bits = v.u8; goto Small;
+    case TYPE_UCHAR:     bits = v.u8; goto Small;
+    case TYPE_SHORT:     bits = v.u16; goto Small;
+    case TYPE_USHORT:    bits = v.u16; goto Small;
+    case TYPE_INT:
+    case TYPE_UINT:
+    case TYPE_FLOAT:     bits = v.u32; goto Small;
+    case TYPE_LONG:
+        if (!fits_48(v.u64))
+            break;
+        n = BOX(BOX_LONG, v.u64 & BOX_MASK);
+        goto Store;
+    case TYPE_ENTITY:
+        if (!fits_48((uintptr_t)v.obj))
+            break;
+        n = BOX(BOX_ENTITY, (uintptr_t)v.obj);
+        goto Store;
+    case TYPE_COROUTINE:
+        if (!fits_48((uintptr_t)v.co))
+            break;
+        n = BOX(BOX_COROUTINE, (uintptr_t)v.co);
+        goto Store;
+    case TYPE_STRING:
+    {
+        size_t len = STR_LEN(&v.str);
+        const char* p = STR_PTR(&v.str);
+        if (len <= BOX_STRING_MAX && memchr(p, 0, len) == NULL)
+        {
+            uint64_t chars = 0;
+            memcpy(&chars, p, len);
+            n = BOX(BOX_STRING, chars);
+            goto Store;
+        }
+        if (v.str.sso[STR_INLINE] == STR_POOL && fits_48((uintptr_t)p))
+        {
+            n = BOX(BOX_POOLED, (uintptr_t)p);
+            goto Store;
+        }
+        break;
+    }
+    default:
+        if (IS_ARRAY(v.type) && fits_48((uintptr_t)v.arr))
+        {
+            n = BOX(BOX_ARRAY, (uintptr_t)v.arr);
+            goto Store;
+        }
+        break;
+    }
+
+    // wide, the cell is reused when the slot has one
+    if (BOX_TAG(*s) != BOX_WIDE)
+    {
+        *s = BOX(BOX_WIDE, (uintptr_t)new_cell());
+    }
+    *(value*)(uintptr_t)(*s & BOX_MASK) = v;
+    return;
+
+Small:
+    n = BOX(BOX_SMALL, (uint64_t)v.type << 32 | bits);
+Store:
+    if (BOX_TAG(*s) == BOX_WIDE)
+    {
+        free_cell((value*)(uintptr_t)(*s & BOX_MASK));
+    }
+    *s = n;
+}
+
+// a slot that holds nothing yet
+slot new_slot(value v)
+{
+    slot s = 0;
+    store_slot(&s, v);
+    return s;
+}
+
+void free_slot(slot s)
+{
+    if (BOX_TAG(s) == BOX_WIDE)
+    {
+        free_cell((value*)(uintptr_t)(s & BOX_MASK));
+    }
+}
+
+int str_transient(const string* s);
+string string_keep(const string* s);
+int is_global(const slot* s);
+
+// a string made during a --map record or a --serve request is freed
+// when it ends, stored where it outlives that it's copied out first
+void keep_value(value* v)
+{
+    if (v->type == TYPE_STRING && str_transient(&v->str))
+    {
+        v->str = string_keep(&v->str);
+    }
+}
+
+#define MATCH_OP(ltype, _op, rtype)                                     \
+    if (STAT_INC(binop_checks),                                         \
+        lhs->type == ltype                                              \
+        && rhs->type == rtype                                           \
+        && op == _op)
+
+const char* op_name(int op)
+{
+    static THREAD_LOCAL char buf[2];
+    switch(op)
+    {
+    case EQU: return "==";
+    case NEQ: return "!=";
+    case LE:  return "<=";
+    case GE:  return ">=";
+    case AND: return "&&";
+    case OR:  return "||";
+    }
+    buf[0] = (char)op;
+    return buf;
+}
+
+#define IMPL_OP(ltype, _op, rtype, otype, ofield, lfield, _op2, rfield) \
+    MATCH_OP(ltype, _op, rtype)                                         \
+    {                                                                   \
+        out->type = otype;                                              \
+        out->ofield = lhs->lfield _op2 rhs->rfield;                     \
+        return;                                                         \
+    }
+
+double fmod(double, double);
+void array_op(value* out, const value* lhs, int op, const value* rhs);
+
+// str.c
+void string_op(value* out, const value* lhs, int op, const value* rhs);
+
+#define IS_NUMBER(type) ((type) >= TYPE_CHAR && (type) <= TYPE_DOUBLE)
+
+int64_t number_i64(const value* v)
+{
+    switch(v->type)
+    {
+    case TYPE_CHAR:      return v->i8;
+    case TYPE_SHORT:     return v->i16;
+    case TYPE_INT:       return v->i32;
+    case TYPE_LONG:      return v->i64;
+    case TYPE_UCHAR:     return v->u8;
+    case TYPE_USHORT:    return v->u16;
+    case TYPE_UINT:      return v->u32;
+    case TYPE_ULONG:     return (int64_t)v->u64;
+    case TYPE_FLOAT:     return (int64_t)v->f32;
+    default:             return (int64_t)v->f64;
+    }
+}
+
+double number_f64(const value* v)
+{
+    switch(v->type)
+    {
+    case TYPE_ULONG:     return (double)v->u64;
+    case TYPE_FLOAT:     return v->f32;
+    case TYPE_DOUBLE:    return v->f64;
+    default:             return (double)number_i64(v);
+    }
+}
+
+// converts between any 2 number types, like a c cast
+void convert_number(value* v, int type)
+{
+    if (v->type == type)
+        return;
+
+    value out;
+    memset(&out, 0, sizeof(value));
+    out.type = type;
+    switch(type)
+    {
+    case TYPE_CHAR:      out.i8 = (int8_t)number_i64(v); break;
+    case TYPE_SHORT:     out.i16 = (int16_t)number_i64(v); break;
+    case TYPE_INT:       out.i32 = (int32_t)number_i64(v); break;
+    case TYPE_LONG:      out.i64 = number_i64(v); break;
+    case TYPE_UCHAR:     out.u8 = (uint8_t)number_i64(v); break;
+    case TYPE_USHORT:    out.u16 = (uint16_t)number_i64(v); break;
+    case TYPE_UINT:      out.u32 = (uint32_t)number_i64(v); break;
+    case TYPE_ULONG:     out.u64 = v->type == TYPE_ULONG ? v->u64 : (uint64_t)number_i64(v); break;
+    case TYPE_FLOAT:     out.f32 = (float)number_f64(v); break;
+    case TYPE_DOUBLE:    out.f64 = number_f64(v); break;
+    }
+    *v = out;
+}
+
+// both sides of an operator are promoted to double, float, long or
+// int, the first one either side has, like c.
+int common_type(const value* lhs, const value* rhs)
+{
+    if (lhs->type == TYPE_DOUBLE || rhs->type == TYPE_DOUBLE)
+        return TYPE_DOUBLE;
+    if (lhs->type == TYPE_FLOAT || rhs->type == TYPE_FLOAT)
+        return TYPE_FLOAT;
+    if (lhs->type == TYPE_LONG || rhs->type == TYPE_LONG
+        || lhs->type == TYPE_ULONG || rhs->type == TYPE_ULONG)
+        return TYPE_LONG;
+    return TYPE_INT;
+}
+
+// numbers that aren't an int/float pair
+void number_op(value* out, const value* lhs, int op, const value* rhs)
+{
+    int type = common_type(lhs, rhs);
+
+    value r;
+    memset(&r, 0, sizeof(value));
+    if (type == TYPE_FLOAT || type == TYPE_DOUBLE)
+    {
+        double a = number_f64(lhs);
+        double b = number_f64(rhs);
+        r.type = TYPE_DOUBLE;
+        switch(op)
+        {
+        case '+': r.f64 = a + b; break;
+        case '-': r.f64 = a - b; break;
+        case '*': r.f64 = a * b; break;
+        case '/': r.f64 = a / b; break;
+        case '%': r.f64 = fmod(a, b); break;
+        case '<': r.type = TYPE_INT; r.i32 = a < b; break;
+        case '>': r.type = TYPE_INT; r.i32 = a > b; break;
+        case LE:  r.type = TYPE_INT; r.i32 = a <= b; break;
+        case GE:  r.type = TYPE_INT; r.i32 = a >= b; break;
+        case EQU: r.type = TYPE_INT; r.i32 = a == b; break;
+        case NEQ: r.type = TYPE_INT; r.i32 = a != b; break;
+        default:  r.type = TYPE_VOID; break;
+        }
+    }
+    else
+    {
+        int64_t a = number_i64(lhs);
+        int64_t b = number_i64(rhs);
+        r.type = TYPE_LONG;
+        switch(op)
+        {
+        case '+': r.i64 = (int64_t)((uint64_t)a + (uint64_t)b); break;
+        case '-': r.i64 = (int64_t)((uint64_t)a - (uint64_t)b); break;
+        case '*': r.i64 = (int64_t)((uint64_t)a * (uint64_t)b); break;
+        case '/': r.i64 = a / b; break;
+        case '%': r.i64 = a % b; break;
+        case '<': r.type = TYPE_INT; r.i32 = a < b; break;
+        case '>': r.type = TYPE_INT; r.i32 = a > b; break;
+        case LE:  r.type = TYPE_INT; r.i32 = a <= b; break;
+        case GE:  r.type = TYPE_INT; r.i32 = a >= b; break;
+        case EQU: r.type = TYPE_INT; r.i32 = a == b; break;
+        case NEQ: r.type = TYPE_INT; r.i32 = a != b; break;
+        default:  r.type = TYPE_VOID; break;
+        }
+    }
+
+    if (r.type == TYPE_VOID)
+    {
+        ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+            lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+    }
+    if (r.type != TYPE_INT)
+    {
+        convert_number(&r, type);
+    }
+    *out = r;
+}
+
+#define IS_VECTOR(type) ((type) == TYPE_FLOAT3 || (type) == TYPE_FLOAT4)
+
+// lanes of a vector operand, a float or int is broadcast
+int vector_lanes(const value* v, float* lanes)
+{
+    if (IS_VECTOR(v->type))
+    {
+        memcpy(lanes, v->v4, sizeof(v->v4));
+        return 1;
+    }
+    if (!IS_NUMBER(v->type))
+        return 0;
+    float f = (float)number_f64(v);
+    lanes[0] = lanes[1] = lanes[2] = lanes[3] = f;
+    return 1;
+}
+
+// float3/float4 + - * / the same type, or a scalar
+void vector_op(value* out, const value* lhs, int op, const value* rhs)
+{
+    int type = IS_VECTOR(lhs->type) ? lhs->type : rhs->type;
+    float a[4], b[4];
+
+    if ((op != '+' && op != '-' && op != '*' && op != '/')
+        || (IS_VECTOR(lhs->type) && IS_VECTOR(rhs->type) && lhs->type != rhs->type)
+        || !vector_lanes(lhs, a)
+        || !vector_lanes(rhs, b))
+    {
+        ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+            lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+    }
+
+    out->type = type;
+    vec4_op(op, out->v4, a, b);
+    if (type == TYPE_FLOAT3)
+    {
+        out->v4[3] = 0;
+    }
+}
+
+void binary_op(value* out, const value* lhs, int op, const value* rhs)
+{
+    STAT_INC(binops);
+
+    // operators between 2 ints
+    IMPL_OP(
+        TYPE_INT, '+', TYPE_INT,
+        TYPE_INT, i32, i32, +, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '-', TYPE_INT,
+        TYPE_INT, i32, i32, -, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '*', TYPE_INT,
+        TYPE_INT, i32, i32, *, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '/', TYPE_INT,
+        TYPE_INT, i32, i32, /, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '%', TYPE_INT,
+        TYPE_INT, i32, i32, %, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '<', TYPE_INT,
+        TYPE_INT, i32, i32, <, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '>', TYPE_INT,
+        TYPE_INT, i32, i32, >, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, LE, TYPE_INT,
+        TYPE_INT, i32, i32, <=, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, GE, TYPE_INT,
+        TYPE_INT, i32, i32, >=, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, EQU, TYPE_INT,
+        TYPE_INT, i32, i32, ==, i32
+    );
+
+    IMPL_OP(
+        TYPE_INT, NEQ, TYPE_INT,
+        TYPE_INT, i32, i32, !=, i32
+    );
+
+    // operators between 2 floats
+    IMPL_OP(
+        TYPE_FLOAT, '+', TYPE_FLOAT,
+        TYPE_FLOAT, f32, f32, +, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '-', TYPE_FLOAT,
+        TYPE_FLOAT, f32, f32, -, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '*', TYPE_FLOAT,
+        TYPE_FLOAT, f32, f32, *, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '/', TYPE_FLOAT,
+        TYPE_FLOAT, f32, f32, /, f32
+    );
+
+    MATCH_OP(TYPE_FLOAT, '%', TYPE_FLOAT)
+    {
+        out->type = TYPE_FLOAT;
+        out->f32 = fmod(lhs->f32, rhs->f32);
+        return; 
+    }
+
+    IMPL_OP(
+        TYPE_FLOAT, '<', TYPE_FLOAT,
+        TYPE_INT, i32, f32, <, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '>', TYPE_FLOAT,
+        TYPE_INT, i32, f32, >, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, LE, TYPE_FLOAT,
+        TYPE_INT, i32, f32, <=, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, GE, TYPE_FLOAT,
+        TYPE_INT, i32, f32, >=, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, EQU, TYPE_FLOAT,
+        TYPE_INT, i32, f32, ==, f32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, NEQ, TYPE_FLOAT,
+        TYPE_INT, i32, f32, !=, f32
+    );
+
+    // operators between float and int
+    IMPL_OP(
+        TYPE_FLOAT, '+', TYPE_INT,
+        TYPE_FLOAT, f32, f32, +, i32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '-', TYPE_INT,
+        TYPE_FLOAT, f32, f32, -, i32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '*', TYPE_INT,
+        TYPE_FLOAT, f32, f32, *, i32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '/', TYPE_INT,
+        TYPE_FLOAT, f32, f32, /, i32
+    );
+
+    MATCH_OP(TYPE_FLOAT, '%', TYPE_INT)
+    {
+        out->type = TYPE_FLOAT;
+        out->f32 = fmod(lhs->f32, rhs->i32);
+        return; 
+    }
+
+    IMPL_OP(
+        TYPE_FLOAT, '<', TYPE_INT,
+        TYPE_INT, i32, f32, <, i32
+    );
+
+    IMPL_OP(
+        TYPE_FLOAT, '>', TYPE_INT,
+        TYPE_INT, i32, f32, >, i32
+    );
+
+    // operators between int and float
+    IMPL_OP(
+        TYPE_INT, '+', TYPE_FLOAT,
+        TYPE_FLOAT, f32, i32, +, f32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '-', TYPE_FLOAT,
+        TYPE_FLOAT, f32, i32, -, f32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '*', TYPE_FLOAT,
+        TYPE_FLOAT, f32, i32, *, f32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '/', TYPE_FLOAT,
+        TYPE_FLOAT, f32, i32, /, f32
+    );
+
+    MATCH_OP(TYPE_INT, '%', TYPE_FLOAT)
+    {
+        out->type = TYPE_FLOAT;
+        out->f32 = fmod(lhs->i32, rhs->f32);
+        return; 
+    }
+
+    IMPL_OP(
+        TYPE_INT, '<', TYPE_FLOAT,
+        TYPE_INT, i32, i32, <, f32
+    );
+
+    IMPL_OP(
+        TYPE_INT, '>', TYPE_FLOAT,
+        TYPE_INT, i32, i32, >, f32
+    );
+
+    if (IS_NUMBER(lhs->type) && IS_NUMBER(rhs->type))
+    {
+        number_op(out, lhs, op, rhs);
+        return;
+    }
+
+    // entities, arrays & coroutines are the same when they're one object,
+    // == of arrays isn't element-wise
+    if (lhs->type == rhs->type && (op == EQU || op == NEQ)
+        && (lhs->type == TYPE_ENTITY || lhs->type == TYPE_COROUTINE || IS_ARRAY(lhs->type)))
+    {
+        out->type = TYPE_INT;
+        out->i32 = (lhs->obj == rhs->obj) == (op == EQU);
+        return;
+    }
+
+    if (IS_ARRAY(lhs->type) || IS_ARRAY(rhs->type))
+    {
+        array_op(out, lhs, op, rhs);
+        return;
+    }
+
+    if (IS_VECTOR(lhs->type) || IS_VECTOR(rhs->type))
+    {
+        vector_op(out, lhs, op, rhs);
+        return;
+    }
+
+    if (lhs->type == TYPE_STRING || rhs->type == TYPE_STRING)
+    {
+        string_op(out, lhs, op, rhs);
+        return;
+    }
+
+    ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+        lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+}
+
+// lhs op rhs for a comparison, without making a value when both are ints
+int compare(const value* lhs, int op, const value* rhs)
+{
+    if (lhs->type == TYPE_INT && rhs->type == TYPE_INT)
+    {
+        int32_t a = lhs->i32;
+        int32_t b = rhs->i32;
+        switch(op)
+        {
+        case '<': return a < b;
+        case '>': return a > b;
+        case LE:  return a <= b;
+        case GE:  return a >= b;
+        case EQU: return a == b;
+        case NEQ: return a != b;
+        }
+    }
+    value out;
+    binary_op(&out, lhs, op, rhs);
+    return out.i32;
+}
+
+// conditions: numbers are true when they're not 0, strings when they're
+// not empty, entities, arrays & coroutines when they're set
+int truth(const value* v)
+{
+    switch(v->type)
+    {
+    case TYPE_INT:       return v->i32 != 0;
+    case TYPE_FLOAT:     return v->f32 != 0;
+    case TYPE_DOUBLE:    return v->f64 != 0;
+    case TYPE_STRING:    return STR_LEN(&v->str) != 0;
+    case TYPE_ENTITY:    return v->obj != NULL;
+    case TYPE_COROUTINE: return v->co != NULL;
+    }
+    if (IS_NUMBER(v->type))
+        return number_i64(v) != 0;
+    if (IS_ARRAY(v->type))
+        return v->arr != NULL;
+    ERROR("(%d) %s can't be a condition\n", lineno, type_name(v->type));
+}
+
+void type_convert(value* val, int type)
+{
+    if (val->type == type)
+        return;
+    if (IS_NUMBER(val->type) && IS_NUMBER(type))
+    {
+        convert_number(val, type);
+        return;
+    }
+    ERROR("(%d) can't convert from %s to %s\n", 
+        lineno, type_name(val->type), type_name(type));
+}
+
+slot* _find_member(member* m, char* name)
+{
+    if (m == NULL)
+        return NULL;
+
+    STAT_INC(member_steps);
+    if (m->name == name)
+        return &m->val;
+    
+    return _find_member(m->next, name);
+}
+
+slot* find_member(entity* e, char* name)
+{
+    return _find_member(e->mbeg, name);
+}
+
+slot* get_member(entity* e, char* name)
+{
+    slot* val = find_member(e, name);
+    if (val == NULL)
+        ERROR("(%d) no such member: %s\n", lineno, name);
+    return val;
+}
+
+// ecs.c
+extern int ecs_mode;
+void ecs_add(entity* e);
+void ecs_append(entity* e, char* name, value val);
+void ecs_remove(entity* e);
+
+void append_member(value var, char* name, value val)
+{
+    if (var.type != TYPE_ENTITY)
+    {
+        ERROR("(%d) can't append member to non-entity object\n", lineno);
+    }
+    entity* e = var.obj;
+    if (e->arch != NULL)
+    {
+        ecs_append(e, name, val);
+        return;
+    }
+    if (find_member(e, name) != NULL)
+    {
+        ERROR("(%d) member %s already exists\n", lineno, name);
+    }
+    keep_value(&val);
+    member* m = mem_alloc(sizeof(member));
+    m->next = NULL;
+    m->name = name;
+    m->val = new_slot(val);
+    if (e->mend == NULL)
+    {
+        e->mbeg = m;
+        e->mend = m;
+    }
+    else
+    {
+        e->mend->next = m;
+        e->mend = m;
+    }
+}
+
+value new_entity()
+{
+    entity* e = mem_alloc(sizeof(entity));
+    e->mbeg = NULL;
+    e->mend = NULL;
+    e->arch = NULL;
+    e->row = 0;
+    if (ecs_mode)
+    {
+        ecs_add(e);
+    }
+
+    value ret;
+    ret.type = TYPE_ENTITY;
+    ret.obj = e;
+    return ret;
+}
+
+void free_members(member* m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    free_members(m->next);
+    free_slot(m->val);
+    mem_free(m);
+}
+
+// arrays
+
+// bytes of an element of type
+int type_size(int type)
+{
+    switch(type)
+    {
+    case TYPE_CHAR:
+    case TYPE_UCHAR:     return 1;
+    case TYPE_SHORT:
+    case TYPE_USHORT:    return 2;
+    case TYPE_INT:
+    case TYPE_UINT:
+    case TYPE_FLOAT:     return 4;
+    case TYPE_LONG:
+    case TYPE_ULONG:
+    case TYPE_DOUBLE:    return 8;
+    case TYPE_FLOAT3:    return 3 * sizeof(float);
+    case TYPE_FLOAT4:    return 4 * sizeof(float);
+    case TYPE_STRING:    return sizeof(string);
+    default:             return sizeof(void*);
+    }
+}
+
+void reserve_array(array* a, int cap)
+{
+    if (cap <= a->cap)
+        return;
+    if (cap < 2 * a->cap)
+        cap = 2 * a->cap;
+    a->data = mem_realloc(a->data, (size_t)cap * a->size);
+    a->cap = cap;
+}
+
+void resize_array(array* a, int len)
+{
+    if (len < 0)
+    {
+        ERROR("(%d) negative array length %d\n", lineno, len);
+    }
+    reserve_array(a, len);
+    if (len > a->len)
+    {
+        memset(a->data + (size_t)a->len * a->size, 0, (size_t)(len - a->len) * a->size);
+    }
+    a->len = len;
+}
+
+// any element type, arrays of arrays are only used internally
+array* make_array(int type, int len)
+{
+    array* a = mem_alloc(sizeof(array));
+    a->type = type;
+    a->size = type_size(type);
+    a->len = 0;
+    a->cap = 0;
+    a->data = NULL;
+    resize_array(a, len);
+    return a;
+}
+
+// type is the element type, the elements are zeroed
+value new_array(int type, int len)
+{
+    if (type == TYPE_VOID || IS_ARRAY(type))
+    {
+        ERROR("(%d) can't make an array of %s\n", lineno, type_name(type));
+    }
+
+    array* a = make_array(type, len);
+
+    value ret;
+    ret.type = ARRAY_OF(type);
+    ret.arr = a;
+    return ret;
+}
+
+void free_array(array* a)
+{
+    mem_free(a->data);
+    mem_free(a);
+}
+
+void check_index(array* a, int i)
+{
+    if (i < 0 || i >= a->len)
+    {
+        ERROR("(%d) index %d out of bounds, length %d\n", lineno, i, a->len);
+    }
+}
+
+// the element is copied in and out of the value's union,
+// every field of it starts at the same address.
+value array_get(array* a, int i)
+{
+    check_index(a, i);
+    value v;
+    v.type = a->type;
+    // a float3 element leaves w at 0
+    memset(v.v4, 0, sizeof(v.v4));
+    memcpy(v.v4, a->data + (size_t)i * a->size, a->size);
+    return v;
+}
+
+void array_set(array* a, int i, value v)
+{
+    check_index(a, i);
+    if (v.type != a->type)
+    {
+        ERROR("(%d) can't store %s in %s\n", lineno, type_name(v.type), array_type_name(a->type));
+    }
+    keep_value(&v);
+    memcpy(a->data + (size_t)i * a->size, &v.u64, a->size);
+}
+
+// data & step of an operand of array_op(), a scalar is converted
+// to the element type in tmp and broadcast with a step of 0.
+const void* array_operand(const value* v, int type, int len, int* step, value* tmp)
+{
+    if (IS_ARRAY(v->type))
+    {
+        if (v->type != ARRAY_OF(type) || v->arr->len != len)
+        {
+            ERROR("(%d) array operands must have the same type and length\n", lineno);
+        }
+        *step = 1;
+        return v->arr->data;
+    }
+
+    *tmp = *v;
+    if (IS_NUMBER(v->type))
+    {
+        convert_number(tmp, type);
+    }
+    if (tmp->type != type)
+    {
+        ERROR("(%d) can't combine %s with %s\n", lineno, type_name(v->type), array_type_name(type));
+    }
+    *step = 0;
+    return &tmp->u64;
+}
+
+// elementwise + - * / of int[] and float[], against an array of the
+// same length or a scalar. the result is a new array.
+void array_op(value* out, const value* lhs, int op, const value* rhs)
+{
+    const value* a = IS_ARRAY(lhs->type) ? lhs : rhs;
+    int type = ELEM_TYPE(a->type);
+    int len = a->arr->len;
+
+    if ((type != TYPE_INT && type != TYPE_FLOAT)
+        || (op != '+' && op != '-' && op != '*' && op != '/'))
+    {
+        ERROR("(%d) unknown operator between types '%s' and '%s': %s\n",
+            lineno, type_name(lhs->type), type_name(rhs->type), op_name(op));
+    }
+
+    int ls, rs;
+    value lt, rt;
+    const void* l = array_operand(lhs, type, len, &ls, &lt);
+    const void* r = array_operand(rhs, type, len, &rs, &rt);
+
+    // out may be lhs, it's written last
+    value ret = new_array(type, len);
+    if (type == TYPE_FLOAT)
+        simd_f32(op, (float*)ret.arr->data, l, ls, r, rs, len);
+    else
+        simd_i32(op, (int32_t*)ret.arr->data, l, ls, r, rs, len);
+    *out = ret;
+}
+
+// a place that values are loaded from and stored to: a variable,
+// a member, or an element of an array. a swizzle picks lanes of a
+// float3/float4 there.
+typedef struct place
+{
+    slot* val;      // NULL for an array element
+    array* arr;
+    int index;
+    int swizzle;    // 0, or lane count << 8 | 2 bits per lane
+    int member;     // a member of an entity
+} place;
+
+#define SWIZZLE_LANES(s) ((s) >> 8)
+#define SWIZZLE_LANE(s, i) (((s) >> (2 * (i))) & 3)
+
+int place_type(place p)
+{
+    if (p.swizzle)
+    {
+        int n = SWIZZLE_LANES(p.swizzle);
+        return n == 1 ? TYPE_FLOAT : n == 3 ? TYPE_FLOAT3 : TYPE_FLOAT4;
+    }
+    return p.val ? slot_type(*p.val) : p.arr->type;
+}
+
+value load(place p)
+{
+    value v = p.val ? load_slot(*p.val) : array_get(p.arr, p.index);
+    if (p.swizzle)
+    {
+        value out;
+        memset(&out, 0, sizeof(value));
+        out.type = place_type(p);
+        for (int i = 0; i < SWIZZLE_LANES(p.swizzle); i++)
+        {
+            out.v4[i] = v.v4[SWIZZLE_LANE(p.swizzle, i)];
+        }
+        return out;
+    }
+    return v;
+}
+
+void store(place p, value v)
+{
+    if (p.swizzle)
+    {
+        if (SWIZZLE_LANES(p.swizzle) != 1 || v.type != TYPE_FLOAT)
+        {
+            ERROR("(%d) only a float can be stored to a single lane\n", lineno);
+        }
+        int lane = SWIZZLE_LANE(p.swizzle, 0);
+        p.swizzle = 0;
+        value whole = load(p);
+        whole.v4[lane] = v.f32;
+        store(p, whole);
+        return;
+    }
+    if (p.val)
+    {
+        // a local goes with the record, a global or member outlives it
+        if (v.type == TYPE_STRING && str_transient(&v.str) && (p.member || is_global(p.val)))
+            v.str = string_keep(&v.str);
+        store_slot(p.val, v);
+    }
+    else
+    {
+        array_set(p.arr, p.index, v);
+    }
+}
+
+// .x .y .z .w pick one lane, .xyz .zyx .xyzw ... make a new vector
+int parse_swizzle(int type, const char* s)
+{
+    int n = (int)strlen(s);
+    int swizzle = 0;
+    if (n != 1 && n != 3 && n != 4)
+        return 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        int lane = s[i] == 'x' ? 0 : s[i] == 'y' ? 1 : s[i] == 'z' ? 2 : s[i] == 'w' ? 3 : -1;
+        if (lane == -1 || (lane == 3 && type == TYPE_FLOAT3))
+            return 0;
+        swizzle |= lane << (2 * i);
+    }
+    return n << 8 | swizzle;
+}
+
+place ecs_place(entity* e, char* name);
+
+place member_place(entity* e, char* name)
+{
+    if (e->arch != NULL)
+    {
+        return ecs_place(e, name);
+    }
+
+    place p;
+    p.val = get_member(e, name);
+    p.arr = NULL;
+    p.index = 0;
+    p.swizzle = 0;
+    p.member = 1;
+    return p;
+}
+
+slot* get_variable(const char* name);
+
+// an argument of a native function
+value arg(const char* name)
+{
+    return load_slot(*get_variable(find_string((char*)name)));
+}
+
+array* array_arg(const char* name)
+{
+    value v = arg(name);
+    if (!IS_ARRAY(v.type))
+    {
+        ERROR("(%d) %s is not an array\n", lineno, type_name(v.type));
+    }
+    return v.arr;
+}
+
+// len() of an array or a string
+value array_len()
+{
+    value v = arg("a");
+    value ret;
+    ret.type = TYPE_INT;
+    if (v.type == TYPE_STRING)
+        ret.i32 = (int32_t)STR_LEN(&v.str);
+    else
+        ret.i32 = array_arg("a")->len;
+    return ret;
+}
+
+value array_push()
+{
+    array* a = array_arg("a");
+    resize_array(a, a->len + 1);
+    array_set(a, a->len - 1, arg("v"));
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+    return ret;
+}
+
+value array_resize()
+{
+    resize_array(array_arg("a"), arg("n").i32);
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+    return ret;
+}
+
+// sum(a), min(a), max(a) & dot(a, b) of int[] and float[]
+array* numeric_array(array* a)
+{
+    if (a->type != TYPE_INT && a->type != TYPE_FLOAT)
+    {
+        ERROR("(%d) %s is not numeric\n", lineno, array_type_name(a->type));
+    }
+    return a;
+}
+
+array* numeric_arg(const char* name)
+{
+    return numeric_array(array_arg(name));
+}
+
+// min(a) & max(a) are math intrinsics, see math.c
+value reduce_array(array* a, int op)
+{
+    if (op != '+' && a->len == 0)
+    {
+        ERROR("(%d) %s of an empty array\n", lineno, op == '<' ? "min" : "max");
+    }
+
+    value ret;
+    ret.type = a->type;
+    if (a->type == TYPE_FLOAT)
+    {
+        float* f = (float*)a->data;
+        ret.f32 = op == '+' ? simd_sum_f32(f, a->len)
+                : op == '<' ? simd_min_f32(f, a->len)
+                : simd_max_f32(f, a->len);
+    }
+    else
+    {
+        int32_t* i = (int32_t*)a->data;
+        ret.i32 = op == '+' ? simd_sum_i32(i, a->len)
+                : op == '<' ? simd_min_i32(i, a->len)
+                : simd_max_i32(i, a->len);
+    }
+    return ret;
+}
+
+value array_sum() { return reduce_array(numeric_arg("a"), '+'); }
+
+value array_dot()
+{
+    value va = arg("a");
+    value vb = arg("b");
+    if (IS_VECTOR(va.type))
+    {
+        if (va.type != vb.type)
+        {
+            ERROR("(%d) dot of %s and %s\n", lineno, type_name(va.type), type_name(vb.type));
+        }
+        value ret;
+        ret.type = TYPE_FLOAT;
+        ret.f32 = vec4_dot(va.v4, vb.v4);
+        return ret;
+    }
+
+    array* a = numeric_arg("a");
+    array* b = numeric_arg("b");
+    if (a->type != b->type || a->len != b->len)
+    {
+        ERROR("(%d) array operands must have the same type and length\n", lineno);
+    }
+
+    value ret;
+    ret.type = a->type;
+    if (a->type == TYPE_FLOAT)
+        ret.f32 = simd_dot_f32((float*)a->data, (float*)b->data, a->len);
+    else
+        ret.i32 = simd_dot_i32((int32_t*)a->data, (int32_t*)b->data, a->len);
+    return ret;
+}
+
+value vector_cross()
+{
+    value a = arg("a");
+    value b = arg("b");
+
+    value ret;
+    ret.type = TYPE_FLOAT3;
+    vec3_cross(ret.v4, a.v4, b.v4);
+    return ret;
+}
+
+// float3(x, y, z) & float4(x, y, z, w), other numbers are converted
+value new_vector(int type, value* args, int n)
+{
+    int lanes = type == TYPE_FLOAT3 ? 3 : 4;
+    if (n != lanes)
+    {
+        ERROR("(%d) %s takes %d components\n", lineno, type_name(type), lanes);
+    }
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = type;
+    for (int i = 0; i < n; i++)
+    {
+        if (IS_NUMBER(args[i].type))
+            ret.v4[i] = (float)number_f64(&args[i]);
+        else
+            ERROR("(%d) %s component must be a number\n", lineno, type_name(type));
+    }
+    return ret;
+}
+
+// del() takes entities and arrays
+value del_entity()
+{
+    value var = arg("e");
+    if (IS_ARRAY(var.type))
+    {
+        free_array(var.arr);
+    }
+    else if (var.type == TYPE_ENTITY)
+    {
+        entity* e = var.obj;
+        if (e->arch != NULL)
+        {
+            ecs_remove(e);
+        }
+        free_members(e->mbeg);
+        mem_free(e);
+    }
+    else
+    {
+        ERROR("(%d) can't delete %s\n", lineno, type_name(var.type));
+    }
+
+    value ret;
+    memset(&ret, 0, sizeof(value));
+    ret.type = TYPE_VOID;
+    return ret;
 }
\ No newline at end of file
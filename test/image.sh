@@ -0,0 +1,73 @@
+#!/bin/sh
+# a damaged foo.entc must not crash a run of foo.ent, the source is
+# lexed instead and the cache written again. a cache that can't be
+# written only gets a warning.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/a.ent" <<'END'
+int fib(int n)
+{
+    switch (n)
+    {
+    case 0: return 0;
+    case 1: return 1;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main()
+{
+    return fib(20);
+}
+END
+
+"$entity" --compile "$dir/a.ent" || exit 1
+cp "$dir/a.entc" "$dir/good.entc"
+size=$(wc -c < "$dir/good.entc")
+
+run() {
+    out=$("$entity" "$dir/a.ent")
+    if [ "$out" != "6765" ]; then
+        echo "FAIL $1: $out"
+        exit 1
+    fi
+}
+
+for n in 24 60 300 $((size / 2)) $((size - 1)); do
+    head -c $n "$dir/good.entc" > "$dir/a.entc"
+    run "truncated to $n"
+done
+cmp -s "$dir/a.entc" "$dir/good.entc" || { echo "FAIL cache not rewritten"; exit 1; }
+
+# n_tokens, the string count and the offset of the functions
+for off in 24 32 36; do
+    cp "$dir/good.entc" "$dir/a.entc"
+    printf '\377\377\377\177' | dd of="$dir/a.entc" bs=1 seek=$off conv=notrunc 2>/dev/null
+    run "header field at $off"
+done
+
+# a cache that can't be refreshed is a warning, the run goes on
+cp "$dir/good.entc" "$dir/a.entc"
+echo >> "$dir/a.ent"
+out=$( (trap '' XFSZ; ulimit -f 0; "$entity" "$dir/a.ent" 2>&1) )
+status=$?
+if [ $status -ne 0 ] || [ "$out" != "$(printf "6765\ncan't refresh $dir/a.entc, the source is lexed again next time")" ]; then
+    echo "FAIL unwritable cache: exit status $status, $out"
+    exit 1
+fi
+cmp -s "$dir/a.entc" "$dir/good.entc" || { echo "FAIL cache changed"; exit 1; }
+ls "$dir" | grep -q tmp && { echo "FAIL temp file left"; exit 1; }
+run "stale cache"
+cmp -s "$dir/a.entc" "$dir/good.entc" && { echo "FAIL stale cache not refreshed"; exit 1; }
+
+# running a damaged image is an error, not a crash
+head -c 300 "$dir/good.entc" > "$dir/b.entc"
+"$entity" "$dir/b.entc" > /dev/null 2>&1
+status=$?
+if [ $status -ne 255 ]; then
+    echo "FAIL damaged image exits with $status"
+    exit 1
+fi
+exit 0
@@ -0,0 +1,57 @@
+#!/bin/sh
+# sqrt() and the other intrinsics are found without linking, and a
+# function of the same name added by reload() takes their place.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# a streamed body is never linked
+cat > "$dir/a.ent" <<'END'
+int main()
+{
+    float x = 16.0;
+    sqrt(x);
+    return floor(sqrt(x));
+}
+END
+
+out=$("$entity" --stream "$dir/a.ent")
+if [ "$out" != "4" ]; then
+    echo "FAIL streamed intrinsic: $out"
+    exit 1
+fi
+
+cat > "$dir/b.ent" <<'END'
+float f(float x)
+{
+    return sqrt(x);
+}
+
+int main()
+{
+    int a = floor(f(16.0));
+    while (reload() == 0) { }
+    int b = floor(f(16.0));
+    return a * 10 + b;
+}
+END
+
+"$entity" "$dir/b.ent" > "$dir/out" &
+pid=$!
+sleep 1
+cp "$dir/b.ent" "$dir/new.ent"
+cat >> "$dir/new.ent" <<'END'
+
+float sqrt(float x)
+{
+    return 7.0;
+}
+END
+mv "$dir/new.ent" "$dir/b.ent"
+wait $pid
+out=$(cat "$dir/out")
+if [ "$out" != "47" ]; then
+    echo "FAIL sqrt added by reload: $out"
+    exit 1
+fi
+exit 0
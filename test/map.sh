@@ -0,0 +1,73 @@
+#!/bin/sh
+# --map frees the strings of a record after it, the ones a record keeps
+# in a global, a member or an array are copied out first.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/a.ent" <<'END'
+string first = "";
+string last = "";
+string grown = "";
+string[] names;
+entity prev;
+int n = 0;
+
+string f(string name, int x)
+{
+    string out = "";
+    if (n > 0) {
+        out = first + " " + last + " " + names[n - 1] + " " + prev.name + " " + len(grown);
+    }
+    entity e = new();
+    string e.name = name + "!";
+    prev = e;
+    if (n == 0) {
+        first = name;
+    }
+    last = name + "?";
+    grown = grown + "0123456789abcdefghij";
+    push(names, name);
+    n = n + 1;
+    string junk = name + name + name + name;
+    return out;
+}
+
+int main()
+{
+    return 0;
+}
+END
+
+awk 'BEGIN { for (i = 0; i < 3; i++) printf "record-%d-abcdefghijklmnopqrstuvwxyz-0123456789,%d\n", i, i }' > "$dir/a.csv"
+for mode in "" --ecs; do
+    out=$("$entity" $mode --map f "$dir/a.ent" < "$dir/a.csv" | tail -n 1)
+    r0=record-0-abcdefghijklmnopqrstuvwxyz-0123456789
+    r1=record-1-abcdefghijklmnopqrstuvwxyz-0123456789
+    if [ "$out" != "$r0 $r1? $r1 $r1! 40" ]; then
+        echo "FAIL kept strings $mode: $out"
+        exit 1
+    fi
+done
+
+# a million records of 46 char fields in 24MB, they took 47MB before
+cat > "$dir/b.ent" <<'END'
+string f(string s, int x)
+{
+    return s + "!";
+}
+
+int main()
+{
+    return 0;
+}
+END
+
+out=$(ulimit -v 24576
+    awk 'BEGIN { for (i = 0; i < 1000000; i++) printf "field-%08d-abcdefghijklmnopqrstuvwxyz-01234,%d\n", i, i }' |
+    "$entity" --map f "$dir/b.ent" | tail -n 1)
+if [ "$out" != "field-00999999-abcdefghijklmnopqrstuvwxyz-01234!" ]; then
+    echo "FAIL a million records: $out"
+    exit 1
+fi
+exit 0
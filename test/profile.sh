@@ -0,0 +1,71 @@
+#!/bin/sh
+# --profile prints a table of the functions and writes the collapsed
+# stacks next to the source, and a call that failed in a served
+# request isn't the parent of the calls of the next requests.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/a.ent" <<'END'
+int fib(int n)
+{
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main()
+{
+    return fib(10);
+}
+END
+
+cat > "$dir/b.ent" <<'END'
+int deep(int x)
+{
+    nosuch();
+    return x;
+}
+
+int bad(int x)
+{
+    return deep(x);
+}
+
+int leaf(int x)
+{
+    return x + 1;
+}
+
+int good(int x)
+{
+    return leaf(x);
+}
+END
+
+cd "$dir" || exit 1
+
+out=$("$entity" --profile a.ent 2>table)
+[ "$out" = "55" ] || { echo "FAIL fib: $out"; exit 1; }
+# fib(10) is called 177 times in all
+grep -q '^fib  *177 ' table || { echo "FAIL table:"; cat table; exit 1; }
+grep -q '^main  *1 ' table || { echo "FAIL table:"; cat table; exit 1; }
+grep -q 'collapsed stacks written to a.ent.folded' table || { echo "FAIL table:"; cat table; exit 1; }
+grep -q '^main [0-9][0-9]*$' a.ent.folded || { echo "FAIL folded:"; cat a.ent.folded; exit 1; }
+grep -q '^main;fib;fib;fib [0-9][0-9]*$' a.ent.folded || { echo "FAIL folded:"; cat a.ent.folded; exit 1; }
+# no stack is deeper than fib(10) recurses
+if grep -q '^main\(;fib\)\{11\} ' a.ent.folded; then
+    echo "FAIL folded:"; cat a.ent.folded; exit 1
+fi
+
+out=$(printf 'bad 1\ngood 2\ngood 3\n' | "$entity" --serve --profile b.ent 2>table)
+[ "$out" = "$(printf '!(3) no such function nosuch\n=3\n=4')" ] || { echo "FAIL serve: $out"; exit 1; }
+grep -q '^good  *2 ' table || { echo "FAIL serve table:"; cat table; exit 1; }
+grep -q '^good [0-9][0-9]*$' b.ent.folded || { echo "FAIL serve folded:"; cat b.ent.folded; exit 1; }
+grep -q '^good;leaf [0-9][0-9]*$' b.ent.folded || { echo "FAIL serve folded:"; cat b.ent.folded; exit 1; }
+if grep -q 'deep;' b.ent.folded; then
+    echo "FAIL serve folded:"; cat b.ent.folded; exit 1
+fi
+
+exit 0
@@ -0,0 +1,137 @@
+#!/bin/sh
+# a reload whose new globals fail to initialize changes nothing and is
+# tried again when the file is written again, even within the same
+# second. reload() in a parallel for is an error. a reload with --eager
+# waits for the functions to be compiled.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+main='int main()
+{
+    int a = f();
+    int r1 = reload();
+    while (r1 == 0) {
+        r1 = reload();
+    }
+    int b = f();
+    int r2 = reload();
+    while (r2 == 0) {
+        r2 = reload();
+    }
+    int r3 = reload();
+    while (r3 == 0) {
+        r3 = reload();
+    }
+    int c = f();
+    print("" + a + " " + r1 + " " + b + " " + r2 + " " + r3 + " " + c + " ");
+    return g();
+}'
+
+cat > "$dir/a.ent" <<END
+int f()
+{
+    return 1;
+}
+
+$main
+END
+
+cat > "$dir/broken.ent" <<END
+int h = nosuch();
+
+int f()
+{
+    return 2;
+}
+
+int g()
+{
+    return h;
+}
+
+$main
+END
+
+cat > "$dir/fixed.ent" <<END
+int h = 5;
+
+int f()
+{
+    return 3;
+}
+
+int g()
+{
+    return h;
+}
+
+$main
+END
+
+timeout 20 "$entity" "$dir/a.ent" > "$dir/out" 2> "$dir/err" &
+pid=$!
+sleep 1
+cp "$dir/broken.ent" "$dir/new.ent"
+mv "$dir/new.ent" "$dir/a.ent"
+sleep 0.5
+cp "$dir/broken.ent" "$dir/new.ent"
+mv "$dir/new.ent" "$dir/a.ent"
+sleep 0.5
+cp "$dir/fixed.ent" "$dir/new.ent"
+mv "$dir/new.ent" "$dir/a.ent"
+wait $pid
+out=$(cat "$dir/out")
+if [ "$out" != "1 -1 1 -1 2 3 5" ]; then
+    echo "FAIL failed initializer: $out"
+    cat "$dir/err"
+    exit 1
+fi
+
+# a reload with --eager doesn't change the functions under the thread
+# that compiles them
+i=0
+{
+    while [ $i -lt 20000 ]; do
+        echo "int f$i() { return $i; }"
+        i=$((i + 1))
+    done
+    echo 'int main()
+{
+    int r = reload();
+    while (r == 0) {
+        r = reload();
+    }
+    return f0() + r;
+}'
+} > "$dir/e.ent"
+timeout 20 "$entity" --eager "$dir/e.ent" > "$dir/out" 2> "$dir/err" &
+pid=$!
+sleep 1
+sed 's/^int f0() { return 0; }$/int f0() { return 7; }/' "$dir/e.ent" > "$dir/new.ent"
+mv "$dir/new.ent" "$dir/e.ent"
+wait $pid
+out=$(cat "$dir/out")
+if [ "$out" != "8" ]; then
+    echo "FAIL reload with --eager: $out"
+    cat "$dir/err"
+    exit 1
+fi
+
+cat > "$dir/b.ent" <<'END'
+int main()
+{
+    parallel for (int i = 0; i < 4) {
+        reload();
+    }
+    return 0;
+}
+END
+
+out=$(ENTITY_THREADS=2 "$entity" "$dir/b.ent" 2>&1)
+status=$?
+if [ $status -ne 255 ] || [ "$out" != "(4) reload() in a parallel for" ]; then
+    echo "FAIL reload in a parallel for: exit status $status, $out"
+    exit 1
+fi
+exit 0
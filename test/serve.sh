@@ -0,0 +1,107 @@
+#!/bin/sh
+# --serve takes a budget above 0, answers an error with '!' and goes
+# on, a request that fails inside a query doesn't leave it open, the
+# strings of a request are freed after it, and neither running out of
+# coroutine stacks nor a client that goes away kills the server.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/a.ent" <<'END'
+int fails(int x)
+{
+    entity e = new();
+    int e.x = x;
+    query (entity q : x) {
+        nosuch();
+    }
+    return 0;
+}
+
+int grows(int x)
+{
+    entity e = new();
+    int e.x = x;
+    int e.y = x;
+    return x;
+}
+
+coroutine count(int n)
+{
+    yield n;
+    return n;
+}
+
+int many(int n)
+{
+    int i = 0;
+    while (i < n) {
+        coroutine c = count(i);
+        resume(c);
+        i = i + 1;
+    }
+    return n;
+}
+
+int big(string s)
+{
+    string t = s;
+    int i = 0;
+    while (i < 7) {
+        t = t + t;
+        i = i + 1;
+    }
+    return len(t);
+}
+
+int main()
+{
+    return 0;
+}
+END
+
+# a budget is a number of ticks above 0
+for budget in abc 0 -5 " 5" 5x 99999999999999999999 ""; do
+    out=$(echo "grows 1" | "$entity" --serve --budget "$budget" "$dir/a.ent" 2>&1)
+    status=$?
+    if [ $status -ne 255 ] || [ "$out" != "--budget: $budget isn't a number of ticks above 0" ]; then
+        echo "FAIL --budget '$budget': exit status $status, $out"
+        exit 1
+    fi
+done
+
+for mode in "" "--budget 100"; do
+    out=$(printf 'nosuch 1\nfails 1\ngrows 2\n' | "$entity" --ecs --serve $mode "$dir/a.ent")
+    expected=$(printf '!no function nosuch\n!(6) no such function nosuch\n=2')
+    if [ "$out" != "$expected" ]; then
+        echo "FAIL errors $mode: $out"
+        exit 1
+    fi
+
+    # coroutine stacks run out, the request fails and the server goes on
+    out=$(ulimit -v 400000
+        printf 'many 100000\ngrows 3\n' | "$entity" --serve $mode "$dir/a.ent")
+    if [ "$(echo "$out" | cut -d: -f1)" != "$(printf '!failed to create coroutine\n=3')" ]; then
+        echo "FAIL out of coroutine stacks $mode: $out"
+        exit 1
+    fi
+
+    # 200000 requests of 2k strings in 24MB
+    out=$(ulimit -v 24576
+        awk 'BEGIN { for (i = 0; i < 200000; i++) print "big 0123456789abcdef" }' |
+        "$entity" --serve $mode "$dir/a.ent" | grep -c '^=2048$')
+    if [ "$out" != "200000" ]; then
+        echo "FAIL strings of a request $mode: $out"
+        exit 1
+    fi
+
+    # head leaves after the first answer, the others get EPIPE
+    status=$( { awk 'BEGIN { for (i = 0; i < 100000; i++) print "grows 1" }' |
+        "$entity" --serve $mode "$dir/a.ent"; echo $? > "$dir/status"; } | head -n 1 > /dev/null
+        cat "$dir/status")
+    if [ "$status" != "0" ]; then
+        echo "FAIL client gone $mode: exit status $status"
+        exit 1
+    fi
+done
+exit 0
@@ -0,0 +1,55 @@
+#!/bin/sh
+# --stats prints the counters after the result, every coroutine costs
+# the same allocations each time, and --profile doesn't add its own.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/a.ent" <<'END'
+coroutine count(int n)
+{
+    yield n;
+    return n;
+}
+
+int many(int n)
+{
+    int i = 0;
+    while (i < n) {
+        coroutine c = count(i);
+        resume(c);
+        i = i + 1;
+    }
+    return n;
+}
+
+int main()
+{
+    return many(10);
+}
+END
+sed 's/many(10)/many(110)/' "$dir/a.ent" > "$dir/b.ent"
+
+# the value of counter $2 in the output of a run
+stat() {
+    sed -n "s/^$2=//p" "$1"
+}
+
+"$entity" --stats "$dir/a.ent" > "$dir/a.out" 2> "$dir/a.err"
+[ "$(cat "$dir/a.out")" = "10" ] || { echo "FAIL result: $(cat "$dir/a.out")"; exit 1; }
+a=$(stat "$dir/a.err" allocs)
+f=$(stat "$dir/a.err" frees)
+[ -n "$a" ] && [ -n "$f" ] || { echo "FAIL counters:"; cat "$dir/a.err"; exit 1; }
+[ "$a" -gt 0 ] && [ "$a" -ge "$f" ] || { echo "FAIL allocs=$a frees=$f"; exit 1; }
+
+"$entity" --stats "$dir/b.ent" > /dev/null 2> "$dir/b.err"
+b=$(stat "$dir/b.err" allocs)
+g=$(stat "$dir/b.err" frees)
+[ $((b - a)) -gt 0 ] && [ $(((b - a) % 100)) -eq 0 ] || { echo "FAIL 100 coroutines: allocs $a -> $b"; exit 1; }
+[ $((g - f)) -gt 0 ] && [ $(((g - f) % 100)) -eq 0 ] || { echo "FAIL 100 coroutines: frees $f -> $g"; exit 1; }
+
+"$entity" --stats --profile "$dir/a.ent" > /dev/null 2> "$dir/p.err"
+p=$(stat "$dir/p.err" allocs)
+[ "$p" = "$a" ] || { echo "FAIL --profile: allocs $a -> $p"; exit 1; }
+
+exit 0
@@ -0,0 +1,60 @@
+#!/bin/sh
+# --stream lexes the source through a window a token at a time: a
+# source of several windows runs the same as without it, a string
+# longer than the window is lexed whole, a number too long for it is an
+# error.
+entity=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# about 3 windows of functions, main calls the first and the last
+i=0
+{
+    while [ $i -lt 30000 ]; do
+        echo "int f$i(int x) { # padding padding padding padding padding"
+        echo "    return x + $i;"
+        echo "}"
+        i=$((i + 1))
+    done
+    echo "int main() { return f1(1) + f29999(2); }"
+} > "$dir/a.ent"
+
+want=$("$entity" "$dir/a.ent" 2>&1)
+[ "$want" = "30003" ] || { echo "FAIL without --stream: $want"; exit 1; }
+got=$("$entity" --stream "$dir/a.ent" 2>&1)
+[ "$got" = "$want" ] || { echo "FAIL --stream: $got"; exit 1; }
+
+# a string of 3MB, after a window's worth of other tokens
+x=xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+{
+    head -n 30000 "$dir/a.ent"
+    printf 'int main() { string s = "'
+    i=0
+    while [ $i -lt 30000 ]; do
+        printf '%s' "$x"
+        i=$((i + 1))
+    done
+    echo '"; print(s); return f2(1); }'
+} > "$dir/b.ent"
+
+n=$("$entity" --stream "$dir/b.ent" 2>&1 | tr -d '\n' | tr -cd x | wc -c)
+[ "$n" -eq 3000000 ] || { echo "FAIL long string: $n"; exit 1; }
+tail=$("$entity" --stream "$dir/b.ent" 2>&1 | tail -c 2)
+[ "$tail" = "3" ] || { echo "FAIL after the long string: $tail"; exit 1; }
+
+# a number longer than the window
+{
+    printf 'int main() { return 1.'
+    i=0
+    while [ $i -lt 12000 ]; do
+        printf '%s' "0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        i=$((i + 1))
+    done
+    echo '; }'
+    head -n 30000 "$dir/a.ent"
+} > "$dir/c.ent"
+
+out=$("$entity" --stream "$dir/c.ent" 2>&1)
+[ "$out" = "(1) number too long" ] || { echo "FAIL long number: $out"; exit 1; }
+
+exit 0